@@ -0,0 +1,263 @@
+/**
+ * Host microbenchmarks for the intersection and sampling routines in
+ * intersections.h and interactions.h.
+ *
+ * Usage: path_tracer_benchmark [rays per batch]
+ *
+ * Every intersection test is run on three generated ray batches: hit-heavy
+ * (rays aimed well inside the primitive's silhouette), grazing (aimed at its
+ * silhouette) and miss-heavy (aimed well outside of it). Each benchmark is
+ * repeated and the fastest run is reported, in ns per call and millions of
+ * calls per second.
+ */
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <thrust/random.h>
+#include <glm/gtc/matrix_inverse.hpp>
+
+#include "sceneStructs.h"
+#include "utilities.h"
+#include "intersections.h"
+#include "interactions.h"
+
+namespace {
+
+const int numRuns = 5;
+
+// keeps results alive so the compiler can't drop the calls being timed
+volatile float sink;
+
+enum RayDistribution
+{
+    RAYS_HIT,
+    RAYS_GRAZING,
+    RAYS_MISS,
+    NUM_RAY_DISTRIBUTIONS
+};
+
+const char* distributionNames[NUM_RAY_DISTRIBUTIONS] = { "hit", "grazing", "miss" };
+
+/**
+ * Rays from random points around a primitive, aimed at points offset from its
+ * center perpendicular to the ray by a fraction of `radius`, the radius of
+ * the primitive's silhouette: [0, .7] for hits, [.95, 1.05] for grazing rays,
+ * [1.5, 3] for misses.
+ */
+std::vector<Ray> generateRays(int n, RayDistribution distribution, glm::vec3 center, float radius, unsigned int seed)
+{
+    static const float offsetRange[NUM_RAY_DISTRIBUTIONS][2] = { { 0.f, .7f }, { .95f, 1.05f }, { 1.5f, 3.f } };
+
+    thrust::default_random_engine rng(seed);
+    thrust::uniform_real_distribution<float> u01(0, 1);
+    std::vector<Ray> rays(n);
+    for (int i = 0; i < n; ++i)
+    {
+        glm::vec3 toOrigin = calculateRandomDirectionInHemisphere(u01(rng) < .5f ? glm::vec3(0, 0, 1) : glm::vec3(0, 0, -1), rng);
+        glm::vec3 origin = center + 5.f * radius * toOrigin;
+
+        glm::vec3 perp = glm::normalize(glm::cross(toOrigin, glm::abs(toOrigin.x) < .9f ? glm::vec3(1, 0, 0) : glm::vec3(0, 1, 0)));
+        float angle = u01(rng) * TWO_PI;
+        perp = glm::cos(angle) * perp + glm::sin(angle) * glm::cross(toOrigin, perp);
+        float offset = glm::mix(offsetRange[distribution][0], offsetRange[distribution][1], u01(rng));
+
+        rays[i].origin = origin;
+        rays[i].direction = glm::normalize(center + offset * radius * perp - origin);
+    }
+    return rays;
+}
+
+Geom makeGeom(GeomType type, glm::vec3 translation, glm::vec3 rotation, glm::vec3 scale)
+{
+    Geom geom;
+    geom.type = type;
+    geom.materialid = 0;
+    geom.transform = utilityCore::buildTransformationMatrix(translation, rotation, scale);
+    geom.inverseTransform = glm::inverse(geom.transform);
+    geom.invTranspose = glm::inverseTranspose(geom.transform);
+    return geom;
+}
+
+/**
+ * Runs `body` over calls [0, n) numRuns times and prints the fastest run.
+ * body(i, hit) returns a value that is folded into `sink`, and sets whether
+ * the call hit, which is reported if showHits is set.
+ */
+template <typename Body>
+void report(const char* name, const char* distribution, int n, const Body& body, bool showHits = true)
+{
+    double best = 1e30;
+    int hits = 0;
+    for (int run = 0; run < numRuns; ++run)
+    {
+        float acc = 0.f;
+        hits = 0;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < n; ++i)
+        {
+            bool hit = false;
+            acc += body(i, hit);
+            hits += hit;
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        sink = acc;
+        best = std::min(best, std::chrono::duration<double, std::nano>(end - start).count());
+    }
+    double nsPerCall = best / n;
+    printf("%-40s %-8s %9.2f ns %10.2f M/s", name, distribution, nsPerCall, 1e3 / nsPerCall);
+    if (showHits)
+    {
+        printf(" %7.1f%%", 100.0 * hits / n);
+    }
+    printf("\n");
+}
+
+/**
+ * Times test(ray, hit) on every ray distribution. `radius` is the radius of
+ * the primitive's silhouette around `center`.
+ */
+template <typename Test>
+void benchmarkIntersection(const char* name, int n, glm::vec3 center, float radius, const Test& test)
+{
+    for (int d = 0; d < NUM_RAY_DISTRIBUTIONS; ++d)
+    {
+        std::vector<Ray> rays = generateRays(n, (RayDistribution)d, center, radius, 1234u + d);
+        report(name, distributionNames[d], n, [&](int i, bool& hit)
+        {
+            return test(rays[i], hit);
+        });
+    }
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    const int n = argc > 1 ? std::max(1, atoi(argv[1])) : 1 << 20;
+    printf("%d calls per run, best of %d runs\n\n", n, numRuns);
+    printf("%-40s %-8s %12s %14s %8s\n", "function", "rays", "time", "throughput", "hits");
+
+    glm::vec3 center(1.f, 2.f, -3.f);
+    Geom sphere = makeGeom(SPHERE, center, glm::vec3(10.f, 20.f, 30.f), glm::vec3(2.f));
+    Geom cube = makeGeom(CUBE, center, glm::vec3(10.f, 20.f, 30.f), glm::vec3(2.f));
+    Geom mesh = makeGeom(MESH, center, glm::vec3(0.f), glm::vec3(1.f));
+
+    Triangle tri;
+    tri.pos[0] = glm::vec3(-1.f, -1.f, 0.f);
+    tri.pos[1] = glm::vec3(1.f, -1.f, 0.f);
+    tri.pos[2] = glm::vec3(0.f, 1.f, 0.f);
+    for (int v = 0; v < 3; ++v)
+    {
+        tri.normal[v] = glm::vec3(0.f, 0.f, 1.f);
+        tri.uv[v] = glm::vec2(tri.pos[v]) * .5f + .5f;
+        tri.tangent[v] = glm::vec4(1.f, 0.f, 0.f, 1.f);
+    }
+
+    AABB aabb;
+    aabb.bound[0] = center - glm::vec3(1.f);
+    aabb.bound[1] = center + glm::vec3(1.f);
+
+    Material plain = {};
+    plain.color = glm::vec3(.8f);
+    plain.indexOfRefraction = 1.f;
+
+    benchmarkIntersection("boxIntersectionTest", n, center, 1.35f, [&](const Ray& r, bool& hit)
+    {
+        glm::vec3 p, nrm;
+        bool outside;
+        float t = boxIntersectionTest(cube, r, p, nrm, outside);
+        hit = t > 0.f;
+        return t;
+    });
+    benchmarkIntersection("sphereIntersectionTest", n, center, 1.f, [&](const Ray& r, bool& hit)
+    {
+        glm::vec3 p, nrm;
+        bool outside;
+        float t = sphereIntersectionTest(sphere, r, p, nrm, outside);
+        hit = t > 0.f;
+        return t;
+    });
+    benchmarkIntersection("triangleIntersectionTest", n, center, .45f, [&](const Ray& r, bool& hit)
+    {
+        glm::vec3 p, nrm;
+        glm::vec2 uv;
+        float t = triangleIntersectionTest<FEATURE_ALL>(mesh, tri, r, plain, nullptr, p, nrm, uv);
+        hit = t > 0.f;
+        return t;
+    });
+    PackedTriangle packedTri = packTriangle(tri);
+    benchmarkIntersection("triangleIntersectionTest (packed)", n, center, .45f, [&](const Ray& r, bool& hit)
+    {
+        glm::vec3 p, nrm;
+        glm::vec2 uv;
+        float t = triangleIntersectionTest<FEATURE_ALL>(mesh, packedTri, r, plain, nullptr, p, nrm, uv);
+        hit = t > 0.f;
+        return t;
+    });
+    benchmarkIntersection("aabbIntersectionTest", n, center, 1.35f, [&](const Ray& r, bool& hit)
+    {
+        hit = aabbIntersectionTest(aabb, r);
+        return hit ? 1.f : 0.f;
+    });
+
+    printf("\n");
+
+    // sampling: normals and random engines are prepared up front
+    std::vector<glm::vec3> normals(n);
+    {
+        thrust::default_random_engine rng(42u);
+        for (int i = 0; i < n; ++i)
+        {
+            normals[i] = calculateRandomDirectionInHemisphere(glm::vec3(0.f, 1.f, 0.f), rng);
+        }
+    }
+
+    thrust::default_random_engine rng(7u);
+    report("calculateRandomDirectionInHemisphere", "-", n, [&](int i, bool& hit)
+    {
+        return calculateRandomDirectionInHemisphere(normals[i], rng).x;
+    }, false);
+
+    std::vector<glm::vec3> texData(16 * 16, glm::vec3(.5f));
+    Material diffuse = plain;
+    Material textured = plain;
+    textured.tex.offset = 0;
+    textured.tex.width = 16;
+    textured.tex.height = 16;
+    Material reflective = plain;
+    reflective.hasReflective = 1.f;
+    reflective.specular.color = glm::vec3(.9f);
+    Material refractive = reflective;
+    refractive.hasRefractive = 1.f;
+    refractive.indexOfRefraction = 1.5f;
+
+    const struct
+    {
+        const char* name;
+        const Material* material;
+    } bsdfs[] = {
+        { "diffuse", &diffuse },
+        { "textured", &textured },
+        { "reflect", &reflective },
+        { "refract", &refractive },
+    };
+
+    std::vector<Ray> rays = generateRays(n, RAYS_HIT, glm::vec3(0.f), 1.f, 99u);
+    for (const auto& bsdf : bsdfs)
+    {
+        report("scatterRay", bsdf.name, n, [&](int i, bool& hit)
+        {
+            PathSegment path;
+            path.ray = rays[i];
+            path.color = glm::vec3(1.f);
+            glm::vec3 nrm = glm::dot(normals[i], rays[i].direction) > 0.f ? -normals[i] : normals[i];
+            scatterRay<FEATURE_ALL>(path, rays[i].origin, nrm, glm::vec2(.25f, .75f), *bsdf.material, texData.data(), rng);
+            return path.ray.direction.x + path.color.x;
+        }, false);
+    }
+
+    return 0;
+}
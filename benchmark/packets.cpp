@@ -0,0 +1,177 @@
+/**
+ * Times the host ray packets in src/packet.h against tracing the same rays
+ * one at a time, and checks that both find the same hits.
+ *
+ * Usage: packet_benchmark [scene files...]
+ *
+ * For each scene three batches are traced: camera rays through every pixel,
+ * ordered in tiles of RAY_PACKET_SIZE pixels; shadow rays from their hits to
+ * the first emitter; and mirror bounces off the same hits. Each batch is run
+ * numRuns times and the fastest run is reported. Without arguments the scenes
+ * in ../scenes are used. Packets are only traced when the host compiler
+ * targets AVX2 or AVX-512; see PATH_TRACER_HOST_SIMD in CMakeLists.txt.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#include "scene.h"
+#include "packet.h"
+
+namespace {
+
+const int numRuns = 5;
+
+const char* defaultScenes[] = {
+    "../scenes/cornell.txt",
+    "../scenes/cornell_open.txt",
+    "../scenes/boxtextured.txt"
+};
+
+// Camera rays through pixel centers, tile by tile, so that each packet
+// covers a compact block of the image. The basis is rebuilt from the view
+// and up vectors, as main.cpp does before the first frame.
+std::vector<Ray> cameraRays(const Camera &cam) {
+    const glm::vec3 right = glm::normalize(glm::cross(cam.view, cam.up));
+    const glm::vec3 up = glm::cross(right, cam.view);
+    const int tileW = 4;
+    const int tileH = RAY_PACKET_SIZE / tileW;
+    std::vector<Ray> rays;
+    rays.reserve(cam.resolution.x * cam.resolution.y);
+    for (int ty = 0; ty < cam.resolution.y; ty += tileH) {
+        for (int tx = 0; tx < cam.resolution.x; tx += tileW) {
+            for (int y = ty; y < std::min(ty + tileH, cam.resolution.y); ++y) {
+                for (int x = tx; x < std::min(tx + tileW, cam.resolution.x); ++x) {
+                    Ray r;
+                    r.origin = cam.position;
+                    r.direction = glm::normalize(cam.view
+                        - right * cam.pixelLength.x * ((float)x - (float)cam.resolution.x * 0.5f)
+                        - up * cam.pixelLength.y * ((float)y - (float)cam.resolution.y * 0.5f));
+                    rays.push_back(r);
+                }
+            }
+        }
+    }
+    return rays;
+}
+
+// World space geometric normal at a hit.
+glm::vec3 hitNormal(const Scene &scene, const Ray &r, const HostHit &hit) {
+    const Geom &geom = scene.geoms[hit.geomIdx];
+    glm::vec3 p = glm::vec3(geom.inverseTransform * glm::vec4(r.origin + hit.t * r.direction, 1.f));
+    glm::vec3 n;
+    if (geom.type == SPHERE) {
+        n = p;
+    } else if (geom.type == CUBE) {
+        glm::vec3 a = glm::abs(p);
+        int axis = a.x > a.y ? (a.x > a.z ? 0 : 2) : (a.y > a.z ? 1 : 2);
+        n = glm::vec3(0.f);
+        n[axis] = p[axis] < 0.f ? -1.f : 1.f;
+    } else {
+        const Triangle &tri = scene.triangles[hit.triIdx];
+        n = glm::cross(tri.pos[1] - tri.pos[0], tri.pos[2] - tri.pos[0]);
+    }
+    return glm::normalize(glm::vec3(geom.invTranspose * glm::vec4(n, 0.f)));
+}
+
+template <typename Fn>
+float bestMs(const Fn &fn) {
+    float best = 1e30f;
+    for (int run = 0; run < numRuns; ++run) {
+        auto start = std::chrono::high_resolution_clock::now();
+        fn();
+        auto end = std::chrono::high_resolution_clock::now();
+        best = std::min(best, std::chrono::duration<float, std::milli>(end - start).count());
+    }
+    return best;
+}
+
+void benchmarkBatch(const Scene &scene, const char *name, const std::vector<Ray> &rays, bool anyHit, float tMax,
+                    std::vector<HostHit> &hits) {
+    const int n = rays.size();
+    hits.resize(n);
+    std::vector<HostHit> single(n);
+    int packetRays = 0;
+    float singleMs = bestMs([&]() { intersectRaysHostSingle(scene, rays.data(), n, single.data(), anyHit, tMax); });
+    float packetMs = bestMs([&]() { packetRays = intersectRaysHost(scene, rays.data(), n, hits.data(), anyHit, tMax); });
+
+    // closest hits may differ in geom where two surfaces meet at the same t,
+    // so their distances are compared instead. Where the compiler contracts
+    // the two paths into fused multiply-adds differently, a few rays grazing
+    // a box edge can also disagree on whether they hit it.
+    int mismatches = 0;
+    for (int i = 0; i < n; ++i) {
+        bool hitA = single[i].geomIdx >= 0;
+        bool hitB = hits[i].geomIdx >= 0;
+        if (hitA != hitB || (!anyHit && hitA && fabsf(single[i].t - hits[i].t) > 1e-4f * single[i].t)) {
+            ++mismatches;
+        }
+    }
+    printf("  %-8s %9d %10.3f ms %10.3f ms %7.2fx %6.1f%% in packets, %d mismatches\n", name, n, singleMs,
+           packetMs, packetMs > 0.f ? singleMs / packetMs : 0.f, n > 0 ? 100.f * packetRays / n : 0.f, mismatches);
+}
+
+void benchmarkScene(const char *filename) {
+    Scene *scene = new Scene(filename);
+    const Camera &cam = scene->state.camera;
+    printf("%s: %dx%d, %zu geoms, %zu triangles, %d-ray packets%s\n", filename, cam.resolution.x,
+           cam.resolution.y, scene->geoms.size(), scene->triangles.size(), RAY_PACKET_SIZE,
+           RAY_PACKET_SIMD ? "" : " (no SIMD, single rays only)");
+    printf("  %-8s %9s %13s %13s %8s\n", "batch", "rays", "single", "packets", "speedup");
+
+    std::vector<Ray> primary = cameraRays(cam);
+    std::vector<HostHit> primaryHits;
+    benchmarkBatch(*scene, "camera", primary, false, FLT_MAX, primaryHits);
+
+    int emitter = -1;
+    for (int g = 0; g < (int)scene->geoms.size() && emitter < 0; ++g) {
+        if (scene->materials[scene->geoms[g].materialid].emittance > 0.f) {
+            emitter = g;
+        }
+    }
+    glm::vec3 lightPos = emitter >= 0 ? glm::vec3(scene->geoms[emitter].transform[3]) : cam.position;
+
+    // shadow rays reach the light's center at t = 1
+    std::vector<Ray> shadow, mirror;
+    for (size_t i = 0; i < primary.size(); ++i) {
+        const HostHit &hit = primaryHits[i];
+        if (hit.geomIdx < 0 || hit.geomIdx == emitter) {
+            continue;
+        }
+        const Ray &r = primary[i];
+        glm::vec3 n = hitNormal(*scene, r, hit);
+        glm::vec3 p = r.origin + hit.t * r.direction + 1e-3f * n;
+
+        Ray s;
+        s.origin = p;
+        s.direction = lightPos - p;
+        shadow.push_back(s);
+
+        Ray m;
+        m.origin = p;
+        m.direction = glm::reflect(r.direction, n);
+        mirror.push_back(m);
+    }
+    std::vector<HostHit> hits;
+    benchmarkBatch(*scene, "shadow", shadow, true, 1.f, hits);
+    benchmarkBatch(*scene, "mirror", mirror, false, FLT_MAX, hits);
+    printf("\n");
+}
+
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        for (int i = 1; i < argc; ++i) {
+            benchmarkScene(argv[i]);
+        }
+    } else {
+        for (const char *filename : defaultScenes) {
+            benchmarkScene(filename);
+        }
+    }
+    return 0;
+}
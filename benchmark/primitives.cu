@@ -0,0 +1,219 @@
+/**
+ * Times the device partition and sort-by-key in stream_compaction/primitives.h
+ * against the thrust calls they replace in the path tracer's bounce loop.
+ *
+ * Usage: primitives_benchmark [scene files...]
+ *
+ * For each scene the path count is its camera resolution and the key range is
+ * its number of materials. Stream compaction is timed at the surviving
+ * fractions of a few bounces (every path alive, then 80%, 50% and 20%
+ * remaining), the material sort on all paths. Each operation is run numRuns
+ * times on fresh data and the fastest run is reported. Without arguments the
+ * scenes in ../scenes are used.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thrust/execution_policy.h>
+#include <thrust/partition.h>
+#include <thrust/sort.h>
+
+#include "sceneStructs.h"
+#include "../stream_compaction/primitives.h"
+
+namespace {
+
+const int numRuns = 5;
+
+const char* defaultScenes[] = {
+    "../scenes/cornell.txt",
+    "../scenes/cornell_open.txt",
+    "../scenes/sphere.txt",
+    "../scenes/boxtextured.txt",
+    "../scenes/title_sample.txt"
+};
+
+const float survivingFractions[] = { 1.f, .8f, .5f, .2f };
+
+struct SceneSize {
+    std::string name;
+    int pixels = 0;
+    int materials = 0;
+};
+
+bool readSceneSize(const char *filename, SceneSize &size) {
+    std::ifstream file(filename);
+    if (!file) {
+        return false;
+    }
+    size.name = filename;
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream tokens(line);
+        std::string token;
+        tokens >> token;
+        if (token == "MATERIAL") {
+            size.materials++;
+        } else if (token == "RES") {
+            int x = 0, y = 0;
+            tokens >> x >> y;
+            size.pixels = x * y;
+        }
+    }
+    return size.pixels > 0;
+}
+
+template <typename Fn>
+float timeMs(const Fn &fn) {
+    cudaEvent_t start, end;
+    cudaEventCreate(&start);
+    cudaEventCreate(&end);
+    cudaEventRecord(start);
+    fn();
+    cudaEventRecord(end);
+    cudaEventSynchronize(end);
+    float ms = 0.f;
+    cudaEventElapsedTime(&ms, start, end);
+    cudaEventDestroy(start);
+    cudaEventDestroy(end);
+    return ms;
+}
+
+void printRow(const char *name, int n, float thrustMs, float primitivesMs) {
+    printf("  %-22s %9d %10.3f ms %10.3f ms %7.2fx\n", name, n, thrustMs, primitivesMs,
+           primitivesMs > 0.f ? thrustMs / primitivesMs : 0.f);
+}
+
+__global__ void kernMaterialKeys(int n, const ShadeableIntersection *isects, int *keys, int *indices) {
+    int index = threadIdx.x + blockIdx.x * blockDim.x;
+    if (index < n) {
+        keys[index] = isects[index].materialId + 1;
+        indices[index] = index;
+    }
+}
+
+__global__ void kernGather(int n, const int *indices, const PathSegment *srcPaths,
+                           const ShadeableIntersection *srcIsects, PathSegment *dstPaths,
+                           ShadeableIntersection *dstIsects) {
+    int index = threadIdx.x + blockIdx.x * blockDim.x;
+    if (index < n) {
+        dstPaths[index] = srcPaths[indices[index]];
+        dstIsects[index] = srcIsects[indices[index]];
+    }
+}
+
+void benchmarkScene(const SceneSize &scene, std::mt19937 &rng) {
+    using namespace StreamCompaction;
+    const int n = scene.pixels;
+    const int blockSize = 128;
+    const dim3 blocks((n + blockSize - 1) / blockSize);
+
+    printf("%s: %d paths, %d materials\n", scene.name.c_str(), n, scene.materials);
+
+    PathSegment *dev_paths, *dev_pathsScratch;
+    ShadeableIntersection *dev_isects, *dev_isectsScratch;
+    int *dev_keys, *dev_keysScratch, *dev_indices, *dev_indicesScratch;
+    cudaMalloc(&dev_paths, n * sizeof(PathSegment));
+    cudaMalloc(&dev_pathsScratch, n * sizeof(PathSegment));
+    cudaMalloc(&dev_isects, n * sizeof(ShadeableIntersection));
+    cudaMalloc(&dev_isectsScratch, n * sizeof(ShadeableIntersection));
+    cudaMalloc(&dev_keys, n * sizeof(int));
+    cudaMalloc(&dev_keysScratch, n * sizeof(int));
+    cudaMalloc(&dev_indices, n * sizeof(int));
+    cudaMalloc(&dev_indicesScratch, n * sizeof(int));
+    Primitives::Workspace workspace = Primitives::createWorkspace(n);
+
+    std::vector<PathSegment> paths(n);
+    std::vector<ShadeableIntersection> isects(n);
+    std::uniform_real_distribution<float> u01(0.f, 1.f);
+    std::uniform_int_distribution<int> materials(0, std::max(0, scene.materials - 1));
+
+    for (float fraction : survivingFractions) {
+        for (int i = 0; i < n; ++i) {
+            paths[i].pixelIndex = i;
+            paths[i].remainingBounces = u01(rng) < fraction ? 1 : 0;
+        }
+        float thrustMs = 1e30f, primitivesMs = 1e30f;
+        int thrustCount = 0, primitivesCount = 0;
+        for (int run = 0; run < numRuns; ++run) {
+            cudaMemcpy(dev_paths, paths.data(), n * sizeof(PathSegment), cudaMemcpyHostToDevice);
+            thrustMs = std::min(thrustMs, timeMs([&] {
+                thrustCount = (int)(thrust::partition(thrust::device, dev_paths, dev_paths + n, pathRemains()) - dev_paths);
+            }));
+            cudaMemcpy(dev_paths, paths.data(), n * sizeof(PathSegment), cudaMemcpyHostToDevice);
+            primitivesMs = std::min(primitivesMs, timeMs([&] {
+                primitivesCount = Primitives::partition(n, dev_paths, dev_pathsScratch, pathRemains(), workspace);
+            }));
+        }
+        char name[64];
+        snprintf(name, sizeof(name), "partition %3d%% alive", (int)(fraction * 100.f + .5f));
+        printRow(name, n, thrustMs, primitivesMs);
+        if (thrustCount != primitivesCount) {
+            printf("  MISMATCH: %d paths remain with thrust, %d with primitives\n", thrustCount, primitivesCount);
+        }
+    }
+
+    for (int i = 0; i < n; ++i) {
+        isects[i].materialId = materials(rng);
+    }
+    const int keyBits = ilog2ceil(scene.materials + 1);
+    float thrustMs = 1e30f, primitivesMs = 1e30f;
+    for (int run = 0; run < numRuns; ++run) {
+        cudaMemcpy(dev_paths, paths.data(), n * sizeof(PathSegment), cudaMemcpyHostToDevice);
+        cudaMemcpy(dev_isects, isects.data(), n * sizeof(ShadeableIntersection), cudaMemcpyHostToDevice);
+        thrustMs = std::min(thrustMs, timeMs([&] {
+            thrust::sort_by_key(thrust::device, dev_isects, dev_isects + n, dev_paths);
+        }));
+        cudaMemcpy(dev_isects, isects.data(), n * sizeof(ShadeableIntersection), cudaMemcpyHostToDevice);
+        primitivesMs = std::min(primitivesMs, timeMs([&] {
+            kernMaterialKeys<<<blocks, blockSize>>>(n, dev_isects, dev_keys, dev_indices);
+            Primitives::sortByKey(n, dev_keys, dev_indices, dev_keysScratch, dev_indicesScratch, keyBits, workspace);
+            kernGather<<<blocks, blockSize>>>(n, dev_indices, dev_paths, dev_isects, dev_pathsScratch, dev_isectsScratch);
+        }));
+    }
+    printRow("material sort", n, thrustMs, primitivesMs);
+
+    std::vector<int> sortedKeys(n);
+    cudaMemcpy(sortedKeys.data(), dev_keys, n * sizeof(int), cudaMemcpyDeviceToHost);
+    if (!std::is_sorted(sortedKeys.begin(), sortedKeys.end())) {
+        printf("  MISMATCH: material keys are not sorted\n");
+    }
+    printf("\n");
+
+    Primitives::freeWorkspace(workspace);
+    cudaFree(dev_paths);
+    cudaFree(dev_pathsScratch);
+    cudaFree(dev_isects);
+    cudaFree(dev_isectsScratch);
+    cudaFree(dev_keys);
+    cudaFree(dev_keysScratch);
+    cudaFree(dev_indices);
+    cudaFree(dev_indicesScratch);
+}
+
+}
+
+int main(int argc, char **argv) {
+    std::vector<const char*> filenames(argv + 1, argv + argc);
+    if (filenames.empty()) {
+        filenames.assign(std::begin(defaultScenes), std::end(defaultScenes));
+    }
+
+    printf("  %-22s %9s %13s %13s %8s\n", "operation", "paths", "thrust", "primitives", "speedup");
+    std::mt19937 rng(1234);
+    for (const char *filename : filenames) {
+        SceneSize scene;
+        if (!readSceneSize(filename, scene)) {
+            printf("%s: can't read a camera resolution, skipped\n\n", filename);
+            continue;
+        }
+        benchmarkScene(scene, rng);
+    }
+    return 0;
+}
@@ -0,0 +1,133 @@
+/**
+ * Compares the multithreaded host scan, compaction, partition and radix sort
+ * in stream_compaction/parallel.h with the serial versions.
+ *
+ * Usage: stream_compaction_benchmark [max elements]
+ *
+ * Sizes go from 1K up to max elements (default 100M) in steps of 10x. There
+ * is no serial radix sort in stream_compaction, so std::stable_sort and
+ * std::stable_partition are the serial references for sorting and
+ * partitioning.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "sceneStructs.h"
+#include "../stream_compaction/cpu.h"
+#include "../stream_compaction/parallel.h"
+
+namespace {
+
+// PathSegment arrays are capped at this size to bound memory use
+const int maxPathSegments = 1 << 24;
+
+template <typename Fn>
+float timeMs(const Fn &fn) {
+    auto start = std::chrono::high_resolution_clock::now();
+    fn();
+    auto end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<float, std::milli>(end - start).count();
+}
+
+void printRow(const char *name, int n, float serialMs, float parallelMs, bool match) {
+    printf("%-10s %11d %12.3f ms %12.3f ms %8.2fx%s\n", name, n, serialMs, parallelMs,
+           parallelMs > 0.f ? serialMs / parallelMs : 0.f, match ? "" : "  MISMATCH");
+}
+
+struct NonZero {
+    bool operator()(int x) const {
+        return x != 0;
+    }
+};
+
+struct IntKey {
+    unsigned int operator()(int x) const {
+        return (unsigned int)x;
+    }
+};
+
+}
+
+int main(int argc, char **argv) {
+    using namespace StreamCompaction;
+
+    const long long maxN = argc > 1 ? std::max(1000LL, atoll(argv[1])) : 100000000LL;
+    printf("%d threads\n\n", Parallel::numThreads());
+    printf("%-10s %11s %15s %15s %9s\n", "operation", "elements", "serial", "parallel", "speedup");
+
+    std::mt19937 rng(1234);
+    for (long long size = 1000; size <= maxN; size *= 10) {
+        const int n = (int)size;
+
+        std::vector<int> idata(n);
+        std::uniform_int_distribution<int> values(0, 3);
+        for (int &x : idata) {
+            x = values(rng);
+        }
+        std::vector<int> serialOut(n);
+        std::vector<int> parallelOut(n);
+
+        CPU::scan(n, serialOut.data(), idata.data());
+        float serialMs = CPU::timer().getCpuElapsedTimeForPreviousOperation();
+        Parallel::scan(n, parallelOut.data(), idata.data());
+        float parallelMs = Parallel::timer().getCpuElapsedTimeForPreviousOperation();
+        printRow("scan", n, serialMs, parallelMs, serialOut == parallelOut);
+
+        int serialCount = CPU::compactWithoutScan(n, serialOut.data(), idata.data());
+        serialMs = CPU::timer().getCpuElapsedTimeForPreviousOperation();
+        int parallelCount = Parallel::compact(n, parallelOut.data(), idata.data(), NonZero());
+        parallelMs = Parallel::timer().getCpuElapsedTimeForPreviousOperation();
+        printRow("compact", n, serialMs, parallelMs, serialCount == parallelCount
+                 && std::equal(serialOut.begin(), serialOut.begin() + serialCount, parallelOut.begin()));
+
+        serialCount = CPU::compactWithScan(n, serialOut.data(), idata.data());
+        serialMs = CPU::timer().getCpuElapsedTimeForPreviousOperation();
+        parallelCount = Parallel::compact(n, parallelOut.data(), idata.data(), NonZero());
+        parallelMs = Parallel::timer().getCpuElapsedTimeForPreviousOperation();
+        printRow("compact*", n, serialMs, parallelMs, serialCount == parallelCount
+                 && std::equal(serialOut.begin(), serialOut.begin() + serialCount, parallelOut.begin()));
+
+        std::uniform_int_distribution<int> keys(0, (1 << 30) - 1);
+        for (int &x : idata) {
+            x = keys(rng);
+        }
+        serialOut = idata;
+        parallelOut = idata;
+        std::vector<int> scratch(n);
+        serialMs = timeMs([&] { std::stable_sort(serialOut.begin(), serialOut.end()); });
+        Parallel::radixSort(n, parallelOut.data(), scratch.data(), IntKey(), 30);
+        parallelMs = Parallel::timer().getCpuElapsedTimeForPreviousOperation();
+        printRow("sort", n, serialMs, parallelMs, serialOut == parallelOut);
+
+        if (n <= maxPathSegments) {
+            std::vector<PathSegment> paths(n);
+            std::uniform_int_distribution<int> bounces(0, 2);
+            for (int i = 0; i < n; ++i) {
+                paths[i].pixelIndex = i;
+                paths[i].remainingBounces = bounces(rng);
+            }
+            std::vector<PathSegment> serialPaths = paths;
+            std::vector<PathSegment> pathScratch(n);
+            int serialRemaining = 0;
+            serialMs = timeMs([&] {
+                serialRemaining = (int)(std::stable_partition(serialPaths.begin(), serialPaths.end(), pathRemains())
+                                        - serialPaths.begin());
+            });
+            int parallelRemaining = Parallel::partition(n, paths.data(), pathScratch.data(), pathRemains());
+            parallelMs = Parallel::timer().getCpuElapsedTimeForPreviousOperation();
+            bool match = serialRemaining == parallelRemaining;
+            for (int i = 0; i < n && match; ++i) {
+                match = serialPaths[i].pixelIndex == paths[i].pixelIndex;
+            }
+            printRow("partition", n, serialMs, parallelMs, match);
+        }
+        printf("\n");
+    }
+
+    printf("compact* is CPU::compactWithScan against a second run of the parallel compaction.\n");
+    return 0;
+}
@@ -0,0 +1,164 @@
+#include <algorithm>
+#include <glm/gtc/matrix_inverse.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "animation.h"
+#include "utilities.h"
+
+namespace {
+
+// Index of the key at or before t and the blend factor towards the next one.
+int findKey(const std::vector<float>& times, float t, float& blend)
+{
+    blend = 0.f;
+    if (times.empty() || t <= times.front())
+    {
+        return 0;
+    }
+    if (t >= times.back())
+    {
+        return (int)times.size() - 1;
+    }
+    int k = (int)(std::upper_bound(times.begin(), times.end(), t) - times.begin()) - 1;
+    float span = times[k + 1] - times[k];
+    blend = span > 0.f ? (t - times[k]) / span : 0.f;
+    return k;
+}
+
+glm::quat toQuat(glm::vec4 xyzw)
+{
+    return glm::quat(xyzw.w, xyzw.x, xyzw.y, xyzw.z);
+}
+
+}
+
+glm::mat4 GeomAnimation::transformAt(int frame) const
+{
+    const TransformKeyframe* next = nullptr;
+    const TransformKeyframe* prev = &keyframes.front();
+    for (const TransformKeyframe& key : keyframes)
+    {
+        if (key.frame <= frame)
+        {
+            prev = &key;
+        }
+        else
+        {
+            next = &key;
+            break;
+        }
+    }
+    if (!next || prev->frame >= frame)
+    {
+        return utilityCore::buildTransformationMatrix(prev->translation, prev->rotation, prev->scale);
+    }
+    float a = (float)(frame - prev->frame) / (next->frame - prev->frame);
+    return utilityCore::buildTransformationMatrix(glm::mix(prev->translation, next->translation, a),
+                                                  glm::mix(prev->rotation, next->rotation, a),
+                                                  glm::mix(prev->scale, next->scale, a));
+}
+
+glm::mat4 NodeTransform::toMatrix() const
+{
+    if (hasMatrix)
+    {
+        return matrix;
+    }
+    return glm::translate(glm::mat4(), translation) * glm::mat4_cast(rotation) * glm::scale(glm::mat4(), scale);
+}
+
+std::vector<glm::mat4> MeshAnimation::worldMatrices(float time) const
+{
+    std::vector<NodeTransform> nodes = restNodes;
+    for (const NodeChannel& channel : channels)
+    {
+        float blend;
+        int k = findKey(channel.times, time, blend);
+        if (channel.step)
+        {
+            blend = 0.f;
+        }
+        glm::vec4 a = channel.values[k];
+        glm::vec4 b = channel.values[std::min(k + 1, (int)channel.values.size() - 1)];
+
+        NodeTransform& node = nodes[channel.node];
+        node.hasMatrix = false;
+        switch (channel.path)
+        {
+        case NodeChannel::TRANSLATION:
+            node.translation = glm::vec3(glm::mix(a, b, blend));
+            break;
+        case NodeChannel::ROTATION:
+            node.rotation = glm::normalize(glm::slerp(toQuat(a), toQuat(b), blend));
+            break;
+        case NodeChannel::SCALE:
+            node.scale = glm::vec3(glm::mix(a, b, blend));
+            break;
+        }
+    }
+
+    // parents can come after their children in glTF, so resolve recursively
+    std::vector<glm::mat4> world(nodes.size());
+    std::vector<bool> done(nodes.size(), false);
+    for (size_t n = 0; n < nodes.size(); ++n)
+    {
+        std::vector<int> chain;
+        for (int i = (int)n; i >= 0 && !done[i]; i = parents[i])
+        {
+            chain.push_back(i);
+        }
+        for (auto it = chain.rbegin(); it != chain.rend(); ++it)
+        {
+            int parent = parents[*it];
+            world[*it] = parent >= 0 ? world[parent] * nodes[*it].toMatrix() : nodes[*it].toMatrix();
+            done[*it] = true;
+        }
+    }
+    return world;
+}
+
+void MeshAnimation::pose(float time, std::vector<Triangle>& triangles, int triBegin) const
+{
+    std::vector<glm::mat4> world = worldMatrices(time);
+    std::vector<glm::mat4> restToPosed(world.size());
+    std::vector<glm::mat3> normalMatrices(world.size());
+    for (size_t n = 0; n < world.size(); ++n)
+    {
+        restToPosed[n] = world[n] * glm::inverse(restWorld[n]);
+        normalMatrices[n] = glm::mat3(glm::inverseTranspose(restToPosed[n]));
+    }
+
+    for (size_t i = 0; i < restTriangles.size(); ++i)
+    {
+        const Triangle& rest = restTriangles[i];
+        Triangle& tri = triangles[triBegin + i];
+        int node = triangleNodes[i];
+        if (node < 0)
+        {
+            tri = rest;
+            continue;
+        }
+        const glm::mat4& m = restToPosed[node];
+        for (int j = 0; j < 3; ++j)
+        {
+            tri.pos[j] = glm::vec3(m * glm::vec4(rest.pos[j], 1.f));
+            tri.normal[j] = glm::normalize(normalMatrices[node] * rest.normal[j]);
+            glm::vec3 tangent = glm::vec3(m * glm::vec4(glm::vec3(rest.tangent[j]), 0.f));
+            float length = glm::length(tangent);
+            tri.tangent[j] = glm::vec4(length > 0.f ? tangent / length : tangent, rest.tangent[j].w);
+        }
+    }
+}
+
+void MeshAnimation::reorder(const std::vector<int>& order)
+{
+    std::vector<Triangle> rest(order.size());
+    std::vector<int> nodes(order.size());
+    for (size_t i = 0; i < order.size(); ++i)
+    {
+        rest[i] = restTriangles[order[i]];
+        nodes[i] = triangleNodes[order[i]];
+    }
+    restTriangles.swap(rest);
+    triangleNodes.swap(nodes);
+}
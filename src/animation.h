@@ -0,0 +1,96 @@
+#pragma once
+
+#include <vector>
+#include "glm/glm.hpp"
+#include "glm/gtc/quaternion.hpp"
+#include "sceneStructs.h"
+
+/**
+ * Transform of a scene file object from its FRAME line on. Frames between two
+ * keyframes interpolate translation, rotation and scale linearly.
+ */
+struct TransformKeyframe
+{
+    int frame;
+    glm::vec3 translation;
+    glm::vec3 rotation;
+    glm::vec3 scale;
+};
+
+/**
+ * Keyframed transform of a scene file object. Only the Geom's matrices and
+ * world box change; mesh triangles stay in object space, so their BVH is
+ * untouched.
+ */
+struct GeomAnimation
+{
+    int geom;
+    std::vector<TransformKeyframe> keyframes;   // sorted by frame
+
+    glm::mat4 transformAt(int frame) const;
+};
+
+/**
+ * Local transform of a glTF node, either TRS or a fixed matrix.
+ */
+struct NodeTransform
+{
+    glm::vec3 translation;
+    glm::quat rotation;
+    glm::vec3 scale = glm::vec3(1.f);
+    bool hasMatrix = false;
+    glm::mat4 matrix;
+
+    glm::mat4 toMatrix() const;
+};
+
+/**
+ * Sampler of a glTF animation channel. values holds one element per key
+ * (vec3 in xyz, quaternions as xyzw); cubic spline samplers keep only their
+ * values and are interpolated linearly.
+ */
+struct NodeChannel
+{
+    enum Path { TRANSLATION, ROTATION, SCALE };
+
+    int node;
+    Path path;
+    bool step;
+    std::vector<float> times;
+    std::vector<glm::vec4> values;
+};
+
+/**
+ * glTF node animation of a mesh. The mesh's triangles are stored in its
+ * object space, posed by the node hierarchy at rest; each frame they are
+ * re-posed from the rest copy by the animated world matrix of the node that
+ * instances them, then the mesh's BVH is refitted.
+ */
+struct MeshAnimation
+{
+    int geom;
+    std::vector<int> parents;               // -1 for roots
+    std::vector<NodeTransform> restNodes;
+    std::vector<NodeChannel> channels;
+    std::vector<glm::mat4> restWorld;       // world matrix of every node at rest
+    std::vector<int> triangleNodes;         // node of every triangle, in BVH order
+    std::vector<Triangle> restTriangles;    // in BVH order
+    float builtCost = 0.f;                  // BVH cost right after the last build
+
+    /**
+     * World matrices of all nodes with the channels sampled at `time`
+     * seconds; times outside a channel's keys clamp to its ends.
+     */
+    std::vector<glm::mat4> worldMatrices(float time) const;
+
+    /**
+     * Writes the triangles posed at `time` to triangles[triBegin, ...).
+     */
+    void pose(float time, std::vector<Triangle>& triangles, int triBegin) const;
+
+    /**
+     * Follows a rebuild of the mesh's BVH: order[i] is the previous position
+     * of the triangle now at i.
+     */
+    void reorder(const std::vector<int>& order);
+};
@@ -0,0 +1,512 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+
+#include "bvh.h"
+#include "utilities.h"
+
+using namespace std;
+
+namespace {
+
+struct BinaryBVHNode
+{
+    AABB aabb;
+    int left = -1;
+    int right = -1;
+    int triBegin = 0;
+    int triCount = 0;
+};
+
+const int numBins = 16;
+// SAH splits stop at this depth. Below it, a leaf of more than 255 triangles
+// is halved, which takes at most 24 more levels for 2^31 triangles, keeping
+// the tree within BVH_MAX_DEPTH.
+const int maxBuildDepth = BVH_MAX_DEPTH - 24;
+
+float surfaceArea(const AABB& aabb)
+{
+    glm::vec3 d = glm::max(aabb.bound[1] - aabb.bound[0], glm::vec3(0.f));
+    return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+void grow(AABB& aabb, const AABB& other)
+{
+    aabb.bound[0] = glm::min(aabb.bound[0], other.bound[0]);
+    aabb.bound[1] = glm::max(aabb.bound[1], other.bound[1]);
+}
+
+void grow(AABB& aabb, glm::vec3 p)
+{
+    aabb.bound[0] = glm::min(aabb.bound[0], p);
+    aabb.bound[1] = glm::max(aabb.bound[1], p);
+}
+
+AABB triangleBounds(const Triangle& tri)
+{
+    AABB aabb;
+    for (int i = 0; i < 3; ++i)
+    {
+        grow(aabb, tri.pos[i]);
+    }
+    return aabb;
+}
+
+glm::vec3 centroid(const Triangle& tri)
+{
+    return (tri.pos[0] + tri.pos[1] + tri.pos[2]) / 3.f;
+}
+
+// Triangle as seen by the build, which reorders these instead of the
+// triangles themselves so that callers can follow the permutation.
+struct BuildPrim
+{
+    AABB bounds;
+    glm::vec3 centroid;
+    int tri;
+};
+
+// Binned SAH build over prims[begin, end). Returns the node index.
+int buildBinary(vector<BuildPrim>& prims, int begin, int end, int depth, vector<BinaryBVHNode>& nodes)
+{
+    int nodeIdx = nodes.size();
+    nodes.emplace_back();
+
+    AABB bounds, centroidBounds;
+    for (int i = begin; i < end; ++i)
+    {
+        grow(bounds, prims[i].bounds);
+        grow(centroidBounds, prims[i].centroid);
+    }
+    nodes[nodeIdx].aabb = bounds;
+
+    int count = end - begin;
+    glm::vec3 extent = centroidBounds.bound[1] - centroidBounds.bound[0];
+    int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    bool canSplit = count > 1 && extent[axis] > 0.f && depth < maxBuildDepth;
+
+    int mid = begin;
+    if (canSplit)
+    {
+        AABB binBounds[numBins];
+        int binCount[numBins] = {};
+        float binScale = numBins / extent[axis];
+        auto binOf = [&](const BuildPrim& prim)
+        {
+            int b = (int)((prim.centroid[axis] - centroidBounds.bound[0][axis]) * binScale);
+            return glm::clamp(b, 0, numBins - 1);
+        };
+        for (int i = begin; i < end; ++i)
+        {
+            int b = binOf(prims[i]);
+            ++binCount[b];
+            grow(binBounds[b], prims[i].bounds);
+        }
+        // sweep from the right to get the cost of every split plane
+        float rightArea[numBins];
+        int rightCount[numBins];
+        AABB acc;
+        int accCount = 0;
+        for (int b = numBins - 1; b > 0; --b)
+        {
+            grow(acc, binBounds[b]);
+            accCount += binCount[b];
+            rightArea[b] = accCount > 0 ? surfaceArea(acc) : 0.f;
+            rightCount[b] = accCount;
+        }
+
+        float bestCost = FLT_MAX;
+        int bestSplit = -1;
+        acc = AABB();
+        accCount = 0;
+        for (int b = 1; b < numBins; ++b)
+        {
+            grow(acc, binBounds[b - 1]);
+            accCount += binCount[b - 1];
+            if (accCount == 0 || rightCount[b] == 0)
+            {
+                continue;
+            }
+            float cost = accCount * surfaceArea(acc) + rightCount[b] * rightArea[b];
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestSplit = b;
+            }
+        }
+
+        float leafCost = count * surfaceArea(bounds);
+        if (bestSplit < 0 || (count <= BVH_MAX_LEAF_SIZE && leafCost <= 1.f * surfaceArea(bounds) + bestCost))
+        {
+            canSplit = count > BVH_MAX_LEAF_SIZE;
+            mid = begin + count / 2;
+            if (canSplit)
+            {
+                nth_element(prims.begin() + begin, prims.begin() + mid, prims.begin() + end,
+                            [axis](const BuildPrim& a, const BuildPrim& b) { return a.centroid[axis] < b.centroid[axis]; });
+            }
+        }
+        else
+        {
+            mid = partition(prims.begin() + begin, prims.begin() + end,
+                            [&](const BuildPrim& prim) { return binOf(prim) < bestSplit; }) - prims.begin();
+        }
+    }
+    else if (count > 255)
+    {
+        // degenerate centroids; split anyway so leaf sizes fit in a byte
+        canSplit = true;
+        mid = begin + count / 2;
+    }
+
+    if (!canSplit)
+    {
+        nodes[nodeIdx].triBegin = begin;
+        nodes[nodeIdx].triCount = count;
+        return nodeIdx;
+    }
+
+    int left = buildBinary(prims, begin, mid, depth + 1, nodes);
+    int right = buildBinary(prims, mid, end, depth + 1, nodes);
+    nodes[nodeIdx].left = left;
+    nodes[nodeIdx].right = right;
+    return nodeIdx;
+}
+
+// Places the quantization grid of a node over its box: the origin at the
+// lower corner and the smallest power-of-two steps whose 255th plane reaches
+// the upper one.
+void setNodeFrame(WideBVHNode& node, const AABB& aabb)
+{
+    node.origin = aabb.bound[0];
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        float extent = aabb.bound[1][axis] - aabb.bound[0][axis];
+        int e = (int)ceilf(log2f(glm::max(extent, 1e-30f) / 255.f));
+        e = glm::clamp(e, -126, 127);
+        while (e < 127 && node.origin[axis] + 255.f * ldexpf(1.f, e) < aabb.bound[1][axis])
+        {
+            ++e;
+        }
+        node.exponent[axis] = (signed char)e;
+    }
+}
+
+// Quantizes child boxes relative to the parent box so that the dequantized
+// boxes, computed the same way as in intersectWideBVHNode, contain them.
+void quantizeChild(WideBVHNode& node, int slot, const AABB& child)
+{
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        float scale = ldexpf(1.f, node.exponent[axis]);
+        float origin = node.origin[axis];
+        int lo = (int)floorf((child.bound[0][axis] - origin) / scale);
+        int hi = (int)ceilf((child.bound[1][axis] - origin) / scale);
+        lo = glm::clamp(lo, 0, 255);
+        hi = glm::clamp(hi, 0, 255);
+        while (lo > 0 && origin + lo * scale > child.bound[0][axis])
+        {
+            --lo;
+        }
+        while (hi < 255 && origin + hi * scale < child.bound[1][axis])
+        {
+            ++hi;
+        }
+        node.qlo[axis][slot] = (unsigned char)lo;
+        node.qhi[axis][slot] = (unsigned char)hi;
+    }
+}
+
+// Collapses the binary subtree at binIdx into wide nodes. Returns the index of
+// the wide node.
+int collapse(const vector<BinaryBVHNode>& binNodes, int binIdx, int triBegin, vector<WideBVHNode>& nodes)
+{
+    const BinaryBVHNode& bin = binNodes[binIdx];
+
+    int children[BVH_WIDTH];
+    int childCount = 0;
+    if (bin.left < 0)
+    {
+        children[childCount++] = binIdx;
+    }
+    else
+    {
+        children[childCount++] = bin.left;
+        children[childCount++] = bin.right;
+    }
+
+    // open the inner child with the largest surface area until the node is full
+    while (childCount < BVH_WIDTH)
+    {
+        int best = -1;
+        float bestArea = -1.f;
+        for (int c = 0; c < childCount; ++c)
+        {
+            const BinaryBVHNode& child = binNodes[children[c]];
+            float area = surfaceArea(child.aabb);
+            if (child.left >= 0 && area > bestArea)
+            {
+                best = c;
+                bestArea = area;
+            }
+        }
+        if (best < 0)
+        {
+            break;
+        }
+        const BinaryBVHNode& opened = binNodes[children[best]];
+        children[best] = opened.left;
+        children[childCount++] = opened.right;
+    }
+
+    int nodeIdx = nodes.size();
+    nodes.emplace_back();
+    WideBVHNode node = {};
+    node.childCount = childCount;
+    setNodeFrame(node, bin.aabb);
+
+    for (int c = 0; c < childCount; ++c)
+    {
+        const BinaryBVHNode& child = binNodes[children[c]];
+        quantizeChild(node, c, child.aabb);
+        if (child.left < 0)
+        {
+            node.child[c] = triBegin + child.triBegin;
+            node.triCount[c] = child.triCount;
+        }
+        else
+        {
+            node.child[c] = collapse(binNodes, children[c], triBegin, nodes);
+            node.triCount[c] = 0;
+        }
+    }
+    nodes[nodeIdx] = node;
+    return nodeIdx;
+}
+
+// Plain ray/triangle test used to gather traversal statistics.
+float intersectTriangle(const Ray& ray, const Triangle& tri)
+{
+    glm::vec3 e1 = tri.pos[1] - tri.pos[0];
+    glm::vec3 e2 = tri.pos[2] - tri.pos[0];
+    glm::vec3 p = glm::cross(ray.direction, e2);
+    float det = glm::dot(e1, p);
+    if (fabsf(det) < 1e-12f)
+    {
+        return -1.f;
+    }
+    float invDet = 1.f / det;
+    glm::vec3 s = ray.origin - tri.pos[0];
+    float u = glm::dot(s, p) * invDet;
+    if (u < 0.f || u > 1.f)
+    {
+        return -1.f;
+    }
+    glm::vec3 q = glm::cross(s, e1);
+    float v = glm::dot(ray.direction, q) * invDet;
+    if (v < 0.f || u + v > 1.f)
+    {
+        return -1.f;
+    }
+    return glm::dot(e2, q) * invDet;
+}
+
+struct StatsLeafIntersector
+{
+    const Triangle* tris;
+    const Ray& ray;
+    float& tMax;
+    int triTests;
+
+    void operator()(int triBegin, int triCount)
+    {
+        for (int i = triBegin; i < triBegin + triCount; ++i)
+        {
+            ++triTests;
+            float t = intersectTriangle(ray, tris[i]);
+            if (t > 0.f && t < tMax)
+            {
+                tMax = t;
+            }
+        }
+    }
+};
+
+bool slabTest(const AABB& aabb, const Ray& ray, glm::vec3 invDir, float tMax)
+{
+    glm::vec3 t0 = (aabb.bound[0] - ray.origin) * invDir;
+    glm::vec3 t1 = (aabb.bound[1] - ray.origin) * invDir;
+    glm::vec3 tmin = glm::min(t0, t1);
+    glm::vec3 tmax = glm::max(t0, t1);
+    float enter = glm::max(glm::max(tmin.x, tmin.y), glm::max(tmin.z, 0.f));
+    float exit = glm::min(glm::min(tmax.x, tmax.y), glm::min(tmax.z, tMax));
+    return enter <= exit;
+}
+
+int traverseBinary(const vector<BinaryBVHNode>& nodes, int triBegin, const Ray& ray, StatsLeafIntersector& leafFn)
+{
+    glm::vec3 invDir = safeInverseDirection(ray.direction);
+    int stack[128];
+    int sp = 0;
+    int steps = 0;
+    stack[sp++] = 0;
+    while (sp > 0)
+    {
+        const BinaryBVHNode& node = nodes[stack[--sp]];
+        ++steps;
+        if (!slabTest(node.aabb, ray, invDir, leafFn.tMax))
+        {
+            continue;
+        }
+        if (node.left < 0)
+        {
+            leafFn(triBegin + node.triBegin, node.triCount);
+        }
+        else if (sp + 2 <= 128)
+        {
+            stack[sp++] = node.right;
+            stack[sp++] = node.left;
+        }
+    }
+    return steps;
+}
+
+// Traces random rays through the box of the mesh with both BVHs and prints
+// node memory and the average work per ray.
+void reportStats(const vector<Triangle>& tris, int triBegin, const vector<BinaryBVHNode>& binNodes,
+                 const vector<WideBVHNode>& nodes, int root, int numWideNodes)
+{
+    const int numRays = 4096;
+    AABB bounds = binNodes[0].aabb;
+    glm::vec3 center = (bounds.bound[0] + bounds.bound[1]) * .5f;
+    float radius = glm::length(bounds.bound[1] - bounds.bound[0]);
+
+    mt19937 rng(0);
+    uniform_real_distribution<float> u01(0.f, 1.f);
+    long long binarySteps = 0, wideSteps = 0, binaryTris = 0, wideTris = 0;
+    int mismatches = 0;
+    for (int i = 0; i < numRays; ++i)
+    {
+        float z = 2.f * u01(rng) - 1.f;
+        float phi = TWO_PI * u01(rng);
+        float r = sqrtf(glm::max(0.f, 1.f - z * z));
+        glm::vec3 target = glm::mix(bounds.bound[0], bounds.bound[1], glm::vec3(u01(rng), u01(rng), u01(rng)));
+
+        Ray ray;
+        ray.origin = center + radius * glm::vec3(r * cosf(phi), r * sinf(phi), z);
+        ray.direction = glm::normalize(target - ray.origin);
+
+        float tBinary = FLT_MAX;
+        StatsLeafIntersector binaryLeaf = { tris.data(), ray, tBinary, 0 };
+        binarySteps += traverseBinary(binNodes, triBegin, ray, binaryLeaf);
+        binaryTris += binaryLeaf.triTests;
+
+        float tWide = FLT_MAX;
+        StatsLeafIntersector wideLeaf = { tris.data(), ray, tWide, 0 };
+        wideSteps += traverseWideBVH(nodes.data(), root, ray, tWide, wideLeaf);
+        wideTris += wideLeaf.triTests;
+
+        if (tBinary != tWide)
+        {
+            ++mismatches;
+        }
+    }
+
+    cout << "BVH: " << binNodes.size() << " binary nodes (" << binNodes.size() * 32 << " bytes), "
+         << numWideNodes << " " << BVH_WIDTH << "-wide nodes (" << numWideNodes * sizeof(WideBVHNode) << " bytes)" << endl;
+    cout << "BVH: per ray, binary " << (float)binarySteps / numRays << " nodes / "
+         << (float)binaryTris / numRays << " triangles, " << BVH_WIDTH << "-wide "
+         << (float)wideSteps / numRays << " nodes / " << (float)wideTris / numRays << " triangles";
+    if (mismatches > 0)
+    {
+        cout << ", " << mismatches << " closest hits differ";
+    }
+    cout << endl;
+}
+
+// Recomputes the child boxes of a wide node from its triangles, requantizes
+// them and adds their SAH cost to `cost`. Returns the node's box.
+AABB refitNode(const vector<Triangle>& tris, vector<WideBVHNode>& nodes, int nodeIdx, float& cost)
+{
+    AABB childBounds[BVH_WIDTH];
+    AABB bounds;
+    const int childCount = nodes[nodeIdx].childCount;
+    for (int c = 0; c < childCount; ++c)
+    {
+        const WideBVHNode& node = nodes[nodeIdx];
+        int triCount = node.triCount[c];
+        if (triCount > 0)
+        {
+            for (int i = node.child[c]; i < node.child[c] + triCount; ++i)
+            {
+                grow(childBounds[c], triangleBounds(tris[i]));
+            }
+        }
+        else
+        {
+            childBounds[c] = refitNode(tris, nodes, node.child[c], cost);
+        }
+        grow(bounds, childBounds[c]);
+        cost += surfaceArea(childBounds[c]) * (triCount > 0 ? triCount : 1);
+    }
+
+    WideBVHNode& node = nodes[nodeIdx];
+    setNodeFrame(node, bounds);
+    for (int c = 0; c < childCount; ++c)
+    {
+        quantizeChild(node, c, childBounds[c]);
+    }
+    return bounds;
+}
+
+}
+
+int buildWideBVH(vector<Triangle>& triangles, int triBegin, int triEnd, vector<WideBVHNode>& nodes, vector<int>* order)
+{
+    auto start = chrono::high_resolution_clock::now();
+
+    const int count = triEnd - triBegin;
+    vector<BuildPrim> prims(count);
+    for (int i = 0; i < count; ++i)
+    {
+        prims[i].bounds = triangleBounds(triangles[triBegin + i]);
+        prims[i].centroid = centroid(triangles[triBegin + i]);
+        prims[i].tri = i;
+    }
+
+    vector<BinaryBVHNode> binNodes;
+    binNodes.reserve(2 * count / BVH_MAX_LEAF_SIZE + 1);
+    buildBinary(prims, 0, count, 0, binNodes);
+
+    vector<Triangle> unordered(triangles.begin() + triBegin, triangles.begin() + triEnd);
+    for (int i = 0; i < count; ++i)
+    {
+        triangles[triBegin + i] = unordered[prims[i].tri];
+    }
+    if (order)
+    {
+        order->resize(count);
+        for (int i = 0; i < count; ++i)
+        {
+            (*order)[i] = prims[i].tri;
+        }
+    }
+
+    size_t firstNode = nodes.size();
+    int root = collapse(binNodes, 0, triBegin, nodes);
+
+    chrono::duration<double, milli> elapsed = chrono::high_resolution_clock::now() - start;
+    cout << "Built BVH over " << count << " triangles in " << elapsed.count() << "ms" << endl;
+    reportStats(triangles, triBegin, binNodes, nodes, root, nodes.size() - firstNode);
+
+    return root;
+}
+
+float refitWideBVH(const vector<Triangle>& triangles, vector<WideBVHNode>& nodes, int root)
+{
+    float cost = 0.f;
+    AABB bounds = refitNode(triangles, nodes, root, cost);
+    float rootArea = surfaceArea(bounds);
+    return rootArea > 0.f ? 1.f + cost / rootArea : 0.f;
+}
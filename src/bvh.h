@@ -0,0 +1,258 @@
+#pragma once
+
+#include <vector>
+#include <cuda_runtime.h>
+#include "glm/glm.hpp"
+#include "sceneStructs.h"
+
+#if !defined(__CUDA_ARCH__) && (defined(__SSE2__) || defined(_M_X64))
+#define BVH_USE_SSE 1
+#include <emmintrin.h>
+#if defined(__AVX2__)
+#define BVH_USE_AVX2 1
+#include <immintrin.h>
+#endif
+#endif
+
+// Branching factor of the BVH used for mesh intersection, 4 or 8.
+#define BVH_WIDTH 4
+// Depth limit of the binary BVH, and so of the wide BVH collapsed from it.
+#define BVH_MAX_DEPTH 64
+// Each wide node on the path to the current one leaves at most
+// BVH_WIDTH - 1 children on the traversal stack.
+#define BVH_STACK_SIZE ((BVH_WIDTH - 1) * BVH_MAX_DEPTH + 1)
+// Leaves of the binary BVH the wide one is collapsed from hold at most this
+// many triangles.
+#define BVH_MAX_LEAF_SIZE 4
+
+/**
+ * Node of a BVH_WIDTH-ary BVH.
+ * Child boxes are quantized to 8 bits per axis relative to the node's own box:
+ * along each axis, child c spans origin + [qlo, qhi][axis][c] * 2^exponent[axis].
+ * A child is either an inner node (triCount == 0, child is its node index) or
+ * a leaf (child is the first of its triCount contiguous triangles).
+ */
+struct WideBVHNode
+{
+    glm::vec3 origin;
+    signed char exponent[3];
+    unsigned char childCount;
+    unsigned char qlo[3][BVH_WIDTH];
+    unsigned char qhi[3][BVH_WIDTH];
+    unsigned char triCount[BVH_WIDTH];
+    int child[BVH_WIDTH];
+};
+
+struct BVHStackEntry
+{
+    int node;
+    int triCount;
+    float tNear;
+};
+
+/**
+ * Builds a BVH over triangles [triBegin, triEnd) and appends its nodes to
+ * `nodes`. Triangles are reordered so that each leaf's triangles are
+ * contiguous. Prints node memory and traversal statistics against the binary
+ * BVH the wide one was collapsed from.
+ *
+ * @param order  If given, receives for every position in the range the
+ *               index, relative to triBegin, the triangle there had before.
+ * @return       Index of the root node.
+ */
+int buildWideBVH(std::vector<Triangle>& triangles, int triBegin, int triEnd, std::vector<WideBVHNode>& nodes,
+                 std::vector<int>* order = nullptr);
+
+/**
+ * Refits the BVH rooted at `root` to triangles that moved since it was built:
+ * all boxes are recomputed bottom-up in one pass over the nodes and the
+ * triangles, keeping the tree's topology.
+ *
+ * @return  SAH cost of the refitted tree relative to its root box. It grows
+ *          as the tree degrades; compare it to the cost right after the
+ *          build (a refit of the unmoved triangles) to decide on a rebuild.
+ */
+float refitWideBVH(const std::vector<Triangle>& triangles, std::vector<WideBVHNode>& nodes, int root);
+
+/**
+ * Reciprocal of a ray direction with zero components replaced by a tiny
+ * value, so that slab tests never compute 0 * inf.
+ */
+__host__ __device__ inline glm::vec3 safeInverseDirection(glm::vec3 d)
+{
+    for (int i = 0; i < 3; ++i)
+    {
+        if (glm::abs(d[i]) < 1e-12f)
+        {
+            d[i] = d[i] < 0.f ? -1e-12f : 1e-12f;
+        }
+    }
+    return 1.f / d;
+}
+
+#if BVH_USE_SSE
+// Converts four quantized bounds to floats.
+inline __m128 loadQuantized4(const unsigned char* q)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i bytes = _mm_cvtsi32_si128(q[0] | (q[1] << 8) | (q[2] << 16) | (q[3] << 24));
+    __m128i words = _mm_unpacklo_epi8(bytes, zero);
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(words, zero));
+}
+#endif
+
+/**
+ * Slab test of a ray against all children of a node.
+ *
+ * @param tNear  Output entry distance of each child.
+ * @return       Bit mask of the children hit within [0, tMax].
+ */
+__host__ __device__ inline unsigned int intersectWideBVHNode(const WideBVHNode& node,
+                                                             glm::vec3 rayOrigin,
+                                                             glm::vec3 invDir,
+                                                             float tMax,
+                                                             float* tNear)
+{
+    // t of a quantized plane q along an axis is base + q * step
+    glm::vec3 scale(ldexpf(1.f, node.exponent[0]), ldexpf(1.f, node.exponent[1]), ldexpf(1.f, node.exponent[2]));
+    glm::vec3 base = (node.origin - rayOrigin) * invDir;
+    glm::vec3 step = scale * invDir;
+    unsigned int mask = 0;
+
+#if BVH_USE_AVX2 && BVH_WIDTH == 8
+    __m256 tmin = _mm256_setzero_ps();
+    __m256 tmax = _mm256_set1_ps(tMax);
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        __m256 lo = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)node.qlo[axis])));
+        __m256 hi = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)node.qhi[axis])));
+        __m256 b = _mm256_set1_ps(base[axis]);
+        __m256 s = _mm256_set1_ps(step[axis]);
+        __m256 t0 = _mm256_add_ps(b, _mm256_mul_ps(lo, s));
+        __m256 t1 = _mm256_add_ps(b, _mm256_mul_ps(hi, s));
+        tmin = _mm256_max_ps(tmin, _mm256_min_ps(t0, t1));
+        tmax = _mm256_min_ps(tmax, _mm256_max_ps(t0, t1));
+    }
+    mask = _mm256_movemask_ps(_mm256_cmp_ps(tmin, tmax, _CMP_LE_OQ));
+    _mm256_storeu_ps(tNear, tmin);
+#elif BVH_USE_SSE
+    for (int g = 0; g < BVH_WIDTH; g += 4)
+    {
+        __m128 tmin = _mm_setzero_ps();
+        __m128 tmax = _mm_set1_ps(tMax);
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            __m128 lo = loadQuantized4(&node.qlo[axis][g]);
+            __m128 hi = loadQuantized4(&node.qhi[axis][g]);
+            __m128 b = _mm_set1_ps(base[axis]);
+            __m128 s = _mm_set1_ps(step[axis]);
+            __m128 t0 = _mm_add_ps(b, _mm_mul_ps(lo, s));
+            __m128 t1 = _mm_add_ps(b, _mm_mul_ps(hi, s));
+            tmin = _mm_max_ps(tmin, _mm_min_ps(t0, t1));
+            tmax = _mm_min_ps(tmax, _mm_max_ps(t0, t1));
+        }
+        mask |= _mm_movemask_ps(_mm_cmple_ps(tmin, tmax)) << g;
+        _mm_storeu_ps(tNear + g, tmin);
+    }
+#else
+    for (int c = 0; c < BVH_WIDTH; ++c)
+    {
+        float tmin = 0.f;
+        float tmax = tMax;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            float t0 = base[axis] + node.qlo[axis][c] * step[axis];
+            float t1 = base[axis] + node.qhi[axis][c] * step[axis];
+            tmin = fmaxf(tmin, fminf(t0, t1));
+            tmax = fminf(tmax, fmaxf(t0, t1));
+        }
+        tNear[c] = tmin;
+        mask |= (tmin <= tmax ? 1u : 0u) << c;
+    }
+#endif
+
+    return mask & ((1u << node.childCount) - 1);
+}
+
+/**
+ * Traversal counters that compile away. Any type with the same members can be
+ * passed to traverseWideBVH to count the work of a traversal.
+ */
+struct NoTraversalStats
+{
+    // node(boxesTested, boxesHit): a node's boxesTested child boxes were
+    // tested, boxesHit of them were hit
+    __host__ __device__ void node(int, int) {}
+    // leaf(triCount): a leaf with triCount triangles was reached
+    __host__ __device__ void leaf(int) {}
+};
+
+/**
+ * Closest-hit traversal of the BVH rooted at `root`. The ray must be in the
+ * space the BVH was built in; its direction need not be normalized, and all
+ * distances are in units of its parameter t.
+ *
+ * leafFn(triBegin, triCount) is called for every leaf the ray reaches and is
+ * expected to lower tMax when it finds a closer hit. Work done is reported to
+ * `stats`.
+ *
+ * @return  Number of nodes visited.
+ */
+template <typename LeafFn, typename Stats>
+__host__ __device__ inline int traverseWideBVH(const WideBVHNode* nodes, int root, const Ray& ray,
+                                               float& tMax, LeafFn& leafFn, Stats& stats)
+{
+    glm::vec3 invDir = safeInverseDirection(ray.direction);
+    BVHStackEntry stack[BVH_STACK_SIZE];
+    int sp = 0;
+    int steps = 0;
+
+    stack[sp++] = { root, 0, 0.f };
+    while (sp > 0)
+    {
+        BVHStackEntry entry = stack[--sp];
+        if (entry.tNear > tMax)
+        {
+            continue;
+        }
+        if (entry.triCount > 0)
+        {
+            stats.leaf(entry.triCount);
+            leafFn(entry.node, entry.triCount);
+            continue;
+        }
+
+        const WideBVHNode& node = nodes[entry.node];
+        ++steps;
+
+        float tNear[BVH_WIDTH];
+        unsigned int mask = intersectWideBVHNode(node, ray.origin, invDir, tMax, tNear);
+
+        // keep the children just pushed sorted far to near, so the nearest is popped first
+        int first = sp;
+        for (int c = 0; c < BVH_WIDTH; ++c)
+        {
+            if (mask & (1u << c))
+            {
+                BVHStackEntry child = { node.child[c], node.triCount[c], tNear[c] };
+                int j = sp++;
+                while (j > first && stack[j - 1].tNear < child.tNear)
+                {
+                    stack[j] = stack[j - 1];
+                    --j;
+                }
+                stack[j] = child;
+            }
+        }
+        stats.node(node.childCount, sp - first);
+    }
+    return steps;
+}
+
+template <typename LeafFn>
+__host__ __device__ inline int traverseWideBVH(const WideBVHNode* nodes, int root, const Ray& ray,
+                                               float& tMax, LeafFn& leafFn)
+{
+    NoTraversalStats stats;
+    return traverseWideBVH(nodes, root, ray, tMax, leafFn, stats);
+}
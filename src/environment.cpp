@@ -0,0 +1,66 @@
+#include "environment.h"
+
+std::vector<AliasEntry> buildAliasTable(const std::vector<float>& weights)
+{
+    const int n = weights.size();
+    std::vector<AliasEntry> table(n);
+    double sum = 0.0;
+    for (float w : weights)
+    {
+        sum += w;
+    }
+
+    // scaled[i] is n times the probability of i; cells below 1 are topped up
+    // by an alias from the cells above 1
+    std::vector<double> scaled(n);
+    std::vector<int> small, large;
+    for (int i = 0; i < n; ++i)
+    {
+        double p = sum > 0.0 ? weights[i] / sum : 1.0 / n;
+        table[i].pdf = (float)p;
+        table[i].alias = i;
+        scaled[i] = p * n;
+        (scaled[i] < 1.0 ? small : large).push_back(i);
+    }
+    while (!small.empty() && !large.empty())
+    {
+        int s = small.back();
+        small.pop_back();
+        int l = large.back();
+        table[s].prob = (float)scaled[s];
+        table[s].alias = l;
+        scaled[l] -= 1.0 - scaled[s];
+        if (scaled[l] < 1.0)
+        {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // what is left is 1 up to rounding
+    for (int i : small)
+    {
+        table[i].prob = 1.f;
+    }
+    for (int i : large)
+    {
+        table[i].prob = 1.f;
+    }
+    return table;
+}
+
+std::vector<AliasEntry> buildEnvironmentAliasTable(const std::vector<glm::vec3>& radiance, int width, int height)
+{
+    const glm::vec3 luminance(0.2126f, 0.7152f, 0.0722f);
+    std::vector<float> weights(width * height);
+    for (int y = 0; y < height; ++y)
+    {
+        // rows near the poles cover less solid angle
+        float sinTheta = sinf((y + 0.5f) / height * PI);
+        for (int x = 0; x < width; ++x)
+        {
+            int i = x + y * width;
+            weights[i] = glm::max(glm::dot(radiance[i], luminance), 0.f) * sinTheta;
+        }
+    }
+    return buildAliasTable(weights);
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <vector>
+#include <cuda_runtime.h>
+#include <thrust/random.h>
+#include "glm/glm.hpp"
+#include "utilities.h"
+
+/**
+ * Cell of an alias table. A sample that picks the cell uniformly keeps it
+ * with probability `prob` and takes `alias` otherwise; `pdf` is the cell's
+ * own probability of being sampled.
+ */
+struct AliasEntry
+{
+    float prob;
+    int alias;
+    float pdf;
+};
+
+/**
+ * Equirectangular environment seen by rays that leave the scene, with an
+ * alias table over its pixels for importance sampling. Pixel (x, y) covers
+ * u = x / width, v = y / height with v = 0 straight up (+y), see
+ * directionToEquirect. A width of 0 means there is no environment.
+ */
+struct EnvironmentMap
+{
+    int width = 0;
+    int height = 0;
+    const glm::vec3* radiance = nullptr;
+    const AliasEntry* alias = nullptr;
+};
+
+/**
+ * Alias table (Vose's method) sampling index i with probability
+ * weights[i] / sum(weights). All-zero weights sample uniformly.
+ */
+std::vector<AliasEntry> buildAliasTable(const std::vector<float>& weights);
+
+/**
+ * Alias table over the pixels of an equirectangular map, weighted by
+ * luminance times the solid angle of each pixel row.
+ */
+std::vector<AliasEntry> buildEnvironmentAliasTable(const std::vector<glm::vec3>& radiance, int width, int height);
+
+__host__ __device__ inline glm::vec2 directionToEquirect(glm::vec3 dir)
+{
+    float u = 0.5f + atan2f(dir.z, dir.x) / TWO_PI;
+    float v = acosf(glm::clamp(dir.y, -1.f, 1.f)) / PI;
+    return glm::vec2(u, v);
+}
+
+__host__ __device__ inline glm::vec3 equirectToDirection(glm::vec2 uv)
+{
+    float phi = (uv.x - 0.5f) * TWO_PI;
+    float theta = uv.y * PI;
+    float sinTheta = sinf(theta);
+    return glm::vec3(sinTheta * cosf(phi), cosf(theta), sinTheta * sinf(phi));
+}
+
+__host__ __device__ inline int environmentPixel(const EnvironmentMap& env, glm::vec2 uv)
+{
+    int x = glm::clamp((int)(uv.x * env.width), 0, env.width - 1);
+    int y = glm::clamp((int)(uv.y * env.height), 0, env.height - 1);
+    return x + y * env.width;
+}
+
+__host__ __device__ inline glm::vec3 environmentRadiance(const EnvironmentMap& env, glm::vec3 dir)
+{
+    return env.radiance[environmentPixel(env, directionToEquirect(dir))];
+}
+
+/**
+ * Solid angle density of a direction sampled uniformly in (u, v) within a
+ * pixel picked with probability pixelPdf; a unit of (u, v) spans
+ * 2 pi^2 sin(theta) steradians.
+ */
+__host__ __device__ inline float pixelPdfToSolidAngle(const EnvironmentMap& env, float pixelPdf, float sinTheta)
+{
+    return sinTheta > 0.f ? pixelPdf * env.width * env.height / (2.f * PI * PI * sinTheta) : 0.f;
+}
+
+/**
+ * Solid angle density of sampleEnvironment producing direction `dir`.
+ */
+__host__ __device__ inline float environmentPdf(const EnvironmentMap& env, glm::vec3 dir)
+{
+    // not sqrt(1 - y^2), which rounds to 0 well before the poles
+    float sinTheta = sqrtf(dir.x * dir.x + dir.z * dir.z);
+    return pixelPdfToSolidAngle(env, env.alias[environmentPixel(env, directionToEquirect(dir))].pdf, sinTheta);
+}
+
+/**
+ * Samples a direction towards the environment in O(1): a pixel from the
+ * alias table, then a uniform point in it.
+ *
+ * @param pdf  Output solid angle density of the direction.
+ */
+__host__ __device__ inline glm::vec3 sampleEnvironment(const EnvironmentMap& env,
+                                                       thrust::default_random_engine& rng, float& pdf)
+{
+    thrust::uniform_real_distribution<float> u01(0, 1);
+    const int numPixels = env.width * env.height;
+    // separate numbers for the cell and the coin flip: a float has too few
+    // bits to split between them on large maps
+    int cell = glm::min((int)(u01(rng) * numPixels), numPixels - 1);
+    const AliasEntry& entry = env.alias[cell];
+    int pixel = u01(rng) < entry.prob ? cell : entry.alias;
+
+    glm::vec2 uv((pixel % env.width + u01(rng)) / env.width, (pixel / env.width + u01(rng)) / env.height);
+    pdf = pixelPdfToSolidAngle(env, env.alias[pixel].pdf, sinf(uv.y * PI));
+    return equirectToDirection(uv);
+}
+
+/**
+ * Power heuristic (beta = 2) weight of a sample taken with density pdfA,
+ * when pdfB could have produced it as well.
+ */
+__host__ __device__ inline float powerHeuristic(float pdfA, float pdfB)
+{
+    float a = pdfA * pdfA;
+    float b = pdfB * pdfB;
+    return a + b > 0.f ? a / (a + b) : 0.f;
+}
@@ -0,0 +1,382 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <json.hpp>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "gltffile.h"
+
+namespace {
+
+const uint32_t glbMagic = 0x46546C67;       // "glTF"
+const uint32_t glbChunkJSON = 0x4E4F534A;   // "JSON"
+const uint32_t glbChunkBIN = 0x004E4942;    // "BIN\0"
+
+// 1 byte that tinygltf decodes in place of a mapped buffer
+const char* stubBufferURI = "data:application/octet-stream;base64,AA==";
+
+uint32_t readU32(const unsigned char* p)
+{
+    uint32_t v;
+    std::memcpy(&v, p, 4);
+    return v;
+}
+
+std::string directoryOf(const std::string& path)
+{
+    size_t slash = path.find_last_of("/\\");
+    return slash == std::string::npos ? std::string() : path.substr(0, slash);
+}
+
+std::string urlDecode(const std::string& s)
+{
+    std::string out;
+    for (size_t i = 0; i < s.size(); ++i)
+    {
+        if (s[i] == '%' && i + 2 < s.size() && isxdigit((unsigned char)s[i + 1]) && isxdigit((unsigned char)s[i + 2]))
+        {
+            out += (char)std::stoi(s.substr(i + 1, 2), nullptr, 16);
+            i += 2;
+        }
+        else
+        {
+            out += s[i];
+        }
+    }
+    return out;
+}
+
+// Splits a .glb into its JSON and binary chunks; the binary chunk is optional.
+bool parseGLB(const MappedFile& file, const char*& json, size_t& jsonLength, const unsigned char*& bin,
+              size_t& binLength, std::string& err)
+{
+    const unsigned char* p = file.data();
+    const size_t size = file.size();
+    if (size < 20 || readU32(p + 12 + 4) != glbChunkJSON)
+    {
+        err += "Invalid .glb header\n";
+        return false;
+    }
+    jsonLength = readU32(p + 12);
+    if (20 + jsonLength > size)
+    {
+        err += "Truncated .glb JSON chunk\n";
+        return false;
+    }
+    json = reinterpret_cast<const char*>(p + 20);
+
+    bin = nullptr;
+    binLength = 0;
+    // chunks are padded to 4 bytes
+    size_t next = 20 + (jsonLength + 3) / 4 * 4;
+    if (next + 8 <= size && readU32(p + next + 4) == glbChunkBIN)
+    {
+        binLength = std::min<size_t>(readU32(p + next), size - next - 8);
+        bin = p + next + 8;
+    }
+    return true;
+}
+
+}
+
+MappedFile::~MappedFile()
+{
+    if (!mapped)
+    {
+        return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(bytes);
+    CloseHandle(mapping);
+    CloseHandle(file);
+#else
+    munmap(const_cast<unsigned char*>(bytes), length);
+#endif
+}
+
+bool MappedFile::open(const std::string& path)
+{
+#ifdef _WIN32
+    HANDLE f = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                           FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (f == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(f, &size))
+    {
+        CloseHandle(f);
+        return false;
+    }
+    length = (size_t)size.QuadPart;
+    HANDLE m = length > 0 ? CreateFileMappingA(f, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+    const void* view = m ? MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0) : nullptr;
+    if (view)
+    {
+        bytes = static_cast<const unsigned char*>(view);
+        file = f;
+        mapping = m;
+        mapped = true;
+        return true;
+    }
+    if (m)
+    {
+        CloseHandle(m);
+    }
+    CloseHandle(f);
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return false;
+    }
+    length = (size_t)st.st_size;
+    void* view = length > 0 ? mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (view != MAP_FAILED)
+    {
+        // the loader reads the whole file, indexed vertices out of order
+        madvise(view, length, MADV_WILLNEED);
+        bytes = static_cast<const unsigned char*>(view);
+        mapped = true;
+        return true;
+    }
+#endif
+
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+    {
+        return false;
+    }
+    contents.resize(length);
+    in.read(reinterpret_cast<char*>(contents.data()), length);
+    bytes = contents.data();
+    return (size_t)in.gcount() == length;
+}
+
+float AccessorView::component(size_t i, int c) const
+{
+    if (!data || c >= numComponents)
+    {
+        return 0.f;
+    }
+    const unsigned char* p = data + i * stride;
+    switch (componentType)
+    {
+    case TINYGLTF_COMPONENT_TYPE_FLOAT:
+    {
+        float v;
+        std::memcpy(&v, p + 4 * c, 4);
+        return v;
+    }
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+        return normalized ? p[c] / 255.f : p[c];
+    case TINYGLTF_COMPONENT_TYPE_BYTE:
+    {
+        float v = (signed char)p[c];
+        return normalized ? std::max(v / 127.f, -1.f) : v;
+    }
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+    {
+        uint16_t v;
+        std::memcpy(&v, p + 2 * c, 2);
+        return normalized ? v / 65535.f : v;
+    }
+    case TINYGLTF_COMPONENT_TYPE_SHORT:
+    {
+        int16_t v;
+        std::memcpy(&v, p + 2 * c, 2);
+        return normalized ? std::max(v / 32767.f, -1.f) : v;
+    }
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT:
+        return (float)readU32(p + 4 * c);
+    default:
+        return 0.f;
+    }
+}
+
+glm::vec4 AccessorView::element(size_t i) const
+{
+    return glm::vec4(component(i, 0), component(i, 1), component(i, 2), component(i, 3));
+}
+
+unsigned int AccessorView::index(size_t i) const
+{
+    if (!data)
+    {
+        return 0;
+    }
+    const unsigned char* p = data + i * stride;
+    switch (componentType)
+    {
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+        return p[0];
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+    {
+        uint16_t v;
+        std::memcpy(&v, p, 2);
+        return v;
+    }
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT:
+        return readU32(p);
+    default:
+        return (unsigned int)component(i, 0);
+    }
+}
+
+bool GLTFFile::load(const std::string& filename, std::string& err, std::string& warn)
+{
+    files.emplace_back(new MappedFile());
+    const MappedFile& file = *files.back();
+    if (!files.back()->open(filename))
+    {
+        err += "Failed to read " + filename + "\n";
+        return false;
+    }
+    const std::string baseDir = directoryOf(filename);
+
+    const char* json = reinterpret_cast<const char*>(file.data());
+    size_t jsonLength = file.size();
+    const unsigned char* bin = nullptr;
+    size_t binLength = 0;
+    if (file.size() >= 4 && readU32(file.data()) == glbMagic
+        && !parseGLB(file, json, jsonLength, bin, binLength, err))
+    {
+        return false;
+    }
+
+    nlohmann::json doc = nlohmann::json::parse(json, json + jsonLength, nullptr, false);
+    if (doc.is_discarded() || !doc.is_object())
+    {
+        err += "Invalid glTF JSON in " + filename + "\n";
+        return false;
+    }
+    doc.erase("images");
+
+    // point the binary chunk and external buffers at mapped files, and have
+    // tinygltf load data URIs, which only small assets use
+    std::vector<const unsigned char*> mappedData;
+    std::vector<size_t> mappedSize;
+    auto buffers = doc.find("buffers");
+    if (buffers != doc.end() && buffers->is_array())
+    {
+        for (size_t i = 0; i < buffers->size(); ++i)
+        {
+            nlohmann::json& buffer = (*buffers)[i];
+            auto byteLength = buffer.find("byteLength");
+            auto uri = buffer.find("uri");
+            const unsigned char* data = nullptr;
+            size_t size = 0;
+            if (uri == buffer.end() && bin)
+            {
+                data = bin;
+                size = binLength;
+            }
+            else if (uri != buffer.end() && uri->is_string() && uri->get<std::string>().compare(0, 5, "data:") != 0)
+            {
+                std::string path = urlDecode(uri->get<std::string>());
+                path = baseDir.empty() ? path : baseDir + "/" + path;
+                files.emplace_back(new MappedFile());
+                if (!files.back()->open(path))
+                {
+                    err += "Failed to read buffer " + path + "\n";
+                    return false;
+                }
+                data = files.back()->data();
+                size = files.back()->size();
+            }
+            if (data)
+            {
+                if (byteLength == buffer.end() || !byteLength->is_number() || byteLength->get<double>() > size)
+                {
+                    err += "Buffer " + std::to_string(i) + " is shorter than its byteLength\n";
+                    return false;
+                }
+                size = byteLength->get<size_t>();
+                buffer["uri"] = stubBufferURI;
+                buffer["byteLength"] = 1;
+            }
+            mappedData.push_back(data);
+            mappedSize.push_back(size);
+        }
+    }
+
+    std::string text = doc.dump();
+    tinygltf::TinyGLTF loader;
+    if (!loader.LoadASCIIFromString(&model, &err, &warn, text.c_str(), (unsigned int)text.size(), baseDir))
+    {
+        return false;
+    }
+
+    bufferData.assign(model.buffers.size(), nullptr);
+    bufferSize.assign(model.buffers.size(), 0);
+    for (size_t i = 0; i < model.buffers.size(); ++i)
+    {
+        if (i < mappedData.size() && mappedData[i])
+        {
+            bufferData[i] = mappedData[i];
+            bufferSize[i] = mappedSize[i];
+        }
+        else
+        {
+            bufferData[i] = model.buffers[i].data.data();
+            bufferSize[i] = model.buffers[i].data.size();
+        }
+    }
+    return true;
+}
+
+AccessorView GLTFFile::accessor(int index) const
+{
+    AccessorView view;
+    if (index < 0 || index >= (int)model.accessors.size())
+    {
+        return view;
+    }
+    const tinygltf::Accessor& accessor = model.accessors[index];
+    view.componentType = accessor.componentType;
+    view.numComponents = tinygltf::GetNumComponentsInType(accessor.type);
+    view.normalized = accessor.normalized;
+    view.count = accessor.count;
+    if (accessor.bufferView < 0)
+    {
+        return view;
+    }
+
+    const tinygltf::BufferView& bufferView = model.bufferViews[accessor.bufferView];
+    const int stride = accessor.ByteStride(bufferView);
+    const int componentSize = tinygltf::GetComponentSizeInBytes(accessor.componentType);
+    if (stride <= 0 || componentSize <= 0 || view.numComponents <= 0 || bufferView.buffer < 0
+        || bufferView.buffer >= (int)bufferData.size())
+    {
+        return AccessorView();
+    }
+    const size_t begin = bufferView.byteOffset + accessor.byteOffset;
+    const size_t end = std::min(bufferSize[bufferView.buffer], bufferView.byteOffset + bufferView.byteLength);
+    const size_t last = view.count > 0 ? begin + (view.count - 1) * stride + view.numComponents * componentSize : begin;
+    if (last > end)
+    {
+        return AccessorView();
+    }
+    view.data = bufferData[bufferView.buffer] + begin;
+    view.stride = stride;
+    return view;
+}
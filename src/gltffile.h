@@ -0,0 +1,92 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <tiny_gltf.h>
+#include "glm/glm.hpp"
+
+/**
+ * Read-only bytes of a file, mapped into memory, or read into it if mapping
+ * fails.
+ */
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile();
+
+    bool open(const std::string& path);
+    const unsigned char* data() const { return bytes; }
+    size_t size() const { return length; }
+
+private:
+    const unsigned char* bytes = nullptr;
+    size_t length = 0;
+    bool mapped = false;
+    std::vector<unsigned char> contents;
+#ifdef _WIN32
+    void* file = nullptr;
+    void* mapping = nullptr;
+#endif
+};
+
+/**
+ * Elements of a glTF accessor where they lie in their buffer: count elements
+ * of numComponents components each, stride bytes apart. Components of any
+ * type are read as floats, normalized integers mapped to [0, 1] or [-1, 1].
+ * An accessor without a buffer view has a null data and reads as zeros.
+ */
+struct AccessorView
+{
+    const unsigned char* data = nullptr;
+    size_t stride = 0;
+    size_t count = 0;
+    int componentType = TINYGLTF_COMPONENT_TYPE_FLOAT;
+    int numComponents = 0;
+    bool normalized = false;
+
+    float component(size_t i, int c) const;
+
+    /**
+     * Element i with its missing components 0.
+     */
+    glm::vec4 element(size_t i) const;
+
+    /**
+     * Component 0 of element i as an unsigned integer, for index accessors.
+     */
+    unsigned int index(size_t i) const;
+};
+
+/**
+ * A glTF model from a .gltf or .glb file. The binary chunk of a .glb and any
+ * external .bin buffers are mapped rather than copied: tinygltf only parses
+ * the JSON, with each of those buffers replaced by a 1-byte stand-in, and
+ * accessor() reads from the mapped files. Images aren't loaded, as materials
+ * come from the scene file.
+ */
+class GLTFFile
+{
+public:
+    tinygltf::Model model;
+
+    /**
+     * @return  Whether the file was parsed; err and warn get tinygltf's
+     *          messages and ours.
+     */
+    bool load(const std::string& filename, std::string& err, std::string& warn);
+
+    /**
+     * View of accessor index, or an empty one if it's out of its buffer.
+     */
+    AccessorView accessor(int index) const;
+
+private:
+    std::vector<std::unique_ptr<MappedFile>> files;
+    // per buffer of model; null where tinygltf holds the data itself
+    std::vector<const unsigned char*> bufferData;
+    std::vector<size_t> bufferSize;
+};
@@ -41,6 +41,122 @@ glm::vec3 calculateRandomDirectionInHemisphere(
         + sin(around) * over * perpendicularDirection2;
 }
 
+/**
+ * BSDF type of a material, in the same order of precedence as scatterRay.
+ */
+__host__ __device__ inline int bsdfType(const Material& m)
+{
+    if (m.emittance > 0.f)
+    {
+        return BSDF_EMISSIVE;
+    }
+    if (m.hasRefractive)
+    {
+        return BSDF_REFRACTIVE;
+    }
+    if (m.hasReflective)
+    {
+        return BSDF_REFLECTIVE;
+    }
+    return m.tex.offset >= 0 ? BSDF_DIFFUSE_TEXTURED : BSDF_DIFFUSE;
+}
+
+/**
+ * Scatters a ray off a surface of BSDF type Type, in place, attenuates the
+ * path's color and records the density of the new direction in bsdfPdf.
+ * Types that do not scatter (emissive) leave the path as is.
+ */
+template <int Type>
+__host__ __device__ inline void scatterBSDF(PathSegment&,
+                                            glm::vec3,
+                                            glm::vec3,
+                                            glm::vec2,
+                                            const Material&,
+                                            const glm::vec3*,
+                                            thrust::default_random_engine&)
+{
+}
+
+template <>
+__host__ __device__ inline void scatterBSDF<BSDF_REFRACTIVE>(PathSegment& pathSegment,
+                                                             glm::vec3 intersect,
+                                                             glm::vec3 normal,
+                                                             glm::vec2 uv,
+                                                             const Material& m,
+                                                             const glm::vec3* texData,
+                                                             thrust::default_random_engine& rng)
+{
+    glm::vec3 dir = pathSegment.ray.direction;
+    float ior = m.indexOfRefraction;
+    float cosAngle = glm::dot(dir, -normal);
+    float fresnel = (1.f - ior) / (1.f + ior);
+    fresnel *= fresnel;
+    fresnel = fresnel + (1.f - fresnel) * pow((1.f - cosAngle), 5);
+
+    thrust::uniform_real_distribution<float> u01(0, 1);
+    if (u01(rng) < fresnel)
+    {
+        pathSegment.ray.origin = intersect;
+        pathSegment.ray.direction = glm::reflect(dir, normal);
+        pathSegment.color *= m.specular.color;
+    }
+    else
+    {
+        pathSegment.ray.origin = intersect + dir * .0002f;
+        pathSegment.ray.direction = glm::refract(dir, normal, cosAngle > 0.f ? 1.f / ior : ior);
+        pathSegment.color *= m.color;
+    }
+    pathSegment.bsdfPdf = 0.f;
+}
+
+template <>
+__host__ __device__ inline void scatterBSDF<BSDF_REFLECTIVE>(PathSegment& pathSegment,
+                                                             glm::vec3 intersect,
+                                                             glm::vec3 normal,
+                                                             glm::vec2 uv,
+                                                             const Material& m,
+                                                             const glm::vec3* texData,
+                                                             thrust::default_random_engine& rng)
+{
+    pathSegment.ray.origin = intersect;
+    pathSegment.ray.direction = glm::reflect(pathSegment.ray.direction, normal);
+    pathSegment.color *= m.specular.color;
+    pathSegment.bsdfPdf = 0.f;
+}
+
+template <>
+__host__ __device__ inline void scatterBSDF<BSDF_DIFFUSE>(PathSegment& pathSegment,
+                                                          glm::vec3 intersect,
+                                                          glm::vec3 normal,
+                                                          glm::vec2 uv,
+                                                          const Material& m,
+                                                          const glm::vec3* texData,
+                                                          thrust::default_random_engine& rng)
+{
+    pathSegment.ray.origin = intersect;
+    pathSegment.ray.direction = calculateRandomDirectionInHemisphere(normal, rng);
+    pathSegment.bsdfPdf = glm::max(glm::dot(pathSegment.ray.direction, normal), 0.f) / PI;
+    pathSegment.color *= m.color;
+}
+
+template <>
+__host__ __device__ inline void scatterBSDF<BSDF_DIFFUSE_TEXTURED>(PathSegment& pathSegment,
+                                                                   glm::vec3 intersect,
+                                                                   glm::vec3 normal,
+                                                                   glm::vec2 uv,
+                                                                   const Material& m,
+                                                                   const glm::vec3* texData,
+                                                                   thrust::default_random_engine& rng)
+{
+    pathSegment.ray.origin = intersect;
+    pathSegment.ray.direction = calculateRandomDirectionInHemisphere(normal, rng);
+    pathSegment.bsdfPdf = glm::max(glm::dot(pathSegment.ray.direction, normal), 0.f) / PI;
+    int w = m.tex.width;
+    int x = uv.x * (w - 1);
+    int y = uv.y * (m.tex.height - 1);
+    pathSegment.color *= m.color * texData[m.tex.offset + y * w + x];
+}
+
 /**
  * Scatter a ray with some probabilities according to the material properties.
  * For example, a diffuse surface scatters in a cosine-weighted hemisphere.
@@ -64,8 +180,11 @@ glm::vec3 calculateRandomDirectionInHemisphere(
  * This method applies its changes to the Ray parameter `ray` in place.
  * It also modifies the color `color` of the ray in place.
  *
+ * Branches for material features that are not in Features are compiled out.
+ *
  * You may need to change the parameter list for your purposes!
  */
+template <int Features>
 __host__ __device__ void scatterRay(PathSegment& pathSegment,
                                     glm::vec3 intersect,
                                     glm::vec3 normal,
@@ -74,50 +193,20 @@ __host__ __device__ void scatterRay(PathSegment& pathSegment,
                                     const glm::vec3* texData,
                                     thrust::default_random_engine& rng) 
 {
-    glm::vec3 dir = pathSegment.ray.direction;
-
-    if (m.hasRefractive)
+    if ((Features & FEATURE_REFRACTIVE) && m.hasRefractive)
     {
-        float ior = m.indexOfRefraction;
-        float cosAngle = glm::dot(dir, -normal);
-        float fresnel = (1.f - ior) / (1.f + ior);
-        fresnel *= fresnel;
-        fresnel = fresnel + (1.f - fresnel) * pow((1.f - cosAngle), 5);
-
-        thrust::uniform_real_distribution<float> u01(0, 1);
-        if (u01(rng) < fresnel)
-        {
-            pathSegment.ray.origin = intersect;
-            pathSegment.ray.direction = glm::reflect(dir, normal);
-            pathSegment.color *= m.specular.color;
-        }
-        else
-        {
-            pathSegment.ray.origin = intersect + dir * .0002f;
-            pathSegment.ray.direction = glm::refract(dir, normal, cosAngle > 0.f ? 1.f / ior : ior);
-            pathSegment.color *= m.color;
-        }
+        scatterBSDF<BSDF_REFRACTIVE>(pathSegment, intersect, normal, uv, m, texData, rng);
     }
-    else if (m.hasReflective)
+    else if ((Features & FEATURE_REFLECTIVE) && m.hasReflective)
     {
-        pathSegment.ray.origin = intersect;
-        pathSegment.ray.direction = glm::reflect(dir, normal);
-        pathSegment.color *= m.specular.color;
+        scatterBSDF<BSDF_REFLECTIVE>(pathSegment, intersect, normal, uv, m, texData, rng);
+    }
+    else if ((Features & FEATURE_TEXTURE) && m.tex.offset >= 0)
+    {
+        scatterBSDF<BSDF_DIFFUSE_TEXTURED>(pathSegment, intersect, normal, uv, m, texData, rng);
     }
     else
     {
-        pathSegment.ray.origin = intersect;
-        pathSegment.ray.direction = calculateRandomDirectionInHemisphere(normal, rng);
-        glm::vec3 col = m.color;
-        int offset = m.tex.offset;
-        if (offset >= 0)
-        {
-            int w = m.tex.width;
-            int x = uv.x * (w - 1);
-            int y = uv.y * (m.tex.height - 1);
-            col *= texData[offset + y * w + x];
-            //col = glm::vec3(uv.x, uv.y, 0.95f);
-        }
-        pathSegment.color *= col;
+        scatterBSDF<BSDF_DIFFUSE>(pathSegment, intersect, normal, uv, m, texData, rng);
     }
 }
@@ -3,6 +3,7 @@
 #include <glm/glm.hpp>
 #include <glm/gtx/intersect.hpp>
 
+#include "packedtriangle.h"
 #include "sceneStructs.h"
 #include "utilities.h"
 
@@ -143,8 +144,16 @@ __host__ __device__ float sphereIntersectionTest(Geom sphere, Ray r,
     return glm::length(r.origin - intersectionPoint);
 }
 
+/**
+ * Test intersection between a ray and a triangle of a mesh, in the mesh's
+ * object space. Normal mapping is only applied when Features includes
+ * FEATURE_BUMP. The triangle can be a Triangle or a PackedTriangle.
+ *
+ * @return  Ray parameter `t` value. -1 if no intersection.
+ */
+template <int Features, typename TriangleType>
 __host__ __device__ float triangleIntersectionTest(Geom geom,
-                                                   Triangle tri,
+                                                   TriangleType tri,
                                                    Ray r,
                                                    const Material& mat,
                                                    const glm::vec3* texData,
@@ -165,16 +174,18 @@ __host__ __device__ float triangleIntersectionTest(Geom geom,
     intersectionPoint = multiplyMV(geom.transform, glm::vec4(getPointOnRay(rt, baryPos.z), 1.f));
     baryPos.z = 1.f - baryPos.x - baryPos.y;
 
-    uv = glm::fract(baryPos.z * tri.uv[0] + baryPos.x * tri.uv[1] + baryPos.y * tri.uv[2]);
+    uv = glm::fract(baryPos.z * triangleUV(tri, 0) + baryPos.x * triangleUV(tri, 1) + baryPos.y * triangleUV(tri, 2));
 
-    glm::vec3 n = baryPos.z * tri.normal[0] + baryPos.x * tri.normal[1] + baryPos.y * tri.normal[2];
+    glm::vec3 n = baryPos.z * triangleNormal(tri, 0) + baryPos.x * triangleNormal(tri, 1)
+                  + baryPos.y * triangleNormal(tri, 2);
     int offset = mat.bump.offset;
-    if (offset >= 0)
+    if ((Features & FEATURE_BUMP) && offset >= 0)
     {
         int w = mat.bump.width;
         int x = uv.x * (w - 1);
         int y = uv.y * (mat.bump.height - 1);
-        glm::vec4 t = baryPos.z * tri.tangent[0] + baryPos.x * tri.tangent[1] + baryPos.y * tri.tangent[2];
+        glm::vec4 t = baryPos.z * triangleTangent(tri, 0) + baryPos.x * triangleTangent(tri, 1)
+                      + baryPos.y * triangleTangent(tri, 2);
         glm::vec3 b = glm::cross(n, glm::vec3(t)) * t.w;
         n = glm::mat3(glm::vec3(t), b, n) * texData[offset + y * w + x];
     }
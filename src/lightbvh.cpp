@@ -0,0 +1,344 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+#include "lightbvh.h"
+
+namespace {
+
+const int numBuckets = 12;
+// Below this depth lights are split by the heuristic; further down, at the
+// median, so no trail gets longer than 64 branches.
+const int maxHeuristicDepth = 32;
+
+// Bounds of one light or a group of them, see LightBVHNode.
+struct LightBounds
+{
+    AABB bounds;
+    glm::vec3 axis = glm::vec3(0.f, 0.f, 1.f);
+    float cosThetaO = 1.f;
+    float cosThetaE = 1.f;
+    float power = 0.f;
+    bool twoSided = false;
+    glm::vec3 centroid;
+};
+
+float luminance(glm::vec3 c)
+{
+    return glm::dot(c, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+float surfaceArea(const AABB& aabb)
+{
+    glm::vec3 d = glm::max(aabb.bound[1] - aabb.bound[0], glm::vec3(0.f));
+    return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+AABB merge(const AABB& a, const AABB& b)
+{
+    AABB m;
+    m.bound[0] = glm::min(a.bound[0], b.bound[0]);
+    m.bound[1] = glm::max(a.bound[1], b.bound[1]);
+    return m;
+}
+
+// Rotates v by angle about the unit axis k (Rodrigues).
+glm::vec3 rotate(glm::vec3 v, float angle, glm::vec3 k)
+{
+    return v * cosf(angle) + glm::cross(k, v) * sinf(angle) + k * glm::dot(k, v) * (1.f - cosf(angle));
+}
+
+// Smallest cone around both cones (axis, cosTheta), written to a.
+void mergeCones(glm::vec3& axisA, float& cosA, glm::vec3 axisB, float cosB)
+{
+    float thetaA = acosf(glm::clamp(cosA, -1.f, 1.f));
+    float thetaB = acosf(glm::clamp(cosB, -1.f, 1.f));
+    float thetaD = acosf(glm::clamp(glm::dot(axisA, axisB), -1.f, 1.f));
+    if (std::min(thetaD + thetaB, PI) <= thetaA)
+    {
+        return;
+    }
+    if (std::min(thetaD + thetaA, PI) <= thetaB)
+    {
+        axisA = axisB;
+        cosA = cosB;
+        return;
+    }
+    float thetaO = 0.5f * (thetaA + thetaD + thetaB);
+    glm::vec3 k = glm::cross(axisA, axisB);
+    if (thetaO >= PI || glm::dot(k, k) == 0.f)
+    {
+        cosA = -1.f;
+        return;
+    }
+    axisA = glm::normalize(rotate(axisA, thetaO - thetaA, glm::normalize(k)));
+    cosA = cosf(thetaO);
+}
+
+LightBounds merge(const LightBounds& a, const LightBounds& b)
+{
+    if (a.power == 0.f)
+    {
+        return b;
+    }
+    if (b.power == 0.f)
+    {
+        return a;
+    }
+    LightBounds m = a;
+    m.bounds = merge(a.bounds, b.bounds);
+    mergeCones(m.axis, m.cosThetaO, b.axis, b.cosThetaO);
+    m.cosThetaE = std::min(a.cosThetaE, b.cosThetaE);
+    m.power = a.power + b.power;
+    m.twoSided = a.twoSided || b.twoSided;
+    return m;
+}
+
+// Surface area orientation heuristic: power times the solid angle measure of
+// the cones times the box area, with thin boxes along the split axis
+// penalized.
+float cost(const LightBounds& b, const AABB& parent, int axis)
+{
+    float thetaO = acosf(glm::clamp(b.cosThetaO, -1.f, 1.f));
+    float thetaE = acosf(glm::clamp(b.cosThetaE, -1.f, 1.f));
+    float thetaW = std::min(thetaO + thetaE, PI);
+    float sinThetaO = safeSqrt(1.f - b.cosThetaO * b.cosThetaO);
+    float mOmega = TWO_PI * (1.f - b.cosThetaO)
+                   + PI / 2.f * (2.f * thetaW * sinThetaO - cosf(thetaO - 2.f * thetaW)
+                                 - 2.f * thetaO * sinThetaO + b.cosThetaO);
+    glm::vec3 d = parent.bound[1] - parent.bound[0];
+    float kr = d[axis] > 0.f ? std::max(d.x, std::max(d.y, d.z)) / d[axis] : 0.f;
+    return b.power * mOmega * kr * surfaceArea(b.bounds);
+}
+
+LightBounds triangleBounds(const Geom& geom, const Triangle& tri, float radiance)
+{
+    LightBounds b;
+    glm::vec3 p[3];
+    for (int i = 0; i < 3; ++i)
+    {
+        p[i] = glm::vec3(geom.transform * glm::vec4(tri.pos[i], 1.f));
+        b.bounds.bound[0] = glm::min(b.bounds.bound[0], p[i]);
+        b.bounds.bound[1] = glm::max(b.bounds.bound[1], p[i]);
+    }
+    glm::vec3 n = glm::cross(p[1] - p[0], p[2] - p[0]);
+    float area = 0.5f * glm::length(n);
+    if (area > 0.f)
+    {
+        b.axis = glm::normalize(n);
+    }
+    // emits from both faces, into the hemisphere around each
+    b.cosThetaO = 1.f;
+    b.cosThetaE = 0.f;
+    b.twoSided = true;
+    b.power = 2.f * area * radiance;
+    b.centroid = (p[0] + p[1] + p[2]) / 3.f;
+    return b;
+}
+
+LightBounds primitiveBounds(const Geom& geom, float radiance)
+{
+    LightBounds b;
+    glm::vec3 axes[3];
+    for (int i = 0; i < 3; ++i)
+    {
+        axes[i] = 0.5f * glm::vec3(geom.transform[i]);
+    }
+    for (int i = 0; i < 8; ++i)
+    {
+        glm::vec3 corner(geom.transform[3]);
+        for (int a = 0; a < 3; ++a)
+        {
+            corner += i & (1 << a) ? axes[a] : -axes[a];
+        }
+        b.bounds.bound[0] = glm::min(b.bounds.bound[0], corner);
+        b.bounds.bound[1] = glm::max(b.bounds.bound[1], corner);
+    }
+
+    float area;
+    float la = glm::length(axes[0]), lb = glm::length(axes[1]), lc = glm::length(axes[2]);
+    if (geom.type == SPHERE)
+    {
+        // Knud Thomsen's approximation of an ellipsoid's area
+        const float p = 1.6075f;
+        area = 4.f * PI * powf((powf(la * lb, p) + powf(lb * lc, p) + powf(lc * la, p)) / 3.f, 1.f / p);
+    }
+    else
+    {
+        area = 8.f * (glm::length(glm::cross(axes[0], axes[1])) + glm::length(glm::cross(axes[1], axes[2]))
+                      + glm::length(glm::cross(axes[2], axes[0])));
+    }
+    // normals in every direction, each emitting into its hemisphere
+    b.cosThetaO = -1.f;
+    b.cosThetaE = 0.f;
+    b.power = area * radiance;
+    b.centroid = glm::vec3(geom.transform[3]);
+    return b;
+}
+
+// Builds the tree over a permutation of the light indices; lights stay in
+// geom order, so a geom's lightBeginIdx keeps pointing at its lights.
+struct Builder
+{
+    std::vector<Light>& lights;
+    std::vector<LightBVHNode>& nodes;
+    const std::vector<LightBounds>& bounds;
+    std::vector<int> items;
+    int maxDepth;
+
+    // Builds the subtree over items [begin, end) and returns its root.
+    int build(int begin, int end, int depth, unsigned long long trail)
+    {
+        maxDepth = std::max(maxDepth, depth);
+        int index = nodes.size();
+        nodes.emplace_back();
+
+        LightBounds total;
+        AABB centroids;
+        for (int i = begin; i < end; ++i)
+        {
+            const LightBounds& b = bounds[items[i]];
+            total = merge(total, b);
+            centroids.bound[0] = glm::min(centroids.bound[0], b.centroid);
+            centroids.bound[1] = glm::max(centroids.bound[1], b.centroid);
+        }
+
+        if (end - begin == 1)
+        {
+            lights[items[begin]].trail = trail;
+            setNode(nodes[index], total, items[begin], true);
+            return index;
+        }
+
+        int mid = depth < maxHeuristicDepth ? splitByCost(begin, end, total, centroids) : -1;
+        if (mid <= begin || mid >= end)
+        {
+            glm::vec3 extent = centroids.bound[1] - centroids.bound[0];
+            int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+            mid = (begin + end) / 2;
+            std::nth_element(items.begin() + begin, items.begin() + mid, items.begin() + end, [&](int a, int b) {
+                return bounds[a].centroid[axis] < bounds[b].centroid[axis];
+            });
+        }
+
+        build(begin, mid, depth + 1, trail);
+        int second = build(mid, end, depth + 1, trail | (1ull << depth));
+        setNode(nodes[index], total, second, false);
+        return index;
+    }
+
+    // Partitions [begin, end) at the cheapest bucket boundary over all axes
+    // and returns the split; -1 if the centroids coincide.
+    int splitByCost(int begin, int end, const LightBounds& total, const AABB& centroids)
+    {
+        float bestCost = INFINITY;
+        int bestAxis = -1, bestBucket = -1;
+        glm::vec3 extent = centroids.bound[1] - centroids.bound[0];
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            if (extent[axis] <= 0.f)
+            {
+                continue;
+            }
+            LightBounds buckets[numBuckets];
+            for (int i = begin; i < end; ++i)
+            {
+                int b = bucketOf(bounds[items[i]].centroid[axis], centroids, axis);
+                buckets[b] = merge(buckets[b], bounds[items[i]]);
+            }
+            LightBounds below[numBuckets];
+            below[0] = buckets[0];
+            for (int b = 1; b < numBuckets; ++b)
+            {
+                below[b] = merge(below[b - 1], buckets[b]);
+            }
+            LightBounds above;
+            for (int b = numBuckets - 1; b > 0; --b)
+            {
+                above = merge(above, buckets[b]);
+                float c = cost(below[b - 1], total.bounds, axis) + cost(above, total.bounds, axis);
+                if (c < bestCost)
+                {
+                    bestCost = c;
+                    bestAxis = axis;
+                    bestBucket = b;
+                }
+            }
+        }
+        if (bestAxis < 0)
+        {
+            return -1;
+        }
+
+        auto split = std::stable_partition(items.begin() + begin, items.begin() + end, [&](int light) {
+            return bucketOf(bounds[light].centroid[bestAxis], centroids, bestAxis) < bestBucket;
+        });
+        return split - items.begin();
+    }
+
+    int bucketOf(float c, const AABB& centroids, int axis) const
+    {
+        float t = (c - centroids.bound[0][axis]) / (centroids.bound[1][axis] - centroids.bound[0][axis]);
+        return glm::clamp((int)(t * numBuckets), 0, numBuckets - 1);
+    }
+
+    static void setNode(LightBVHNode& node, const LightBounds& b, int child, bool leaf)
+    {
+        node.bounds = b.bounds;
+        node.axis = b.axis;
+        node.cosThetaO = b.cosThetaO;
+        node.cosThetaE = b.cosThetaE;
+        node.power = b.power;
+        node.child = child;
+        node.leaf = leaf;
+        node.twoSided = b.twoSided;
+    }
+};
+}
+
+void buildLightBVH(std::vector<Geom>& geoms, const std::vector<Triangle>& triangles,
+                   const std::vector<Material>& materials, std::vector<Light>& lights,
+                   std::vector<LightBVHNode>& nodes)
+{
+    lights.clear();
+    nodes.clear();
+    std::vector<LightBounds> bounds;
+    for (int g = 0; g < (int)geoms.size(); ++g)
+    {
+        Geom& geom = geoms[g];
+        geom.lightBeginIdx = -1;
+        const Material& mat = materials[geom.materialid];
+        float radiance = luminance(mat.color) * mat.emittance;
+        if (mat.emittance <= 0.f || radiance <= 0.f)
+        {
+            continue;
+        }
+        geom.lightBeginIdx = lights.size();
+        if (geom.type == MESH)
+        {
+            for (int t = geom.triBeginIdx; t < geom.triEndIdx; ++t)
+            {
+                lights.push_back({ g, t, 0ull });
+                bounds.push_back(triangleBounds(geom, triangles[t], radiance));
+            }
+        }
+        else
+        {
+            lights.push_back({ g, -1, 0ull });
+            bounds.push_back(primitiveBounds(geom, radiance));
+        }
+    }
+    if (lights.empty())
+    {
+        return;
+    }
+
+    Builder builder = { lights, nodes, bounds, std::vector<int>(lights.size()), 0 };
+    for (size_t i = 0; i < lights.size(); ++i)
+    {
+        builder.items[i] = i;
+    }
+    builder.build(0, lights.size(), 0, 0ull);
+    std::cout << "Light BVH: " << lights.size() << " lights, " << nodes.size() << " nodes, depth "
+              << builder.maxDepth << std::endl;
+}
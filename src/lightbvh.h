@@ -0,0 +1,285 @@
+#pragma once
+
+#include <vector>
+#include <cuda_runtime.h>
+#include <thrust/random.h>
+#include "glm/glm.hpp"
+#include "sceneStructs.h"
+#include "utilities.h"
+
+/**
+ * An emitter: a whole sphere or cube, or one triangle of a mesh.
+ * trail holds the branches from the light BVH's root to the light's leaf,
+ * bit i set if the second child was taken at depth i.
+ */
+struct Light
+{
+    int geom;
+    int tri;                    // index into the scene's triangles, -1 for primitives
+    unsigned long long trail;
+};
+
+/**
+ * Node of the binary light BVH. Bounds cover the positions of the lights
+ * below, which emit within cosThetaE of a direction in the cone of
+ * half-angle acos(cosThetaO) around axis (or its opposite, if twoSided).
+ * The first child directly follows an inner node; `child` is the second one,
+ * or the light index in a leaf.
+ */
+struct LightBVHNode
+{
+    AABB bounds;
+    glm::vec3 axis;
+    float cosThetaO;
+    float cosThetaE;
+    float power;
+    int child;
+    unsigned char leaf;
+    unsigned char twoSided;
+};
+
+/**
+ * Light BVH as passed to the kernels. numLights == 0 means there is nothing
+ * to sample.
+ */
+struct LightBVH
+{
+    const LightBVHNode* nodes = nullptr;
+    const Light* lights = nullptr;
+    int numLights = 0;
+};
+
+/**
+ * Builds a light BVH over every primitive and mesh triangle with an emissive
+ * material, splitting by the surface area orientation heuristic. Sets each
+ * geom's lightBeginIdx: a primitive's light, or the light of its first
+ * triangle, the others following in triangle order.
+ */
+void buildLightBVH(std::vector<Geom>& geoms, const std::vector<Triangle>& triangles,
+                   const std::vector<Material>& materials, std::vector<Light>& lights,
+                   std::vector<LightBVHNode>& nodes);
+
+__host__ __device__ inline float safeSqrt(float x)
+{
+    return sqrtf(glm::max(x, 0.f));
+}
+
+/**
+ * Estimated contribution of the lights below a node to point p, an upper
+ * bound on their power over distance squared times the cosine at the
+ * emitters. Zero only if none of them can reach p.
+ */
+__host__ __device__ inline float lightImportance(const LightBVHNode& node, glm::vec3 p)
+{
+    glm::vec3 center = 0.5f * (node.bounds.bound[0] + node.bounds.bound[1]);
+    glm::vec3 diagonal = node.bounds.bound[1] - node.bounds.bound[0];
+    glm::vec3 toP = p - center;
+    float distance2 = glm::dot(toP, toP);
+    // a point inside the bounds would otherwise get an unbounded importance
+    float d2 = glm::max(distance2, 0.5f * glm::length(diagonal));
+
+    float cosThetaW = distance2 > 0.f ? glm::dot(node.axis, toP) / sqrtf(distance2) : 1.f;
+    if (node.twoSided)
+    {
+        cosThetaW = fabsf(cosThetaW);
+    }
+    float sinThetaW = safeSqrt(1.f - cosThetaW * cosThetaW);
+
+    // directions the bounds subtend from p, as a cone around the direction to
+    // their center
+    float radius2 = 0.25f * glm::dot(diagonal, diagonal);
+    float cosThetaB = distance2 > radius2 ? safeSqrt(1.f - radius2 / distance2) : -1.f;
+    float sinThetaB = safeSqrt(1.f - cosThetaB * cosThetaB);
+
+    // angle to p minus the cone's and the subtended angles, clamped at 0
+    float sinThetaO = safeSqrt(1.f - node.cosThetaO * node.cosThetaO);
+    float cosThetaX = cosThetaW > node.cosThetaO ? 1.f : cosThetaW * node.cosThetaO + sinThetaW * sinThetaO;
+    float sinThetaX = cosThetaW > node.cosThetaO ? 0.f : sinThetaW * node.cosThetaO - cosThetaW * sinThetaO;
+    float cosThetaP = cosThetaX > cosThetaB ? 1.f : cosThetaX * cosThetaB + sinThetaX * sinThetaB;
+    if (cosThetaP <= node.cosThetaE)
+    {
+        return 0.f;
+    }
+    return node.power * cosThetaP / d2;
+}
+
+/**
+ * Picks a light for point p by walking down the BVH, taking each child with
+ * probability proportional to its importance. The random number u is
+ * rescaled at every step so one number serves the whole walk.
+ *
+ * @param pmf  Output probability of the light picked.
+ * @return     Index of the light, or -1 if no light can reach p.
+ */
+__host__ __device__ inline int pickLight(const LightBVH& bvh, glm::vec3 p, float u, float& pmf)
+{
+    pmf = 1.f;
+    int node = 0;
+    while (!bvh.nodes[node].leaf)
+    {
+        int first = node + 1;
+        int second = bvh.nodes[node].child;
+        float i0 = lightImportance(bvh.nodes[first], p);
+        float i1 = lightImportance(bvh.nodes[second], p);
+        if (i0 <= 0.f && i1 <= 0.f)
+        {
+            return -1;
+        }
+        float p0 = i0 / (i0 + i1);
+        if (u < p0)
+        {
+            node = first;
+            u = glm::min(u / p0, 0.99999994f);
+            pmf *= p0;
+        }
+        else
+        {
+            node = second;
+            u = glm::min((u - p0) / (1.f - p0), 0.99999994f);
+            pmf *= 1.f - p0;
+        }
+    }
+    return bvh.nodes[node].child;
+}
+
+/**
+ * Probability of pickLight choosing light `light` for point p.
+ */
+__host__ __device__ inline float pickLightPmf(const LightBVH& bvh, glm::vec3 p, int light)
+{
+    unsigned long long trail = bvh.lights[light].trail;
+    float pmf = 1.f;
+    int node = 0;
+    while (!bvh.nodes[node].leaf)
+    {
+        int first = node + 1;
+        int second = bvh.nodes[node].child;
+        float i0 = lightImportance(bvh.nodes[first], p);
+        float i1 = lightImportance(bvh.nodes[second], p);
+        if (i0 + i1 <= 0.f)
+        {
+            return 0.f;
+        }
+        if (trail & 1)
+        {
+            pmf *= i1 / (i0 + i1);
+            node = second;
+        }
+        else
+        {
+            pmf *= i0 / (i0 + i1);
+            node = first;
+        }
+        trail >>= 1;
+    }
+    return pmf;
+}
+
+/**
+ * Object space surface area and normal at an object space point of a sphere
+ * or cube, as the intersection tests define them.
+ */
+__host__ __device__ inline float primitiveArea(const Geom& geom)
+{
+    return geom.type == SPHERE ? PI : 6.f;
+}
+
+__host__ __device__ inline glm::vec3 primitiveNormal(const Geom& geom, glm::vec3 objPoint)
+{
+    if (geom.type == SPHERE)
+    {
+        return glm::normalize(objPoint);
+    }
+    glm::vec3 a = glm::abs(objPoint);
+    int axis = a.x > a.y ? (a.x > a.z ? 0 : 2) : (a.y > a.z ? 1 : 2);
+    glm::vec3 n(0.f);
+    n[axis] = objPoint[axis] > 0.f ? 1.f : -1.f;
+    return n;
+}
+
+/**
+ * World space density, per unit area, of a point sampled uniformly over a
+ * primitive's object space surface, where its object space normal is objNormal.
+ * The transform scales area there by |det M| |M^-T n|.
+ */
+__host__ __device__ inline float primitiveAreaPdf(const Geom& geom, glm::vec3 objNormal, glm::vec3& worldNormal)
+{
+    glm::vec3 n = glm::mat3(geom.invTranspose) * objNormal;
+    float nLength = glm::length(n);
+    worldNormal = n / nLength;
+    return 1.f / (primitiveArea(geom) * fabsf(glm::determinant(glm::mat3(geom.transform))) * nLength);
+}
+
+/**
+ * Samples a point uniformly over a triangle light's area, or uniformly over a
+ * primitive's object space surface.
+ *
+ * @param normal   Output world space normal at the point.
+ * @param areaPdf  Output density of the point per unit world space area.
+ */
+__host__ __device__ inline glm::vec3 sampleLightPoint(const Light& light, const Geom* geoms, const DeviceTriangle* tris,
+                                                      thrust::default_random_engine& rng,
+                                                      glm::vec3& normal, float& areaPdf)
+{
+    thrust::uniform_real_distribution<float> u01(0, 1);
+    const Geom& geom = geoms[light.geom];
+    float u1 = u01(rng);
+    float u2 = u01(rng);
+    if (light.tri >= 0)
+    {
+        const DeviceTriangle& tri = tris[light.tri];
+        glm::vec3 p0(geom.transform * glm::vec4(tri.pos[0], 1.f));
+        glm::vec3 p1(geom.transform * glm::vec4(tri.pos[1], 1.f));
+        glm::vec3 p2(geom.transform * glm::vec4(tri.pos[2], 1.f));
+        glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+        float nLength = glm::length(n);
+        normal = n / nLength;
+        areaPdf = 2.f / nLength;
+        float s = sqrtf(u1);
+        return (1.f - s) * p0 + s * (1.f - u2) * p1 + s * u2 * p2;
+    }
+
+    glm::vec3 objPoint;
+    if (geom.type == SPHERE)
+    {
+        float z = 1.f - 2.f * u1;
+        float r = safeSqrt(1.f - z * z);
+        float phi = TWO_PI * u2;
+        objPoint = 0.5f * glm::vec3(r * cosf(phi), r * sinf(phi), z);
+    }
+    else
+    {
+        int face = glm::min((int)(u01(rng) * 6.f), 5);
+        int axis = face / 2;
+        objPoint[axis] = face % 2 ? 0.5f : -0.5f;
+        objPoint[(axis + 1) % 3] = u1 - 0.5f;
+        objPoint[(axis + 2) % 3] = u2 - 0.5f;
+    }
+    areaPdf = primitiveAreaPdf(geom, primitiveNormal(geom, objPoint), normal);
+    return glm::vec3(geom.transform * glm::vec4(objPoint, 1.f));
+}
+
+/**
+ * Density per unit world space area with which sampleLightPoint produces the
+ * point p on light `light`.
+ *
+ * @param normal  Output world space normal at p.
+ */
+__host__ __device__ inline float lightPointPdf(const Light& light, const Geom* geoms, const DeviceTriangle* tris,
+                                               glm::vec3 p, glm::vec3& normal)
+{
+    const Geom& geom = geoms[light.geom];
+    if (light.tri >= 0)
+    {
+        const DeviceTriangle& tri = tris[light.tri];
+        glm::vec3 p0(geom.transform * glm::vec4(tri.pos[0], 1.f));
+        glm::vec3 p1(geom.transform * glm::vec4(tri.pos[1], 1.f));
+        glm::vec3 p2(geom.transform * glm::vec4(tri.pos[2], 1.f));
+        glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+        float nLength = glm::length(n);
+        normal = n / nLength;
+        return 2.f / nLength;
+    }
+    glm::vec3 objPoint(geom.inverseTransform * glm::vec4(p, 1.f));
+    return primitiveAreaPdf(geom, primitiveNormal(geom, objPoint), normal);
+}
@@ -1,6 +1,8 @@
 #include "main.h"
 #include "preview.h"
+#include <chrono>
 #include <cstring>
+#include <iomanip>
 
 static std::string startTimeString;
 
@@ -12,9 +14,36 @@ static double lastX;
 static double lastY;
 
 static bool camchanged = true;
+static bool pathtraceReady = false;
+
+// Dynamic resolution: while the camera moves, the render scale adapts so that
+// frames take about targetFrameMs; once the camera has been still for
+// stillMs, rendering goes back to full resolution.
+static const bool dynamicResolution = true;
+static const float targetFrameMs = 33.f;
+static const int stillMs = 250;
+static const int maxRenderScale = 4;
+static std::chrono::steady_clock::time_point lastFrameTime = std::chrono::steady_clock::now();
+static std::chrono::steady_clock::time_point lastCameraMove;
 static float dtheta = 0, dphi = 0;
 static glm::vec3 cammove;
 
+// Progress is printed, and the error estimate refreshed, every
+// progressSeconds. Target errors are only trusted from minErrorSamples
+// samples per pixel on.
+static const float progressSeconds = 2.f;
+static const int minErrorSamples = 16;
+static std::chrono::steady_clock::time_point renderStart;
+static std::chrono::steady_clock::time_point lastProgress;
+static int lastProgressIteration = 0;
+static float samplesPerSecond = 0.f;
+static float relativeError = -1.f;
+static std::string stopCriterion = "saved interactively";
+
+// Frame of an animated scene being rendered; each frame is saved when it
+// meets a stopping criterion, then the next one starts.
+static int animationFrame = 0;
+
 float zoom, theta, phi;
 glm::vec3 cameraPosition;
 glm::vec3 ogLookAt; // for recentering the camera
@@ -22,6 +51,7 @@ glm::vec3 ogLookAt; // for recentering the camera
 Scene *scene;
 RenderState *renderState;
 int iteration;
+int renderScale = 1;
 
 int width;
 int height;
@@ -41,7 +71,12 @@ int main(int argc, char** argv) {
     const char *sceneFile = argv[1];
 
     // Load scene file
+    std::chrono::steady_clock::time_point loadStart = std::chrono::steady_clock::now();
     scene = new Scene(sceneFile);
+    float loadTime = std::chrono::duration<float>(std::chrono::steady_clock::now() - loadStart).count();
+    printf("Loaded scene in %.2f s, peak host memory %.1f MB\n", loadTime,
+           utilityCore::peakResidentBytes() / (1024.f * 1024.f));
+    scene->setFrame(animationFrame);
 
     // Set up camera stuff from loaded path tracer settings
     iteration = 0;
@@ -75,8 +110,46 @@ int main(int argc, char** argv) {
     return 0;
 }
 
+// Samples per pixel in the current accumulation.
+static int samplesPerPixel() {
+    return iteration * pathtraceSamplesPerIteration();
+}
+
+static void restartProgress(std::chrono::steady_clock::time_point now) {
+    renderStart = lastProgress = now;
+    lastProgressIteration = 0;
+    samplesPerSecond = 0.f;
+    relativeError = -1.f;
+}
+
+// Traces the next iteration and displays it.
+static void renderIteration() {
+    uchar4 *pbo_dptr = NULL;
+    iteration++;
+    cudaGLMapBufferObject((void**)&pbo_dptr, pbo);
+
+    // execute the kernel
+    int frame = 0;
+    pathtrace(pbo_dptr, frame, iteration);
+
+    // unmap buffer object
+    cudaGLUnmapBufferObject(pbo);
+}
+
 void saveImage() {
-    float samples = iteration;
+    // the host image is only kept up to date at full resolution, so a
+    // reduced-resolution preview is replaced by a full-resolution iteration
+    if (renderScale > 1) {
+        printf("Rendering at full resolution to save\n");
+        renderScale = 1;
+        pathtraceSetRenderScale(1);
+        pathtraceRestart();
+        restartProgress(std::chrono::steady_clock::now());
+        iteration = 0;
+        renderIteration();
+    }
+
+    float samples = samplesPerPixel();
     // output image file
     image img(width, height);
 
@@ -90,16 +163,111 @@ void saveImage() {
 
     std::string filename = renderState->imageName;
     std::ostringstream ss;
-    ss << filename << "." << startTimeString << "." << samples << "samp";
+    if (renderState->frames > 1) {
+        // the sample count can differ between frames, so keep it out of sequence names
+        ss << filename << "." << startTimeString << "." << std::setw(4) << std::setfill('0') << animationFrame;
+    } else {
+        ss << filename << "." << startTimeString << "." << samples << "samp";
+    }
     filename = ss.str();
 
     // CHECKITOUT
     img.savePNG(filename);
     //img.saveHDR(filename);  // Save a Radiance HDR file
+    pathtraceSaveStats(filename, (int)samples);
+
+    relativeError = pathtraceRelativeError(iteration);
+    float elapsed = std::chrono::duration<float>(std::chrono::steady_clock::now() - renderStart).count();
+    std::ofstream metadata(filename + ".txt");
+    metadata << "frame: " << animationFrame << "/" << renderState->frames << std::endl
+             << "samples: " << samples << std::endl
+             << "render time: " << elapsed << " s" << std::endl
+             << "samples per second: " << (elapsed > 0.f ? samples / elapsed : 0.f) << std::endl
+             << "stopping criterion: " << stopCriterion << std::endl
+             << "estimated relative error: " << relativeError << std::endl
+             << "sample limit: " << renderState->iterations << std::endl
+             << "time budget: " << renderState->timeBudget << " s" << std::endl
+             << "samples per second floor: " << renderState->minSamplesPerSecond << std::endl
+             << "target error: " << renderState->targetError << std::endl;
+    std::cout << "Saved " << filename << ".txt." << std::endl;
+}
+
+// Returns the stopping criterion the render meets, or an empty string.
+static std::string stoppingCriterion(std::chrono::steady_clock::time_point now) {
+    float elapsed = std::chrono::duration<float>(now - renderStart).count();
+    if (samplesPerPixel() >= (int)renderState->iterations) {
+        return "iterations";
+    }
+    if (renderState->timeBudget > 0.f && elapsed >= renderState->timeBudget) {
+        return "time budget";
+    }
+    if (renderState->minSamplesPerSecond > 0.f && lastProgressIteration > 0
+        && samplesPerSecond < renderState->minSamplesPerSecond) {
+        return "samples per second floor";
+    }
+    if (renderState->targetError > 0.f && samplesPerPixel() >= minErrorSamples
+        && relativeError >= 0.f && relativeError <= renderState->targetError) {
+        return "target error";
+    }
+    return "";
+}
+
+// Every progressSeconds: measures the sample rate, refreshes the error
+// estimate and prints them with the time left until the first criterion.
+static void reportProgress(std::chrono::steady_clock::time_point now) {
+    float sinceLast = std::chrono::duration<float>(now - lastProgress).count();
+    if (sinceLast < progressSeconds) {
+        return;
+    }
+    samplesPerSecond = (iteration - lastProgressIteration) * pathtraceSamplesPerIteration() / sinceLast;
+    lastProgress = now;
+    lastProgressIteration = iteration;
+    relativeError = pathtraceRelativeError(iteration);
+
+    float elapsed = std::chrono::duration<float>(now - renderStart).count();
+    const int samples = samplesPerPixel();
+    float eta = samplesPerSecond > 0.f ? (renderState->iterations - samples) / samplesPerSecond : INFINITY;
+    if (renderState->timeBudget > 0.f) {
+        eta = std::min(eta, renderState->timeBudget - elapsed);
+    }
+    if (renderState->targetError > 0.f && relativeError > 0.f && samplesPerSecond > 0.f) {
+        // the error falls as 1 / sqrt(samples)
+        float ratio = relativeError / renderState->targetError;
+        float samplesNeeded = samples * ratio * ratio;
+        eta = std::min(eta, std::max(0.f, samplesNeeded - samples) / samplesPerSecond);
+    }
+    printf("%d/%u samples, %.1f s, %.1f samples/s, relative error %.4f, ETA %.0f s\n",
+           samples, renderState->iterations, elapsed, samplesPerSecond, relativeError, std::max(0.f, eta));
+}
+
+// Picks this frame's render scale and restarts the accumulation if it changed.
+static void updateRenderScale(float frameMs, std::chrono::steady_clock::time_point now) {
+    bool moving = now - lastCameraMove < std::chrono::milliseconds(stillMs);
+    int scale = renderScale;
+    if (!moving) {
+        scale = 1;
+    } else if (frameMs > targetFrameMs * 1.25f) {
+        scale = std::min(scale + 1, maxRenderScale);
+    } else if (frameMs < targetFrameMs * .5f) {
+        scale = std::max(scale - 1, 1);
+    }
+
+    if (scale != renderScale) {
+        renderScale = scale;
+        pathtraceSetRenderScale(scale);
+        iteration = 0;
+    }
 }
 
 void runCuda() {
+    auto now = std::chrono::steady_clock::now();
+    float frameMs = std::chrono::duration<float, std::milli>(now - lastFrameTime).count();
+    lastFrameTime = now;
+
     if (camchanged) {
+        if (pathtraceReady) {
+            lastCameraMove = now;
+        }
         iteration = 0;
         Camera &cam = renderState->camera;
         cameraPosition.x = zoom * sin(phi) * sin(theta);
@@ -122,24 +290,36 @@ void runCuda() {
     // Map OpenGL buffer object for writing from CUDA on a single GPU
     // No data is moved (Win & Linux). When mapped to CUDA, OpenGL should not use this buffer
 
-    if (iteration == 0) {
-        pathtraceFree();
-        pathtraceInit(scene);
+    if (dynamicResolution && pathtraceReady) {
+        updateRenderScale(frameMs, now);
     }
 
-    if (iteration < renderState->iterations) {
-        uchar4 *pbo_dptr = NULL;
-        iteration++;
-        cudaGLMapBufferObject((void**)&pbo_dptr, pbo);
-
-        // execute the kernel
-        int frame = 0;
-        pathtrace(pbo_dptr, frame, iteration);
+    if (iteration == 0) {
+        if (pathtraceReady) {
+            pathtraceRestart();
+        } else {
+            pathtraceFree();
+            pathtraceInit(scene);
+            pathtraceReady = true;
+        }
+        restartProgress(now);
+    }
 
-        // unmap buffer object
-        cudaGLUnmapBufferObject(pbo);
+    std::string criterion = stoppingCriterion(now);
+    if (criterion.empty()) {
+        renderIteration();
+        reportProgress(std::chrono::steady_clock::now());
     } else {
+        stopCriterion = criterion;
+        printf("Stopping: %s\n", criterion.c_str());
         saveImage();
+        if (animationFrame + 1 < renderState->frames) {
+            animationFrame++;
+            printf("Rendering frame %d/%d\n", animationFrame + 1, renderState->frames);
+            pathtraceUpdateScene(scene->setFrame(animationFrame));
+            iteration = 0;
+            return;
+        }
         pathtraceFree();
         cudaDeviceReset();
         exit(EXIT_SUCCESS);
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <cuda_runtime.h>
+
+/**
+ * Spreads the lower 10 bits of v so that there are two zero bits between
+ * each of them, for interleaving three coordinates into a Morton code.
+ */
+__host__ __device__ inline unsigned int expandBits3(unsigned int v) {
+    v &= 0x3ff;
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+/**
+ * Spreads the lower 16 bits of v so that there is one zero bit between each
+ * of them, for interleaving two coordinates into a Morton code.
+ */
+__host__ __device__ inline unsigned int expandBits2(unsigned int v) {
+    v &= 0xffff;
+    v = (v | (v << 8)) & 0x00FF00FFu;
+    v = (v | (v << 4)) & 0x0F0F0F0Fu;
+    v = (v | (v << 2)) & 0x33333333u;
+    v = (v | (v << 1)) & 0x55555555u;
+    return v;
+}
+
+/**
+ * Inverse of expandBits2: gathers every other bit of v into the lower bits.
+ */
+__host__ __device__ inline unsigned int compactBits2(unsigned int v) {
+    v &= 0x55555555u;
+    v = (v | (v >> 1)) & 0x33333333u;
+    v = (v | (v >> 2)) & 0x0F0F0F0Fu;
+    v = (v | (v >> 4)) & 0x00FF00FFu;
+    v = (v | (v >> 8)) & 0x0000FFFFu;
+    return v;
+}
+
+__host__ __device__ inline unsigned int morton2D(unsigned int x, unsigned int y) {
+    return expandBits2(x) | (expandBits2(y) << 1);
+}
+
+__host__ __device__ inline unsigned int morton3D(unsigned int x, unsigned int y, unsigned int z) {
+    return expandBits3(x) | (expandBits3(y) << 1) | (expandBits3(z) << 2);
+}
+
+/**
+ * Octahedral mapping of a unit vector to [-1, 1]^2.
+ */
+__host__ __device__ inline glm::vec2 octEncode(glm::vec3 n) {
+    n /= glm::abs(n.x) + glm::abs(n.y) + glm::abs(n.z);
+    glm::vec2 p(n.x, n.y);
+    if (n.z < 0.f) {
+        p = (1.f - glm::abs(glm::vec2(n.y, n.x)))
+            * glm::vec2(n.x >= 0.f ? 1.f : -1.f, n.y >= 0.f ? 1.f : -1.f);
+    }
+    return p;
+}
+
+/**
+ * Inverse of octEncode.
+ */
+__host__ __device__ inline glm::vec3 octDecode(glm::vec2 p) {
+    glm::vec3 n(p.x, p.y, 1.f - glm::abs(p.x) - glm::abs(p.y));
+    if (n.z < 0.f) {
+        glm::vec2 xy = (1.f - glm::abs(glm::vec2(n.y, n.x)))
+            * glm::vec2(n.x >= 0.f ? 1.f : -1.f, n.y >= 0.f ? 1.f : -1.f);
+        n.x = xy.x;
+        n.y = xy.y;
+    }
+    return glm::normalize(n);
+}
+
+/**
+ * 30-bit sort key for a ray: the top 18 bits are the Morton code of the origin
+ * quantized to 64^3 cells of the scene bounds, the low 12 bits the Morton code
+ * of the direction quantized to 64^2 cells of its octahedral mapping.
+ */
+__host__ __device__ inline unsigned int rayMortonKey(glm::vec3 origin, glm::vec3 direction,
+                                                     glm::vec3 sceneMin, glm::vec3 sceneInvExtent) {
+    glm::vec3 p = glm::clamp((origin - sceneMin) * sceneInvExtent, 0.f, 1.f) * 63.f;
+    glm::vec2 d = glm::clamp(octEncode(direction) * 0.5f + 0.5f, 0.f, 1.f) * 63.f;
+    unsigned int posKey = morton3D((unsigned int)p.x, (unsigned int)p.y, (unsigned int)p.z);
+    unsigned int dirKey = morton2D((unsigned int)d.x, (unsigned int)d.y);
+    return (posKey << 12) | dirKey;
+}
+
+#define PIXEL_TILE_SIZE 8
+
+/**
+ * Maps a linear index to a pixel so that consecutive indices cover the image
+ * in PIXEL_TILE_SIZE^2 tiles, Z-order inside each full tile and row-major
+ * inside the partial tiles at the right and bottom edges. Tiles are visited
+ * row by row. The mapping is a bijection on [0, resolution.x * resolution.y).
+ */
+__host__ __device__ inline glm::ivec2 tiledPixelFromIndex(int index, glm::ivec2 resolution) {
+    const int tileRowPixels = PIXEL_TILE_SIZE * resolution.x;
+    const int tileRow = index / tileRowPixels;
+    const int rowY = tileRow * PIXEL_TILE_SIZE;
+    const int rowHeight = glm::min(PIXEL_TILE_SIZE, resolution.y - rowY);
+
+    const int local = index - tileRow * tileRowPixels;
+    const int tileCol = local / (PIXEL_TILE_SIZE * rowHeight);
+    const int colX = tileCol * PIXEL_TILE_SIZE;
+    const int tileWidth = glm::min(PIXEL_TILE_SIZE, resolution.x - colX);
+
+    const int inTile = local - tileCol * PIXEL_TILE_SIZE * rowHeight;
+    if (tileWidth == PIXEL_TILE_SIZE && rowHeight == PIXEL_TILE_SIZE) {
+        return glm::ivec2(colX + compactBits2(inTile), rowY + compactBits2(inTile >> 1));
+    }
+    return glm::ivec2(colX + inTile % tileWidth, rowY + inTile / tileWidth);
+}
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <cmath>
+#include <cuda_runtime.h>
+#include "glm/glm.hpp"
+#include "sceneStructs.h"
+
+/**
+ * Octahedral mapping of a direction to [-1, 1]^2: it is projected onto the
+ * octahedron |x| + |y| + |z| = 1, whose lower half is folded over the upper
+ * one, and x and y of the result are kept.
+ */
+__host__ __device__ inline glm::vec2 octahedralProject(glm::vec3 v)
+{
+    float sum = fabsf(v.x) + fabsf(v.y) + fabsf(v.z);
+    if (sum == 0.f)
+    {
+        return glm::vec2(0.f);
+    }
+    glm::vec2 p = glm::vec2(v) / sum;
+    if (v.z < 0.f)
+    {
+        p = glm::vec2((1.f - fabsf(p.y)) * (p.x >= 0.f ? 1.f : -1.f), (1.f - fabsf(p.x)) * (p.y >= 0.f ? 1.f : -1.f));
+    }
+    return p;
+}
+
+__host__ __device__ inline glm::vec3 octahedralUnproject(glm::vec2 p)
+{
+    glm::vec3 v(p, 1.f - fabsf(p.x) - fabsf(p.y));
+    float t = glm::max(-v.z, 0.f);
+    v.x += v.x >= 0.f ? -t : t;
+    v.y += v.y >= 0.f ? -t : t;
+    return glm::normalize(v);
+}
+
+// Signed `bits`-bit quantization of x in [-1, 1], in the low bits.
+__host__ __device__ inline unsigned int quantizeSnorm(float x, int bits)
+{
+    const int maxValue = (1 << (bits - 1)) - 1;
+    int q = (int)roundf(glm::clamp(x, -1.f, 1.f) * maxValue);
+    return (unsigned int)q & ((1u << bits) - 1);
+}
+
+__host__ __device__ inline float dequantizeSnorm(unsigned int q, int bits)
+{
+    const int maxValue = (1 << (bits - 1)) - 1;
+    // sign-extend
+    int s = (int)(q << (32 - bits)) >> (32 - bits);
+    return glm::max((float)s / maxValue, -1.f);
+}
+
+/**
+ * Unit normal in 2x16 bits: the octahedral x in the low half, y in the high
+ * half.
+ */
+__host__ __device__ inline unsigned int encodeNormal(glm::vec3 n)
+{
+    glm::vec2 p = octahedralProject(n);
+    return quantizeSnorm(p.x, 16) | quantizeSnorm(p.y, 16) << 16;
+}
+
+__host__ __device__ inline glm::vec3 decodeNormal(unsigned int e)
+{
+    return octahedralUnproject(glm::vec2(dequantizeSnorm(e & 0xffffu, 16), dequantizeSnorm(e >> 16, 16)));
+}
+
+/**
+ * Tangent with its handedness in w, as glTF has it, in 32 bits: x in the low
+ * 16, y in the next 15, and the top bit set if w is negative.
+ */
+__host__ __device__ inline unsigned int encodeTangent(glm::vec4 t)
+{
+    glm::vec2 p = octahedralProject(glm::vec3(t));
+    return quantizeSnorm(p.x, 16) | quantizeSnorm(p.y, 15) << 16 | (t.w < 0.f ? 1u << 31 : 0u);
+}
+
+__host__ __device__ inline glm::vec4 decodeTangent(unsigned int e)
+{
+    glm::vec3 t = octahedralUnproject(glm::vec2(dequantizeSnorm(e & 0xffffu, 16),
+                                                dequantizeSnorm((e >> 16) & 0x7fffu, 15)));
+    return glm::vec4(t, e >> 31 ? -1.f : 1.f);
+}
+
+/**
+ * Packs a triangle's attributes. Texture lookups only use the fractional part
+ * of a UV, so the UVs are moved by whole repeats to start at 0; they are
+ * then stored as 16-bit fractions of the largest of them, or of 1 if that's
+ * smaller.
+ */
+inline PackedTriangle packTriangle(const Triangle& tri)
+{
+    PackedTriangle packed;
+    glm::vec2 origin = glm::floor(glm::min(glm::min(tri.uv[0], tri.uv[1]), tri.uv[2]));
+    float extent = 1.f;
+    for (int i = 0; i < 3; ++i)
+    {
+        glm::vec2 uv = tri.uv[i] - origin;
+        extent = glm::max(extent, glm::max(uv.x, uv.y));
+    }
+    if (!std::isfinite(extent) || !std::isfinite(origin.x) || !std::isfinite(origin.y))
+    {
+        origin = glm::vec2(0.f);
+        extent = 1.f;
+    }
+
+    for (int i = 0; i < 3; ++i)
+    {
+        packed.pos[i] = tri.pos[i];
+        packed.normal[i] = encodeNormal(tri.normal[i]);
+        packed.tangent[i] = encodeTangent(tri.tangent[i]);
+        glm::vec2 uv = glm::clamp((tri.uv[i] - origin) / extent, 0.f, 1.f);
+        packed.uv[i][0] = (unsigned short)roundf(uv.x * 65535.f);
+        packed.uv[i][1] = (unsigned short)roundf(uv.y * 65535.f);
+    }
+    packed.uvExtent = extent;
+    return packed;
+}
+
+/**
+ * Vertex attributes of either layout, decoded. UVs of a PackedTriangle may be
+ * off by whole repeats.
+ */
+__host__ __device__ inline glm::vec3 triangleNormal(const Triangle& tri, int i)
+{
+    return tri.normal[i];
+}
+
+__host__ __device__ inline glm::vec3 triangleNormal(const PackedTriangle& tri, int i)
+{
+    return decodeNormal(tri.normal[i]);
+}
+
+__host__ __device__ inline glm::vec4 triangleTangent(const Triangle& tri, int i)
+{
+    return tri.tangent[i];
+}
+
+__host__ __device__ inline glm::vec4 triangleTangent(const PackedTriangle& tri, int i)
+{
+    return decodeTangent(tri.tangent[i]);
+}
+
+__host__ __device__ inline glm::vec2 triangleUV(const Triangle& tri, int i)
+{
+    return tri.uv[i];
+}
+
+__host__ __device__ inline glm::vec2 triangleUV(const PackedTriangle& tri, int i)
+{
+    return glm::vec2(tri.uv[i][0], tri.uv[i][1]) * (tri.uvExtent / 65535.f);
+}
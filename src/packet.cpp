@@ -0,0 +1,572 @@
+#include <algorithm>
+
+#include "packet.h"
+#include "scene.h"
+
+namespace {
+
+const float minT = 1e-4f;
+
+#if RAY_PACKET_SIMD
+
+//-------------------------------
+//-----------SIMD LANES----------
+//-------------------------------
+
+#if defined(__AVX512F__)
+
+struct vfloat { __m512 v; };
+struct vmask { __mmask16 v; };
+
+inline vfloat load(const float* p) { return { _mm512_load_ps(p) }; }
+inline vfloat set1(float f) { return { _mm512_set1_ps(f) }; }
+inline void store(float* p, vfloat a) { _mm512_store_ps(p, a.v); }
+inline vfloat operator+(vfloat a, vfloat b) { return { _mm512_add_ps(a.v, b.v) }; }
+inline vfloat operator-(vfloat a, vfloat b) { return { _mm512_sub_ps(a.v, b.v) }; }
+inline vfloat operator*(vfloat a, vfloat b) { return { _mm512_mul_ps(a.v, b.v) }; }
+inline vfloat operator/(vfloat a, vfloat b) { return { _mm512_div_ps(a.v, b.v) }; }
+inline vfloat vmin(vfloat a, vfloat b) { return { _mm512_min_ps(a.v, b.v) }; }
+inline vfloat vmax(vfloat a, vfloat b) { return { _mm512_max_ps(a.v, b.v) }; }
+inline vfloat vsqrt(vfloat a) { return { _mm512_sqrt_ps(a.v) }; }
+inline vfloat vabs(vfloat a) { return { _mm512_abs_ps(a.v) }; }
+inline vmask operator<(vfloat a, vfloat b) { return { _mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ) }; }
+inline vmask operator<=(vfloat a, vfloat b) { return { _mm512_cmp_ps_mask(a.v, b.v, _CMP_LE_OQ) }; }
+inline vmask operator>(vfloat a, vfloat b) { return { _mm512_cmp_ps_mask(a.v, b.v, _CMP_GT_OQ) }; }
+inline vmask operator>=(vfloat a, vfloat b) { return { _mm512_cmp_ps_mask(a.v, b.v, _CMP_GE_OQ) }; }
+inline vmask operator&(vmask a, vmask b) { return { (__mmask16)(a.v & b.v) }; }
+inline vfloat select(vmask m, vfloat a, vfloat b) { return { _mm512_mask_blend_ps(m.v, b.v, a.v) }; }
+inline unsigned int bits(vmask m) { return m.v; }
+inline vmask maskFromBits(unsigned int b) { return { (__mmask16)b }; }
+
+#elif defined(__AVX2__)
+
+struct vfloat { __m256 v; };
+struct vmask { __m256 v; };
+
+inline vfloat load(const float* p) { return { _mm256_load_ps(p) }; }
+inline vfloat set1(float f) { return { _mm256_set1_ps(f) }; }
+inline void store(float* p, vfloat a) { _mm256_store_ps(p, a.v); }
+inline vfloat operator+(vfloat a, vfloat b) { return { _mm256_add_ps(a.v, b.v) }; }
+inline vfloat operator-(vfloat a, vfloat b) { return { _mm256_sub_ps(a.v, b.v) }; }
+inline vfloat operator*(vfloat a, vfloat b) { return { _mm256_mul_ps(a.v, b.v) }; }
+inline vfloat operator/(vfloat a, vfloat b) { return { _mm256_div_ps(a.v, b.v) }; }
+inline vfloat vmin(vfloat a, vfloat b) { return { _mm256_min_ps(a.v, b.v) }; }
+inline vfloat vmax(vfloat a, vfloat b) { return { _mm256_max_ps(a.v, b.v) }; }
+inline vfloat vsqrt(vfloat a) { return { _mm256_sqrt_ps(a.v) }; }
+inline vfloat vabs(vfloat a) { return { _mm256_andnot_ps(_mm256_set1_ps(-0.f), a.v) }; }
+inline vmask operator<(vfloat a, vfloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ) }; }
+inline vmask operator<=(vfloat a, vfloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ) }; }
+inline vmask operator>(vfloat a, vfloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ) }; }
+inline vmask operator>=(vfloat a, vfloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ) }; }
+inline vmask operator&(vmask a, vmask b) { return { _mm256_and_ps(a.v, b.v) }; }
+inline vfloat select(vmask m, vfloat a, vfloat b) { return { _mm256_blendv_ps(b.v, a.v, m.v) }; }
+inline unsigned int bits(vmask m) { return _mm256_movemask_ps(m.v); }
+inline vmask maskFromBits(unsigned int b)
+{
+    __m256i lanes = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    __m256i set = _mm256_and_si256(_mm256_set1_epi32(b), lanes);
+    return { _mm256_castsi256_ps(_mm256_cmpeq_epi32(set, lanes)) };
+}
+
+#endif
+
+struct vec3x
+{
+    vfloat x, y, z;
+};
+
+inline vfloat dot(const vec3x& a, const vec3x& b)
+{
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+inline vec3x cross(const vec3x& a, const vec3x& b)
+{
+    return { a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x };
+}
+
+inline vec3x sub(const vec3x& a, glm::vec3 b)
+{
+    return { a.x - set1(b.x), a.y - set1(b.y), a.z - set1(b.z) };
+}
+
+inline vec3x broadcast(glm::vec3 v)
+{
+    return { set1(v.x), set1(v.y), set1(v.z) };
+}
+
+// m * (v, w), with glm's column-major indexing
+inline vec3x transform(const glm::mat4& m, const vec3x& v, float w)
+{
+    vec3x r;
+    r.x = set1(m[0][0]) * v.x + set1(m[1][0]) * v.y + set1(m[2][0]) * v.z + set1(m[3][0] * w);
+    r.y = set1(m[0][1]) * v.x + set1(m[1][1]) * v.y + set1(m[2][1]) * v.z + set1(m[3][1] * w);
+    r.z = set1(m[0][2]) * v.x + set1(m[1][2]) * v.y + set1(m[2][2]) * v.z + set1(m[3][2] * w);
+    return r;
+}
+
+inline vfloat safeInverse(vfloat d)
+{
+    vfloat tiny = set1(1e-12f);
+    vfloat clamped = select(vabs(d) < tiny, select(d < set1(0.f), set1(-1e-12f), tiny), d);
+    return set1(1.f) / clamped;
+}
+
+inline unsigned int popcount(unsigned int b)
+{
+    unsigned int c = 0;
+    for (; b; b &= b - 1)
+    {
+        ++c;
+    }
+    return c;
+}
+
+#endif
+
+//-------------------------------
+//----------SINGLE RAYS----------
+//-------------------------------
+
+// The tests below work on a ray already transformed into object space, with
+// an unnormalized direction so that t is the world space distance.
+
+float intersectSphereT(const Ray& r)
+{
+    float a = glm::dot(r.direction, r.direction);
+    float b = glm::dot(r.origin, r.direction);
+    float c = glm::dot(r.origin, r.origin) - .25f;
+    float disc = b * b - a * c;
+    if (disc < 0.f)
+    {
+        return -1.f;
+    }
+    float sq = sqrtf(disc);
+    float t1 = (-b - sq) / a;
+    float t2 = (-b + sq) / a;
+    return t1 > minT ? t1 : t2;
+}
+
+float intersectBoxT(const Ray& r)
+{
+    glm::vec3 invDir = safeInverseDirection(r.direction);
+    glm::vec3 t0 = (glm::vec3(-.5f) - r.origin) * invDir;
+    glm::vec3 t1 = (glm::vec3(.5f) - r.origin) * invDir;
+    glm::vec3 tmin = glm::min(t0, t1);
+    glm::vec3 tmax = glm::max(t0, t1);
+    float tNear = glm::max(glm::max(tmin.x, tmin.y), tmin.z);
+    float tFar = glm::min(glm::min(tmax.x, tmax.y), tmax.z);
+    if (tNear > tFar)
+    {
+        return -1.f;
+    }
+    return tNear > minT ? tNear : tFar;
+}
+
+float intersectTriangleT(const Ray& r, const Triangle& tri)
+{
+    glm::vec3 e1 = tri.pos[1] - tri.pos[0];
+    glm::vec3 e2 = tri.pos[2] - tri.pos[0];
+    glm::vec3 p = glm::cross(r.direction, e2);
+    float det = glm::dot(e1, p);
+    if (fabsf(det) < 1e-12f)
+    {
+        return -1.f;
+    }
+    float invDet = 1.f / det;
+    glm::vec3 s = r.origin - tri.pos[0];
+    float u = glm::dot(s, p) * invDet;
+    glm::vec3 q = glm::cross(s, e1);
+    float v = glm::dot(r.direction, q) * invDet;
+    if (u < 0.f || v < 0.f || u + v > 1.f)
+    {
+        return -1.f;
+    }
+    return glm::dot(e2, q) * invDet;
+}
+
+struct SingleLeafIntersector
+{
+    const Triangle* tris;
+    const Ray& ray;
+    float& tMax;
+    int& triIdx;
+    bool anyHit;
+
+    void operator()(int triBegin, int triCount)
+    {
+        for (int i = triBegin; i < triBegin + triCount; ++i)
+        {
+            float t = intersectTriangleT(ray, tris[i]);
+            if (t > minT && t < tMax)
+            {
+                tMax = t;
+                triIdx = i;
+                if (anyHit)
+                {
+                    // no entry is closer than this; ends the traversal
+                    tMax = -1.f;
+                    return;
+                }
+            }
+        }
+    }
+};
+
+Ray toObjectSpace(const Geom& geom, const Ray& r)
+{
+    Ray q;
+    q.origin = glm::vec3(geom.inverseTransform * glm::vec4(r.origin, 1.f));
+    q.direction = glm::vec3(geom.inverseTransform * glm::vec4(r.direction, 0.f));
+    return q;
+}
+
+// Traces one ray through the subtree at `node` of a mesh and updates its hit.
+void traceMeshSingle(const Scene& scene, int geomIdx, int node, const Ray& objRay, bool anyHit, HostHit& hit)
+{
+    float tMax = hit.t;
+    int triIdx = -1;
+    SingleLeafIntersector leafFn = { scene.triangles.data(), objRay, tMax, triIdx, anyHit };
+    traverseWideBVH(scene.bvhNodes.data(), node, objRay, tMax, leafFn);
+    if (triIdx >= 0)
+    {
+        // an any-hit query clears tMax to stop; recompute the distance
+        hit.t = anyHit ? intersectTriangleT(objRay, scene.triangles[triIdx]) : tMax;
+        hit.geomIdx = geomIdx;
+        hit.triIdx = triIdx;
+    }
+}
+
+void traceSingle(const Scene& scene, const Ray& r, bool anyHit, HostHit& hit)
+{
+    for (int g = 0; g < (int)scene.geoms.size(); ++g)
+    {
+        const Geom& geom = scene.geoms[g];
+        Ray q = toObjectSpace(geom, r);
+        if (geom.type == MESH)
+        {
+            if (geom.bvhRootIdx >= 0)
+            {
+                traceMeshSingle(scene, g, geom.bvhRootIdx, q, anyHit, hit);
+            }
+        }
+        else
+        {
+            float t = geom.type == SPHERE ? intersectSphereT(q) : intersectBoxT(q);
+            if (t > minT && t < hit.t)
+            {
+                hit.t = t;
+                hit.geomIdx = g;
+                hit.triIdx = -1;
+            }
+        }
+        if (anyHit && hit.geomIdx >= 0)
+        {
+            return;
+        }
+    }
+}
+
+#if RAY_PACKET_SIMD
+
+//-------------------------------
+//------------PACKETS------------
+//-------------------------------
+
+// Records the hits in `hitBits` at distances t for geom g.
+void recordHits(RayPacket& packet, unsigned int hitBits, vfloat t, int g, const int* triIdx, bool anyHit)
+{
+    store(packet.tMax, select(maskFromBits(hitBits), t, load(packet.tMax)));
+    for (int i = 0; i < RAY_PACKET_SIZE; ++i)
+    {
+        if (hitBits & (1u << i))
+        {
+            packet.geomIdx[i] = g;
+            packet.triIdx[i] = triIdx ? triIdx[i] : -1;
+        }
+    }
+    if (anyHit)
+    {
+        packet.active &= ~hitBits;
+    }
+}
+
+void intersectSpherePacket(RayPacket& packet, int g, const vec3x& o, const vec3x& d, bool anyHit)
+{
+    vfloat a = dot(d, d);
+    vfloat b = dot(o, d);
+    vfloat c = dot(o, o) - set1(.25f);
+    vfloat disc = b * b - a * c;
+    vfloat sq = vsqrt(vmax(disc, set1(0.f)));
+    vfloat t1 = (set1(0.f) - b - sq) / a;
+    vfloat t2 = (sq - b) / a;
+    vfloat t = select(t1 > set1(minT), t1, t2);
+
+    vmask hit = (disc >= set1(0.f)) & (t > set1(minT)) & (t < load(packet.tMax));
+    recordHits(packet, bits(hit) & packet.active, t, g, nullptr, anyHit);
+}
+
+void intersectBoxPacket(RayPacket& packet, int g, const vec3x& o, const vec3x& d, bool anyHit)
+{
+    vfloat tNear = set1(-FLT_MAX);
+    vfloat tFar = set1(FLT_MAX);
+    const vfloat* oa[3] = { &o.x, &o.y, &o.z };
+    const vfloat* da[3] = { &d.x, &d.y, &d.z };
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        vfloat invDir = safeInverse(*da[axis]);
+        vfloat t0 = (set1(-.5f) - *oa[axis]) * invDir;
+        vfloat t1 = (set1(.5f) - *oa[axis]) * invDir;
+        tNear = vmax(tNear, vmin(t0, t1));
+        tFar = vmin(tFar, vmax(t0, t1));
+    }
+    vfloat t = select(tNear > set1(minT), tNear, tFar);
+
+    vmask hit = (tNear <= tFar) & (t > set1(minT)) & (t < load(packet.tMax));
+    recordHits(packet, bits(hit) & packet.active, t, g, nullptr, anyHit);
+}
+
+void intersectTrianglePacket(RayPacket& packet, unsigned int mask, int g, int triIdx, const Triangle& tri,
+                             const vec3x& o, const vec3x& d, bool anyHit)
+{
+    vec3x e1 = broadcast(tri.pos[1] - tri.pos[0]);
+    vec3x e2 = broadcast(tri.pos[2] - tri.pos[0]);
+    vec3x p = cross(d, e2);
+    vfloat det = dot(e1, p);
+    vfloat invDet = set1(1.f) / det;
+    vec3x s = sub(o, tri.pos[0]);
+    vfloat u = dot(s, p) * invDet;
+    vec3x q = cross(s, e1);
+    vfloat v = dot(d, q) * invDet;
+    vfloat t = dot(e2, q) * invDet;
+
+    vmask hit = (vabs(det) >= set1(1e-12f)) & (u >= set1(0.f)) & (v >= set1(0.f)) & (u + v <= set1(1.f))
+              & (t > set1(minT)) & (t < load(packet.tMax));
+    int triIdxs[RAY_PACKET_SIZE];
+    std::fill(triIdxs, triIdxs + RAY_PACKET_SIZE, triIdx);
+    recordHits(packet, bits(hit) & mask, t, g, triIdxs, anyHit);
+}
+
+struct PacketStackEntry
+{
+    int node;
+    int triCount;
+    unsigned int mask;
+    float tNear;
+};
+
+// Packet traversal of a mesh's BVH. Subtrees reached by fewer than
+// RAY_PACKET_MIN_ACTIVE rays are finished one ray at a time.
+void traceMeshPacket(const Scene& scene, int g, RayPacket& packet, const vec3x& o, const vec3x& d, bool anyHit)
+{
+    const Geom& geom = scene.geoms[g];
+    const vfloat* oa[3] = { &o.x, &o.y, &o.z };
+    vfloat invDir[3] = { safeInverse(d.x), safeInverse(d.y), safeInverse(d.z) };
+
+    PacketStackEntry stack[BVH_STACK_SIZE];
+    int sp = 0;
+    stack[sp++] = { geom.bvhRootIdx, 0, packet.active, 0.f };
+    while (sp > 0)
+    {
+        PacketStackEntry entry = stack[--sp];
+        unsigned int mask = entry.mask & packet.active;
+        if (mask == 0)
+        {
+            continue;
+        }
+
+        if (entry.triCount > 0)
+        {
+            for (int i = entry.node; i < entry.node + entry.triCount; ++i)
+            {
+                intersectTrianglePacket(packet, mask & packet.active, g, i, scene.triangles[i], o, d, anyHit);
+            }
+            continue;
+        }
+
+        if ((int)popcount(mask) < RAY_PACKET_MIN_ACTIVE)
+        {
+            alignas(64) float ox[3][RAY_PACKET_SIZE], dx[3][RAY_PACKET_SIZE];
+            const vfloat* da[3] = { &d.x, &d.y, &d.z };
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                store(ox[axis], *oa[axis]);
+                store(dx[axis], *da[axis]);
+            }
+            for (int i = 0; i < RAY_PACKET_SIZE; ++i)
+            {
+                if (mask & (1u << i))
+                {
+                    Ray objRay;
+                    objRay.origin = glm::vec3(ox[0][i], ox[1][i], ox[2][i]);
+                    objRay.direction = glm::vec3(dx[0][i], dx[1][i], dx[2][i]);
+                    HostHit hit = { packet.tMax[i], packet.geomIdx[i], packet.triIdx[i] };
+                    traceMeshSingle(scene, g, entry.node, objRay, anyHit, hit);
+                    packet.tMax[i] = hit.t;
+                    packet.geomIdx[i] = hit.geomIdx;
+                    packet.triIdx[i] = hit.triIdx;
+                    if (anyHit && hit.geomIdx >= 0)
+                    {
+                        packet.active &= ~(1u << i);
+                    }
+                }
+            }
+            continue;
+        }
+
+        const WideBVHNode& node = scene.bvhNodes[entry.node];
+        vfloat tMax = load(packet.tMax);
+        int first = sp;
+        for (int c = 0; c < node.childCount; ++c)
+        {
+            vfloat tmin = set1(0.f);
+            vfloat tmax = tMax;
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                float scale = ldexpf(1.f, node.exponent[axis]);
+                vfloat lo = set1(node.origin[axis] + node.qlo[axis][c] * scale);
+                vfloat hi = set1(node.origin[axis] + node.qhi[axis][c] * scale);
+                vfloat t0 = (lo - *oa[axis]) * invDir[axis];
+                vfloat t1 = (hi - *oa[axis]) * invDir[axis];
+                tmin = vmax(tmin, vmin(t0, t1));
+                tmax = vmin(tmax, vmax(t0, t1));
+            }
+            unsigned int childMask = bits(tmin <= tmax) & mask;
+            if (childMask == 0)
+            {
+                continue;
+            }
+
+            alignas(64) float tNear[RAY_PACKET_SIZE];
+            store(tNear, tmin);
+            float closest = FLT_MAX;
+            for (int i = 0; i < RAY_PACKET_SIZE; ++i)
+            {
+                if (childMask & (1u << i))
+                {
+                    closest = fminf(closest, tNear[i]);
+                }
+            }
+
+            // keep the children just pushed sorted far to near
+            PacketStackEntry child = { node.child[c], node.triCount[c], childMask, closest };
+            int j = sp++;
+            while (j > first && stack[j - 1].tNear < child.tNear)
+            {
+                stack[j] = stack[j - 1];
+                --j;
+            }
+            stack[j] = child;
+        }
+    }
+}
+
+void tracePacket(const Scene& scene, RayPacket& packet, bool anyHit)
+{
+    vec3x o = { load(packet.ox), load(packet.oy), load(packet.oz) };
+    vec3x d = { load(packet.dx), load(packet.dy), load(packet.dz) };
+
+    for (int g = 0; g < (int)scene.geoms.size() && packet.active; ++g)
+    {
+        const Geom& geom = scene.geoms[g];
+        vec3x objOrigin = transform(geom.inverseTransform, o, 1.f);
+        vec3x objDir = transform(geom.inverseTransform, d, 0.f);
+        if (geom.type == MESH)
+        {
+            if (geom.bvhRootIdx >= 0)
+            {
+                traceMeshPacket(scene, g, packet, objOrigin, objDir, anyHit);
+            }
+        }
+        else if (geom.type == SPHERE)
+        {
+            intersectSpherePacket(packet, g, objOrigin, objDir, anyHit);
+        }
+        else
+        {
+            intersectBoxPacket(packet, g, objOrigin, objDir, anyHit);
+        }
+    }
+}
+
+// A packet is traced as such only if all its rays agree in direction signs.
+bool isCoherent(const Ray* rays, int count)
+{
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        bool negative = rays[0].direction[axis] < 0.f;
+        for (int i = 1; i < count; ++i)
+        {
+            if ((rays[i].direction[axis] < 0.f) != negative)
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+#endif
+
+}
+
+void intersectRaysHostSingle(const Scene& scene, const Ray* rays, int n, HostHit* hits, bool anyHit, float tMax)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        HostHit hit = { tMax, -1, -1 };
+        traceSingle(scene, rays[i], anyHit, hit);
+        hits[i] = hit;
+        if (hit.geomIdx < 0)
+        {
+            hits[i].t = -1.f;
+        }
+    }
+}
+
+int intersectRaysHost(const Scene& scene, const Ray* rays, int n, HostHit* hits, bool anyHit, float tMax)
+{
+#if !RAY_PACKET_SIMD
+    intersectRaysHostSingle(scene, rays, n, hits, anyHit, tMax);
+    return 0;
+#else
+    int packetRays = 0;
+    RayPacket packet;
+    for (int base = 0; base < n; base += RAY_PACKET_SIZE)
+    {
+        int count = std::min(RAY_PACKET_SIZE, n - base);
+        const Ray* batch = rays + base;
+        if (count < RAY_PACKET_MIN_ACTIVE || !isCoherent(batch, count))
+        {
+            intersectRaysHostSingle(scene, batch, count, hits + base, anyHit, tMax);
+            continue;
+        }
+
+        // unused lanes repeat the first ray and stay inactive
+        for (int i = 0; i < RAY_PACKET_SIZE; ++i)
+        {
+            const Ray& r = batch[i < count ? i : 0];
+            packet.ox[i] = r.origin.x;
+            packet.oy[i] = r.origin.y;
+            packet.oz[i] = r.origin.z;
+            packet.dx[i] = r.direction.x;
+            packet.dy[i] = r.direction.y;
+            packet.dz[i] = r.direction.z;
+            packet.tMax[i] = tMax;
+            packet.geomIdx[i] = -1;
+            packet.triIdx[i] = -1;
+        }
+        packet.active = (1u << count) - 1;
+
+        tracePacket(scene, packet, anyHit);
+        packetRays += count;
+
+        for (int i = 0; i < count; ++i)
+        {
+            bool hit = packet.geomIdx[i] >= 0;
+            hits[base + i] = { hit ? packet.tMax[i] : -1.f, packet.geomIdx[i], packet.triIdx[i] };
+        }
+    }
+    return packetRays;
+#endif
+}
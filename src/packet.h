@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cuda_runtime.h>
+#include "glm/glm.hpp"
+#include "sceneStructs.h"
+#include "bvh.h"
+
+// Packets are only traced when the host compiler targets AVX2 or AVX-512;
+// otherwise every ray is traced on its own.
+#if defined(__AVX512F__)
+#include <immintrin.h>
+#define RAY_PACKET_SIMD 1
+#define RAY_PACKET_SIZE 16
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define RAY_PACKET_SIMD 1
+#define RAY_PACKET_SIZE 8
+#else
+#define RAY_PACKET_SIMD 0
+#define RAY_PACKET_SIZE 8
+#endif
+
+// A packet whose rays disagree in direction signs, or a BVH node reached by
+// fewer than this many of a packet's rays, is traced one ray at a time.
+#define RAY_PACKET_MIN_ACTIVE (RAY_PACKET_SIZE / 4)
+
+class Scene;
+
+/**
+ * Closest (or, for occlusion queries, any) hit of a ray traced on the host.
+ * Only the distance and the primitive are recorded; surface attributes are
+ * left to the caller.
+ */
+struct HostHit
+{
+    float t;
+    int geomIdx;
+    int triIdx;
+};
+
+/**
+ * RAY_PACKET_SIZE rays in structure-of-arrays layout.
+ */
+struct RayPacket
+{
+    alignas(64) float ox[RAY_PACKET_SIZE];
+    alignas(64) float oy[RAY_PACKET_SIZE];
+    alignas(64) float oz[RAY_PACKET_SIZE];
+    alignas(64) float dx[RAY_PACKET_SIZE];
+    alignas(64) float dy[RAY_PACKET_SIZE];
+    alignas(64) float dz[RAY_PACKET_SIZE];
+    alignas(64) float tMax[RAY_PACKET_SIZE];
+    int geomIdx[RAY_PACKET_SIZE];
+    int triIdx[RAY_PACKET_SIZE];
+    // bit i is set while ray i is still being traced
+    unsigned int active;
+};
+
+/**
+ * Intersects n rays with the scene on the host. Rays are traced in packets of
+ * RAY_PACKET_SIZE using AVX-512 or AVX2; packets that are not coherent, and
+ * packets that diverge inside a BVH, fall back to single-ray traversal, as do
+ * all rays when neither instruction set is available.
+ *
+ * @param anyHit  Stop at the first hit found, for shadow rays.
+ * @param tMax    Rays are only traced up to this distance.
+ * @return        Number of rays that were traced as part of a packet.
+ */
+int intersectRaysHost(const Scene& scene, const Ray* rays, int n, HostHit* hits,
+                      bool anyHit = false, float tMax = FLT_MAX);
+
+/**
+ * Same as intersectRaysHost, but always traces one ray at a time.
+ */
+void intersectRaysHostSingle(const Scene& scene, const Ray* rays, int n, HostHit* hits,
+                             bool anyHit = false, float tMax = FLT_MAX);
@@ -0,0 +1,215 @@
+#include <algorithm>
+#include <cmath>
+
+#include "pathguiding.h"
+#include "../stream_compaction/parallel.h"
+
+namespace {
+
+// A recording quadrant is split while it holds more than this fraction of its
+// leaf's energy, down to maxDirDepth.
+const float energyFraction = 0.01f;
+const int maxDirDepth = 20;
+// A spatial leaf is split while it has more than this many recorded vertices
+// times the square root of the pass's samples per pixel.
+const float spatialThreshold = 12000.f;
+const int maxSpatialDepth = 30;
+
+GuideDirNode emptyDirNode()
+{
+    return GuideDirNode{ { 0.f, 0.f, 0.f, 0.f }, { -1, -1, -1, -1 } };
+}
+
+// Copies the quadtree at node of src to the end of dst; returns its root there.
+int copyQuadtree(const std::vector<GuideDirNode>& src, int node, std::vector<GuideDirNode>& dst)
+{
+    int index = dst.size();
+    dst.push_back(src[node]);
+    for (int q = 0; q < 4; ++q)
+    {
+        if (src[node].child[q] >= 0)
+        {
+            int child = copyQuadtree(src, src[node].child[q], dst);
+            dst[index].child[q] = child;
+        }
+    }
+    return index;
+}
+
+// Records only land in leaf quadrants; fills in the inner quadrants' sums from
+// their children and returns the node's total.
+float propagateSums(std::vector<GuideDirNode>& nodes, int node)
+{
+    float total = 0.f;
+    for (int q = 0; q < 4; ++q)
+    {
+        if (nodes[node].child[q] >= 0)
+        {
+            nodes[node].sum[q] = propagateSums(nodes, nodes[node].child[q]);
+        }
+        total += nodes[node].sum[q];
+    }
+    return total;
+}
+
+// Empty recording quadtree whose quadrants are split where the learned
+// quadtree at node (-1 below its leaves, where energy is spread evenly) has
+// more than threshold.
+int buildRecording(const std::vector<GuideDirNode>& learned, int node, float energy, float threshold, int depth,
+                   std::vector<GuideDirNode>& dst)
+{
+    int index = dst.size();
+    dst.push_back(emptyDirNode());
+    for (int q = 0; q < 4; ++q)
+    {
+        float e = node >= 0 ? learned[node].sum[q] : 0.25f * energy;
+        if (e > threshold && depth < maxDirDepth)
+        {
+            int child = buildRecording(learned, node >= 0 ? learned[node].child[q] : -1, e, threshold, depth + 1, dst);
+            dst[index].child[q] = child;
+        }
+    }
+    return index;
+}
+
+// What a pass taught one spatial leaf: the quadtree to sample from (empty if
+// it recorded nothing) and the structure of the next one to record into.
+struct LeafQuadtrees
+{
+    std::vector<GuideDirNode> sampling;
+    std::vector<GuideDirNode> recording;
+};
+
+LeafQuadtrees refineLeaf(const GuideTree& tree, const GuideSpatialNode& leaf)
+{
+    LeafQuadtrees result;
+    copyQuadtree(tree.recordingNodes, leaf.recordingRoot, result.sampling);
+    float total = propagateSums(result.sampling, 0);
+    if (!(total > 0.f))
+    {
+        // keep recording into the same structure
+        result.sampling.clear();
+        copyQuadtree(tree.recordingNodes, leaf.recordingRoot, result.recording);
+        for (GuideDirNode& node : result.recording)
+        {
+            std::fill(node.sum, node.sum + 4, 0.f);
+        }
+        return result;
+    }
+    buildRecording(result.sampling, 0, total, energyFraction * total, 1, result.recording);
+    return result;
+}
+
+// Rebuilds the spatial tree into out, splitting the leaves that recorded
+// enough vertices and handing every leaf its new quadtrees.
+struct SpatialRebuild
+{
+    const GuideTree& old;
+    const std::vector<unsigned int>& sampleCounts;
+    const std::vector<LeafQuadtrees>& quadtrees;     // per old node, empty for inner ones
+    const std::vector<int>& samplingRoots;           // per old node, in out
+    float threshold;
+    GuideTree& out;
+
+    void node(int oldNode, int newNode, int depth)
+    {
+        const GuideSpatialNode& o = old.spatial[oldNode];
+        if (o.child < 0)
+        {
+            leaf(oldNode, newNode, (float)sampleCounts[oldNode], depth);
+            return;
+        }
+        int child = out.spatial.size();
+        out.spatial.resize(child + 2);
+        out.spatial[newNode] = GuideSpatialNode{ child, o.axis, -1, -1 };
+        node(o.child, child, depth + 1);
+        node(o.child + 1, child + 1, depth + 1);
+    }
+
+    // each half of a split leaf is assumed to get half its samples
+    void leaf(int oldLeaf, int newNode, float samples, int depth)
+    {
+        if (samples > threshold && depth < maxSpatialDepth)
+        {
+            int child = out.spatial.size();
+            out.spatial.resize(child + 2);
+            out.spatial[newNode] = GuideSpatialNode{ child, depth % 3, -1, -1 };
+            leaf(oldLeaf, child, 0.5f * samples, depth + 1);
+            leaf(oldLeaf, child + 1, 0.5f * samples, depth + 1);
+            return;
+        }
+        // halves share the sampling quadtree but record separately
+        int recordingRoot = out.recordingNodes.size();
+        for (GuideDirNode node : quadtrees[oldLeaf].recording)
+        {
+            for (int q = 0; q < 4; ++q)
+            {
+                node.child[q] += node.child[q] >= 0 ? recordingRoot : 0;
+            }
+            out.recordingNodes.push_back(node);
+        }
+        out.spatial[newNode] = GuideSpatialNode{ -1, 0, samplingRoots[oldLeaf], recordingRoot };
+    }
+};
+
+}
+
+void initGuideTree(GuideTree& tree, const AABB& sceneBounds)
+{
+    // a cube, so halving along the axes in turn keeps the cells cubic
+    glm::vec3 center = 0.5f * (sceneBounds.bound[0] + sceneBounds.bound[1]);
+    glm::vec3 extent = sceneBounds.bound[1] - sceneBounds.bound[0];
+    float size = 1.01f * std::max(std::max(extent.x, extent.y), std::max(extent.z, EPSILON));
+    tree.boundsMin = center - 0.5f * size;
+    tree.boundsSize = glm::vec3(size);
+
+    tree.spatial.assign(1, GuideSpatialNode{ -1, 0, -1, 0 });
+    tree.samplingNodes.clear();
+    tree.recordingNodes.assign(1, emptyDirNode());
+}
+
+void refineGuideTree(GuideTree& tree, const std::vector<unsigned int>& sampleCounts, int samplesPerPixel)
+{
+    std::vector<int> leaves;
+    for (int i = 0; i < (int)tree.spatial.size(); ++i)
+    {
+        if (tree.spatial[i].child < 0)
+        {
+            leaves.push_back(i);
+        }
+    }
+
+    std::vector<LeafQuadtrees> quadtrees(tree.spatial.size());
+    StreamCompaction::Parallel::parallelFor(leaves.size(), [&](int i) {
+        quadtrees[leaves[i]] = refineLeaf(tree, tree.spatial[leaves[i]]);
+    });
+
+    GuideTree out;
+    out.boundsMin = tree.boundsMin;
+    out.boundsSize = tree.boundsSize;
+    std::vector<int> samplingRoots(tree.spatial.size(), -1);
+    for (int leaf : leaves)
+    {
+        const std::vector<GuideDirNode>& sampling = quadtrees[leaf].sampling;
+        if (sampling.empty())
+        {
+            continue;
+        }
+        int root = out.samplingNodes.size();
+        samplingRoots[leaf] = root;
+        for (GuideDirNode node : sampling)
+        {
+            for (int q = 0; q < 4; ++q)
+            {
+                node.child[q] += node.child[q] >= 0 ? root : 0;
+            }
+            out.samplingNodes.push_back(node);
+        }
+    }
+
+    out.spatial.resize(1);
+    SpatialRebuild rebuild = { tree, sampleCounts, quadtrees, samplingRoots,
+                               spatialThreshold * std::sqrt((float)samplesPerPixel), out };
+    rebuild.node(0, 0, 0);
+    tree = std::move(out);
+}
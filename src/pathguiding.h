@@ -0,0 +1,238 @@
+#pragma once
+
+#include <vector>
+#include <cuda_runtime.h>
+#include <thrust/random.h>
+#include "glm/glm.hpp"
+#include "sceneStructs.h"
+#include "utilities.h"
+
+/**
+ * Node of a directional quadtree over the unit square of cylindrical
+ * coordinates (see guideDirectionToSquare). sum[q] is the energy recorded in
+ * quadrant q (x half + 2 * y half); child[q] is the quadrant's node, or -1 if
+ * it is a leaf.
+ */
+struct GuideDirNode
+{
+    float sum[4];
+    int child[4];
+};
+
+/**
+ * Node of the spatial binary tree. An inner node halves its box along axis;
+ * its children are child and child + 1. A leaf has a directional quadtree to
+ * sample from (-1 until it has learned something) and one to record into.
+ */
+struct GuideSpatialNode
+{
+    int child;          // -1 in a leaf
+    int axis;
+    int samplingRoot;
+    int recordingRoot;
+};
+
+/**
+ * Diffuse vertex of a path, kept until the path terminates so radiance found
+ * further along can be credited to the direction it scattered in: the
+ * radiance over weight is added to quadrant `quadrant` of recording node
+ * `node`. weight is the path's throughput after the vertex times the
+ * density of the direction; prev is the path's previous record or -1.
+ */
+struct GuideRecord
+{
+    int node;
+    int quadrant;
+    glm::vec3 weight;
+    int prev;
+};
+
+/**
+ * SD-tree (spatial-directional tree) as passed to the kernels, with the
+ * records of the current iteration. A null spatial means no guiding.
+ */
+struct PathGuide
+{
+    const GuideSpatialNode* spatial = nullptr;
+    const GuideDirNode* samplingNodes = nullptr;
+    GuideDirNode* recordingNodes = nullptr;
+    unsigned int* sampleCounts = nullptr;     // per spatial node
+    GuideRecord* records = nullptr;
+    int* recordCount = nullptr;
+    int recordCapacity = 0;
+    glm::vec3 boundsMin;
+    glm::vec3 boundsSize;
+};
+
+/**
+ * Host side of the SD-tree, in the layout uploaded to the device. Node 0 of
+ * spatial is the root; it covers a cube around the scene.
+ */
+struct GuideTree
+{
+    glm::vec3 boundsMin;
+    glm::vec3 boundsSize;
+    std::vector<GuideSpatialNode> spatial;
+    std::vector<GuideDirNode> samplingNodes;
+    std::vector<GuideDirNode> recordingNodes;
+};
+
+/**
+ * Starts an SD-tree over the scene bounds: a single spatial leaf that has
+ * nothing to sample from yet and records into a quadtree of four leaves.
+ */
+void initGuideTree(GuideTree& tree, const AABB& sceneBounds);
+
+/**
+ * Ends a training pass. tree.recordingNodes holds the energy recorded during
+ * the pass and sampleCounts the vertices recorded in each spatial node. The
+ * recorded quadtrees become the ones to sample from; spatial leaves that got
+ * enough samples for a pass of samplesPerPixel are split; and every leaf gets
+ * an empty recording quadtree refined where the pass found energy.
+ * Runs on the threads of StreamCompaction::Parallel.
+ */
+void refineGuideTree(GuideTree& tree, const std::vector<unsigned int>& sampleCounts, int samplesPerPixel);
+
+/**
+ * Maps a direction to the unit square: x = (cos(theta) + 1) / 2 and
+ * y = phi / 2 pi around z. The map preserves area, so a density over the
+ * square is 4 pi times the solid angle density.
+ */
+__host__ __device__ inline glm::vec2 guideDirectionToSquare(glm::vec3 dir)
+{
+    float phi = atan2f(dir.y, dir.x);
+    if (phi < 0.f)
+    {
+        phi += TWO_PI;
+    }
+    return glm::vec2(glm::clamp((dir.z + 1.f) * 0.5f, 0.f, 1.f), glm::clamp(phi / TWO_PI, 0.f, 1.f));
+}
+
+__host__ __device__ inline glm::vec3 guideSquareToDirection(glm::vec2 p)
+{
+    float cosTheta = 2.f * p.x - 1.f;
+    float sinTheta = sqrtf(glm::max(1.f - cosTheta * cosTheta, 0.f));
+    float phi = TWO_PI * p.y;
+    return glm::vec3(sinTheta * cosf(phi), sinTheta * sinf(phi), cosTheta);
+}
+
+/**
+ * Spatial leaf whose box contains p; points outside the tree's cube go to
+ * the nearest leaf.
+ */
+__host__ __device__ inline int guideSpatialLeaf(const PathGuide& guide, glm::vec3 p)
+{
+    glm::vec3 x = glm::clamp((p - guide.boundsMin) / guide.boundsSize, 0.f, 1.f);
+    int node = 0;
+    while (guide.spatial[node].child >= 0)
+    {
+        int axis = guide.spatial[node].axis;
+        if (x[axis] < 0.5f)
+        {
+            node = guide.spatial[node].child;
+            x[axis] *= 2.f;
+        }
+        else
+        {
+            node = guide.spatial[node].child + 1;
+            x[axis] = x[axis] * 2.f - 1.f;
+        }
+    }
+    return node;
+}
+
+__host__ __device__ inline int guideQuadrant(glm::vec2& p)
+{
+    int q = 0;
+    for (int i = 0; i < 2; ++i)
+    {
+        if (p[i] < 0.5f)
+        {
+            p[i] *= 2.f;
+        }
+        else
+        {
+            p[i] = p[i] * 2.f - 1.f;
+            q |= 1 << i;
+        }
+    }
+    return q;
+}
+
+/**
+ * Leaf quadrant of the quadtree at root that contains direction dir.
+ *
+ * @param quadrant  Output quadrant of the returned node.
+ */
+__host__ __device__ inline int guideLeafNode(const GuideDirNode* nodes, int root, glm::vec3 dir, int& quadrant)
+{
+    glm::vec2 p = guideDirectionToSquare(dir);
+    int node = root;
+    while (true)
+    {
+        quadrant = guideQuadrant(p);
+        int child = nodes[node].child[quadrant];
+        if (child < 0)
+        {
+            return node;
+        }
+        node = child;
+    }
+}
+
+/**
+ * Solid angle density with which sampleGuideDirection produces dir from the
+ * quadtree at root.
+ */
+__host__ __device__ inline float guidePdf(const GuideDirNode* nodes, int root, glm::vec3 dir)
+{
+    glm::vec2 p = guideDirectionToSquare(dir);
+    float pdf = 1.f / (4.f * PI);
+    int node = root;
+    while (node >= 0)
+    {
+        const GuideDirNode& n = nodes[node];
+        float total = n.sum[0] + n.sum[1] + n.sum[2] + n.sum[3];
+        int q = guideQuadrant(p);
+        if (total <= 0.f)
+        {
+            return 0.f;
+        }
+        pdf *= 4.f * n.sum[q] / total;
+        node = n.child[q];
+    }
+    return pdf;
+}
+
+/**
+ * Samples a direction from the quadtree at root: quadrants proportionally to
+ * their energy down to a leaf, then a uniform point in it.
+ */
+__host__ __device__ inline glm::vec3 sampleGuideDirection(const GuideDirNode* nodes, int root,
+                                                          thrust::default_random_engine& rng)
+{
+    thrust::uniform_real_distribution<float> u01(0, 1);
+    glm::vec2 origin(0.f);
+    float size = 1.f;
+    int node = root;
+    while (node >= 0)
+    {
+        const GuideDirNode& n = nodes[node];
+        float u = u01(rng) * (n.sum[0] + n.sum[1] + n.sum[2] + n.sum[3]);
+        int q = 0;
+        while (q < 3 && u >= n.sum[q])
+        {
+            u -= n.sum[q];
+            ++q;
+        }
+        // rounding can run past the last quadrant with energy
+        while (q > 0 && n.sum[q] <= 0.f)
+        {
+            --q;
+        }
+        size *= 0.5f;
+        origin += size * glm::vec2(q & 1, q >> 1);
+        node = n.child[q];
+    }
+    return guideSquareToDirection(origin + size * glm::vec2(u01(rng), u01(rng)));
+}
@@ -1,11 +1,14 @@
 #include <cstdio>
 #include <cuda.h>
 #include <cmath>
+#include <chrono>
 #include <thrust/execution_policy.h>
 #include <thrust/random.h>
 #include <thrust/remove.h>
 #include <thrust/partition.h>
+#include <thrust/reduce.h>
 #include <thrust/device_ptr.h>
+#include <vector>
 
 #include "sceneStructs.h"
 #include "scene.h"
@@ -15,17 +18,159 @@
 #include "pathtrace.h"
 #include "intersections.h"
 #include "interactions.h"
+#include "environment.h"
+#include "lightbvh.h"
+#include "photonmap.h"
+#include "pathguiding.h"
+#include "radiancecache.h"
+#include "packedtriangle.h"
+#include "scenearena.h"
+#include "morton.h"
+#include "raystats.h"
 #include "../stream_compaction/common.h"
+#include "../stream_compaction/efficient.h"
+#include "../stream_compaction/primitives.h"
+#include "../stream_compaction/parallel.h"
 
 #define ERRORCHECK 1
 #define STREAM_COMPACTION 1
-#define SORT_BY_MATERIAL 1
+// the shading queues already group paths by BSDF, making the sort redundant
+#define SORT_BY_MATERIAL (!SHADING_QUEUES)
+#define SORT_BY_RAY_KEY 0
+#define THRUST_PRIMITIVES 0
+#define PIXEL_ORDER_TILED 1
 #define CACHE_FIRST_BOUNCE 0
+#define SPECIALIZE_KERNELS 1
+#define SHADING_QUEUES 1
+#define RAY_STATS 0
+#define TEMPORAL_REPROJECTION 1
+#define ERROR_ESTIMATE 1
+#define PATH_REGENERATION 1
+#define CAUSTIC_PHOTONS 0
+#define PATH_GUIDING 1
+#define RADIANCE_CACHE 0
 #define PERFORMANCE_ANALYSIS 1
 
-#define FILENAME (strrchr(__FILE__, '/') ? strrchr(__FILE__, '/') + 1 : __FILE__)
-#define checkCUDAError(msg) checkCUDAErrorFn(msg, FILENAME, __LINE__)
-void checkCUDAErrorFn(const char *msg, const char *file, int line) {
+#if CACHE_FIRST_BOUNCE
+// The first CACHE_FIRST_BOUNCE_PATTERNS iterations trace jittered camera rays
+// normally and keep them, together with their first intersections; later
+// iterations cycle through these patterns instead of re-intersecting. The
+// number of resident patterns is capped by CACHE_FIRST_BOUNCE_BUDGET_MB.
+#define CACHE_FIRST_BOUNCE_PATTERNS 16
+#define CACHE_FIRST_BOUNCE_BUDGET_MB 256
+#endif
+
+#if TEMPORAL_REPROJECTION
+// After a camera move, the previous accumulation is reprojected into the new
+// view through each pixel's first hit and shown blended with the fresh
+// samples, worth at most TEMPORAL_HISTORY_SAMPLES samples. History is rejected
+// where the first hits are further apart than TEMPORAL_DEPTH_TOLERANCE times
+// their distance to the camera, or where their normals disagree. Only the
+// preview uses it; saved images hold fresh samples only.
+#define TEMPORAL_HISTORY_SAMPLES 16
+#define TEMPORAL_DEPTH_TOLERANCE 0.02f
+#define TEMPORAL_NORMAL_TOLERANCE 0.9f
+#endif
+
+#if ERROR_ESTIMATE
+// Even iterations are also accumulated on their own. The difference between
+// their mean and the mean of all iterations has about the variance of the
+// latter, which gives a cheap estimate of the remaining noise.
+#define ERROR_ESTIMATE_EPSILON 1e-4f
+#endif
+
+// Shadow rays towards sampled emitters end this fraction short of the light,
+// so they don't hit the surface they were aimed at.
+#define SHADOW_RAY_EPSILON 1e-3f
+
+#if PATH_REGENERATION
+// Paths that terminate are gathered right after each compaction and their
+// slots refilled with camera rays for further samples, so every bounce runs
+// on a full pool until PATH_REGENERATION_SAMPLES samples per pixel have been
+// started; only the last few bounces of an iteration drain the pool.
+// An iteration then adds that many samples to every pixel.
+#define PATH_REGENERATION_SAMPLES 4
+#define SAMPLES_PER_ITERATION PATH_REGENERATION_SAMPLES
+#if !STREAM_COMPACTION
+#error "PATH_REGENERATION refills the slots freed by STREAM_COMPACTION"
+#endif
+#else
+#define SAMPLES_PER_ITERATION 1
+#endif
+
+#if CAUSTIC_PHOTONS
+// In scenes with specular materials and emitters, each iteration first traces
+// this many photons from the emitters and keeps those that reach a diffuse
+// surface through specular bounces. Paths gather them at their first diffuse
+// vertex. The gather radius starts at a fraction of the scene's diagonal and
+// shrinks every iteration as r_i^2 = r_{i-1}^2 (i - 1 + alpha) / i, so the
+// average over iterations converges. The gather is a biased density estimate,
+// so it's off unless a render opts into it.
+#define CAUSTIC_PHOTONS_PER_ITERATION (1 << 18)
+#define CAUSTIC_INITIAL_RADIUS 0.005f
+#define CAUSTIC_RADIUS_ALPHA (2.f / 3.f)
+// depth passed to makeSeededRandomEngine for photons, beyond any path's
+#define CAUSTIC_PHOTON_SEED_DEPTH 511
+#endif
+
+#if PATH_GUIDING
+// Diffuse vertices sample from an SD-tree of the incident radiance learned so
+// far with probability PATH_GUIDING_FRACTION, and cosine-weighted otherwise.
+// Training runs in passes of doubling length: after iterations 1, 3, 7, 15,
+// ... the host refines the tree from what the pass recorded. Each iteration
+// keeps up to PATH_GUIDING_RECORDS_PER_PIXEL diffuse vertices per pixel for
+// recording; vertices past that aren't recorded.
+#define PATH_GUIDING_FRACTION 0.5f
+#define PATH_GUIDING_RECORDS_PER_PIXEL 8
+#endif
+
+#if RADIANCE_CACHE
+// Paths end at a diffuse vertex on the radiance cached there once their
+// spread, the footprint their bounces have widened to, is more than
+// RADIANCE_CACHE_SPREAD times the camera ray's (as areas, after Mueller et
+// al.'s "Real-time Neural Radiance Caching"). Every diffuse vertex recorded
+// in an iteration, up to RADIANCE_CACHE_RECORDS_PER_PIXEL per pixel, updates
+// the cache with what its path went on to find. The table is a fixed
+// RADIANCE_CACHE_ENTRIES entries of 44 bytes; entries nobody touched for
+// RADIANCE_CACHE_MAX_AGE iterations are evicted, and estimates average at
+// most RADIANCE_CACHE_MAX_SAMPLES samples so they keep adapting. The cache
+// trades bias for speed, so it's off unless a render opts into it.
+#define RADIANCE_CACHE_ENTRIES (1 << 20)
+#define RADIANCE_CACHE_SPREAD 0.01f
+#define RADIANCE_CACHE_RECORDS_PER_PIXEL 8
+#define RADIANCE_CACHE_MAX_AGE 32
+#define RADIANCE_CACHE_MAX_SAMPLES 1024.f
+// cell size near the camera, and the distance from which cells double in
+// size with every doubling of the distance, as fractions of the scene diagonal
+#define RADIANCE_CACHE_CELL_SIZE 0.005f
+#define RADIANCE_CACHE_NEAR_DISTANCE 0.125f
+#endif
+
+// Features each kernel is specialized on; with SPECIALIZE_KERNELS, the
+// features of the loaded scene select one instantiation per kernel, otherwise
+// the kernels are always launched with FEATURE_ALL.
+#define RAY_GEN_FEATURES (FEATURE_DOF)
+#define INTERSECT_FEATURES (FEATURE_MESH | FEATURE_BUMP)
+#define SHADE_FEATURES (FEATURE_TEXTURE | FEATURE_REFLECTIVE | FEATURE_REFRACTIVE)
+
+// Paths are shaded from one queue per BSDF type, plus one for paths whose ray
+// left the scene, each by a kernel specialized for it.
+#define SHADE_QUEUE_MISS NUM_BSDF_TYPES
+#define NUM_SHADE_QUEUES (NUM_BSDF_TYPES + 1)
+
+// With RAY_STATS, the work done for each pixel is counted and saved as
+// heatmaps next to the rendered image; otherwise the counters compile out.
+#if RAY_STATS
+#define RAY_STAT(x) x
+#else
+#define RAY_STAT(x)
+#endif
+
+// stream_compaction/common.h declares its own checkCUDAErrorFn; use a local
+// one that also synchronizes, so the two don't collide at link time
+#undef checkCUDAError
+#define checkCUDAError(msg) checkPathtraceErrorFn(msg, FILENAME, __LINE__)
+static void checkPathtraceErrorFn(const char *msg, const char *file, int line) {
 #if ERRORCHECK
     cudaDeviceSynchronize();
     cudaError_t err = cudaGetLastError();
@@ -48,12 +193,24 @@ void checkCUDAErrorFn(const char *msg, const char *file, int line) {
 #if PERFORMANCE_ANALYSIS
 const int numIters = 100;
 static float totalTime = 0.f;
+static std::vector<float> depthTime;
 using StreamCompaction::Common::PerformanceTimer;
 PerformanceTimer& timer()
 {
     static PerformanceTimer timer;
     return timer;
 }
+
+// In the numIters iterations after the timed ones, the intersection kernel
+// also runs in its all-features variant, on the same paths as the scene's
+// variant, and both are timed.
+static float variantIntersectTime = 0.f;
+static float allFeaturesIntersectTime = 0.f;
+PerformanceTimer& variantTimer()
+{
+    static PerformanceTimer timer;
+    return timer;
+}
 #endif
 
 __host__ __device__
@@ -62,20 +219,61 @@ thrust::default_random_engine makeSeededRandomEngine(int iter, int index, int de
     return thrust::default_random_engine(h);
 }
 
-//Kernel that writes the image to the OpenGL PBO directly.
-__global__ void sendImageToPBO(uchar4* pbo, glm::ivec2 resolution,
-        int iter, glm::vec3* image) {
-    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
-    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+// Pixel covered by the path (or thread) with the given index. With
+// PIXEL_ORDER_TILED, neighbouring indices map to pixels in the same tile
+// rather than along a scanline.
+__host__ __device__ inline glm::ivec2 pixelFromIndex(int index, glm::ivec2 resolution)
+{
+#if PIXEL_ORDER_TILED
+    return tiledPixelFromIndex(index, resolution);
+#else
+    return glm::ivec2(index % resolution.x, index / resolution.x);
+#endif
+}
+
+//Mean radiance of an image pixel. If history is set, its mean radiance (xyz)
+//counts as w extra samples.
+__device__ glm::vec3 pixelRadiance(int index, int numSamples, const glm::vec3* image, const glm::vec4* history) {
+    glm::vec3 pix = image[index];
+    float samples = numSamples;
+    if (history) {
+        pix += glm::vec3(history[index]) * history[index].w;
+        samples += history[index].w;
+    }
+    return pix / samples;
+}
 
-    if (x < resolution.x && y < resolution.y) {
-        int index = x + (y * resolution.x);
-        glm::vec3 pix = image[index];
+//Kernel that writes the image to the OpenGL PBO directly. An image rendered
+//at a lower resolution than the PBO's is upscaled bilinearly.
+__global__ void sendImageToPBO(uchar4* pbo, glm::ivec2 displayResolution, glm::ivec2 resolution,
+        int numSamples, glm::vec3* image, const glm::vec4* history) {
+    int thread = (blockIdx.x * blockDim.x) + threadIdx.x;
+
+    if (thread < displayResolution.x * displayResolution.y) {
+        glm::ivec2 pixel = pixelFromIndex(thread, displayResolution);
+        int index = pixel.x + (pixel.y * displayResolution.x);
+        glm::vec3 pix;
+        if (resolution == displayResolution) {
+            pix = pixelRadiance(index, numSamples, image, history);
+        } else {
+            // the display pixel's center in render pixels, whose centers are
+            // at integer coordinates; clamped at the image edges
+            glm::vec2 p = (glm::vec2(pixel) + 0.5f) * glm::vec2(resolution) / glm::vec2(displayResolution) - 0.5f;
+            p = glm::max(p, glm::vec2(0.f));
+            glm::ivec2 p0 = glm::min(glm::ivec2(p), resolution - 1);
+            glm::ivec2 p1 = glm::min(p0 + 1, resolution - 1);
+            glm::vec2 f = p - glm::vec2(p0);
+            glm::vec3 top = glm::mix(pixelRadiance(p0.x + p0.y * resolution.x, numSamples, image, history),
+                                     pixelRadiance(p1.x + p0.y * resolution.x, numSamples, image, history), f.x);
+            glm::vec3 bottom = glm::mix(pixelRadiance(p0.x + p1.y * resolution.x, numSamples, image, history),
+                                        pixelRadiance(p1.x + p1.y * resolution.x, numSamples, image, history), f.x);
+            pix = glm::mix(top, bottom, f.y);
+        }
 
         glm::ivec3 color;
-        color.x = glm::clamp((int) (pix.x / iter * 255.0), 0, 255);
-        color.y = glm::clamp((int) (pix.y / iter * 255.0), 0, 255);
-        color.z = glm::clamp((int) (pix.z / iter * 255.0), 0, 255);
+        color.x = glm::clamp((int) (pix.x * 255.0), 0, 255);
+        color.y = glm::clamp((int) (pix.y * 255.0), 0, 255);
+        color.z = glm::clamp((int) (pix.z * 255.0), 0, 255);
 
         // Each thread writes one pixel location in the texture (textel)
         pbo[index].w = 0;
@@ -88,15 +286,438 @@ __global__ void sendImageToPBO(uchar4* pbo, glm::ivec2 resolution,
 static Scene* hst_scene = nullptr;
 static glm::vec3* dev_image = nullptr;
 static Geom* dev_geoms = nullptr;
-static Triangle* dev_triangles = nullptr;
+static DeviceTriangle* dev_triangles = nullptr;
+static WideBVHNode* dev_bvhNodes = nullptr;
+static size_t bvhNodeCapacity = 0;
+// dev_bvhNodes has an allocation of its own once a rebuilt BVH outgrew its
+// section of the arena
+static bool bvhNodesOwned = false;
 static Material* dev_materials = nullptr;
 static glm::vec3* dev_texData = nullptr;
+// All of the above but dev_image in one allocation, laid out by sceneArena.
+// The staging buffer is kept for scenes whose triangles are animated.
+static char* dev_sceneArena = nullptr;
+static SceneArena sceneArena;
 static PathSegment* dev_paths = nullptr;
 static ShadeableIntersection* dev_intersections = nullptr;
+static Ray* dev_cachedRays = nullptr;
 static ShadeableIntersection* dev_cachedIntersections = nullptr;
+static int numCachedPatterns = 0;
+static PathSegment* dev_pathsScratch = nullptr;
+static ShadeableIntersection* dev_intersectionsScratch = nullptr;
+static int* dev_sortKeys = nullptr;
+static int* dev_sortKeysScratch = nullptr;
+static int* dev_sortIndices = nullptr;
+static int* dev_sortIndicesScratch = nullptr;
+static int materialKeyBits = 0;
+static StreamCompaction::Primitives::Workspace compactionWorkspace;
+static glm::vec3 sceneMin;
+static glm::vec3 sceneInvExtent;
+static int sceneFeatures = FEATURE_ALL;
+static int* dev_shadeQueues = nullptr;
+static int* dev_shadeQueueCounts = nullptr;
+static RayStats* dev_pixelStats = nullptr;
+
+// Shadow ray towards a sampled light, and the radiance it adds to its pixel
+// unless something is in the way before tMax. Zero radiance marks an empty
+// slot.
+struct ShadowRay
+{
+    Ray ray;
+    float tMax;
+    glm::vec3 radiance;
+    int pixelIndex;
+    int guideRecord;    // the path's newest guiding record when it was sampled
+    int cacheRecord;    // and its newest radiance cache record
+};
+
+// Shadow ray slots of each path, one per kind of light sampled at its
+// diffuse vertices.
+enum ShadowRaySlot
+{
+    SHADOW_RAY_ENVIRONMENT,
+    SHADOW_RAY_EMITTER,
+    NUM_SHADOW_RAYS
+};
+
+// What the shading kernels need to light diffuse vertices: the environment,
+// the emitters and the geometry they're on, the shadow ray slots, the
+// caustic photons, and the path guide and radiance cache that learn from the
+// radiance paths find. shadowRays is null if the scene has nothing to sample.
+struct LightSampling
+{
+    EnvironmentMap env;
+    LightBVH lights;
+    const Geom* geoms;
+    const DeviceTriangle* tris;
+    ShadowRay* shadowRays;
+    PhotonMap caustics;
+    PathGuide guide;
+    RadianceCache cache;
+};
+
+static glm::vec3* dev_envRadiance = nullptr;
+static AliasEntry* dev_envAlias = nullptr;
+static EnvironmentMap environment;
+static Light* dev_lights = nullptr;
+static LightBVHNode* dev_lightNodes = nullptr;
+static LightBVH lightBVH;
+static ShadowRay* dev_shadowRays = nullptr;
+
+// Caustic photons of the current iteration, before and after sorting by
+// cell, and the hash grid over them. dev_photons is null if the scene gets
+// no photon map.
+static Photon* dev_photons = nullptr;
+static Photon* dev_photonsSorted = nullptr;
+static int* dev_photonCount = nullptr;
+static int* dev_photonKeys = nullptr;
+static int* dev_photonKeysScratch = nullptr;
+static int* dev_photonIndices = nullptr;
+static int* dev_photonIndicesScratch = nullptr;
+static int* dev_photonCellStart = nullptr;
+static int* dev_photonCellEnd = nullptr;
+static AliasEntry* dev_photonLightAlias = nullptr;
+static StreamCompaction::Primitives::Workspace photonWorkspace;
+static float causticInitialRadius = 0.f;
+static PhotonMap photonMap;
+
+// SD-tree of PATH_GUIDING on the host and the device, where its arrays have
+// room for the given number of nodes. dev_guideSpatial is null without
+// guiding.
+static GuideTree guideTree;
+static PathGuide pathGuide;
+static GuideSpatialNode* dev_guideSpatial = nullptr;
+static GuideDirNode* dev_guideSampling = nullptr;
+static GuideDirNode* dev_guideRecording = nullptr;
+static unsigned int* dev_guideSampleCounts = nullptr;
+static GuideRecord* dev_guideRecords = nullptr;
+static int* dev_guideRecordCount = nullptr;
+static size_t guideSpatialCapacity = 0;
+static size_t guideSamplingCapacity = 0;
+static size_t guideRecordingCapacity = 0;
+static int guideIterations = 0;
+
+// Hash grid and records of RADIANCE_CACHE; radianceCache.size is 0 without it.
+static unsigned long long* dev_cacheKeys = nullptr;
+static glm::vec4* dev_cacheAccum = nullptr;
+static glm::vec4* dev_cacheResolved = nullptr;
+static unsigned int* dev_cacheAge = nullptr;
+static CacheRecord* dev_cacheRecords = nullptr;
+static int* dev_cacheRecordCount = nullptr;
+static RadianceCache radianceCache;
+
+#if TEMPORAL_REPROJECTION
+// First surface seen through a pixel, to match pixels across camera moves.
+struct FirstHit
+{
+    glm::vec3 position;
+    glm::vec3 normal;
+    int hit;
+};
+
+// Reprojection state: the first hits of the current and previous camera, the
+// previous accumulation's mean radiance and weight, and the history
+// reprojected from it (mean radiance in xyz, weight in w).
+static FirstHit* dev_firstHits = nullptr;
+static FirstHit* dev_prevFirstHits = nullptr;
+static glm::vec4* dev_prevEstimate = nullptr;
+static glm::vec4* dev_history = nullptr;
+static Camera lastCamera;
+static int lastIter = 0;
+static Camera historyCamera;
+static bool historyPending = false;
+#endif
+static int renderScale = 1;
+static glm::vec3* dev_imageEven = nullptr;
+static glm::vec2* dev_errorTerms = nullptr;
+
+// The scene camera at the current render scale: 1/renderScale as many pixels
+// in each direction, each proportionally larger.
+static Camera renderCamera()
+{
+    Camera cam = hst_scene->state.camera;
+    glm::ivec2 fullResolution = cam.resolution;
+    cam.resolution = (fullResolution + renderScale - 1) / renderScale;
+    cam.pixelLength *= glm::vec2(fullResolution) / glm::vec2(cam.resolution);
+    return cam;
+}
+
+// Features used by a scene's geometry, materials and camera.
+static int computeSceneFeatures(const Scene& scene)
+{
+    int features = 0;
+    for (const Geom& geom : scene.geoms)
+    {
+        if (geom.type == MESH)
+        {
+            features |= FEATURE_MESH;
+        }
+    }
+    for (const Material& mat : scene.materials)
+    {
+        if (mat.bump.offset >= 0)
+        {
+            features |= FEATURE_BUMP;
+        }
+        if (mat.tex.offset >= 0)
+        {
+            features |= FEATURE_TEXTURE;
+        }
+        if (mat.hasReflective > 0.f)
+        {
+            features |= FEATURE_REFLECTIVE;
+        }
+        if (mat.hasRefractive > 0.f)
+        {
+            features |= FEATURE_REFRACTIVE;
+        }
+    }
+    if (scene.state.camera.aperture > 0.f)
+    {
+        features |= FEATURE_DOF;
+    }
+    return features;
+}
+
+#if PERFORMANCE_ANALYSIS
+// Names of the features in a feature mask, for reports.
+static std::string featureString(int features)
+{
+    static const char* names[] = { "mesh", "bump", "texture", "reflective", "refractive", "dof" };
+    std::string str;
+    for (int i = 0; i < 6; ++i)
+    {
+        if (features & (1 << i))
+        {
+            str += str.empty() ? names[i] : std::string("|") + names[i];
+        }
+    }
+    return str.empty() ? "none" : str;
+}
+#endif
+
+/**
+ * Calls launch.template run<F>() with F = features & KernelFeatures. Only the
+ * subsets of KernelFeatures are instantiated, so a kernel specialized on n
+ * features has 2^n variants.
+ */
+template <int KernelFeatures, int F = KernelFeatures>
+struct FeatureDispatch
+{
+    template <typename Launch>
+    static void run(int features, const Launch& launch)
+    {
+        if ((features & KernelFeatures) == F)
+        {
+            launch.template run<F>();
+        }
+        else
+        {
+            // next smaller subset of KernelFeatures
+            FeatureDispatch<KernelFeatures, (F - 1) & KernelFeatures>::run(features, launch);
+        }
+    }
+};
+
+template <int KernelFeatures>
+struct FeatureDispatch<KernelFeatures, 0>
+{
+    template <typename Launch>
+    static void run(int features, const Launch& launch)
+    {
+        launch.template run<0>();
+    }
+};
+
+// World space bounds of a geom.
+static AABB geomBounds(const Geom& geom)
+{
+    if (geom.type == MESH)
+    {
+        return geom.aabb;
+    }
+    AABB aabb;
+    for (int i = 0; i < 8; ++i)
+    {
+        glm::vec3 corner(i & 1 ? .5f : -.5f, i & 2 ? .5f : -.5f, i & 4 ? .5f : -.5f);
+        glm::vec3 worldPos(geom.transform * glm::vec4(corner, 1.f));
+        aabb.bound[0] = glm::min(aabb.bound[0], worldPos);
+        aabb.bound[1] = glm::max(aabb.bound[1], worldPos);
+    }
+    return aabb;
+}
+
+// Copies the scene's triangles to dev_triangles through their section of the
+// staging buffer, packing their attributes on the host threads with
+// COMPRESSED_ATTRIBUTES.
+static void uploadTriangles(const std::vector<Triangle>& triangles)
+{
+    stageTriangles(triangles, sceneArena);
+    cudaMemcpy(dev_triangles, sceneArena.staging + sceneArena.offset[SECTION_TRIANGLES],
+               sceneArena.bytes[SECTION_TRIANGLES], cudaMemcpyHostToDevice);
+}
+
+#if COMPRESSED_ATTRIBUTES
+// Prints what packing the triangles saves and the largest error it makes in
+// each attribute, against their packed versions.
+static void reportAttributeError(const std::vector<Triangle>& triangles, const PackedTriangle* packedTriangles)
+{
+    if (triangles.empty())
+    {
+        return;
+    }
+    float normalError = 0.f;
+    float tangentError = 0.f;
+    float uvError = 0.f;
+    for (size_t i = 0; i < triangles.size(); ++i)
+    {
+        const Triangle& tri = triangles[i];
+        const PackedTriangle& packed = packedTriangles[i];
+        for (int j = 0; j < 3; ++j)
+        {
+            float normalLength = glm::length(tri.normal[j]);
+            if (normalLength > 0.f)
+            {
+                float c = glm::dot(tri.normal[j] / normalLength, triangleNormal(packed, j));
+                normalError = glm::max(normalError, acosf(glm::clamp(c, -1.f, 1.f)));
+            }
+            glm::vec3 tangent(tri.tangent[j]);
+            float tangentLength = glm::length(tangent);
+            if (tangentLength > 0.f)
+            {
+                float c = glm::dot(tangent / tangentLength, glm::vec3(triangleTangent(packed, j)));
+                tangentError = glm::max(tangentError, acosf(glm::clamp(c, -1.f, 1.f)));
+            }
+            // packed UVs may be off by whole repeats
+            glm::vec2 d = triangleUV(packed, j) - tri.uv[j];
+            d -= glm::round(d);
+            uvError = glm::max(uvError, glm::max(fabsf(d.x), fabsf(d.y)));
+        }
+    }
+    const float toDegrees = 180.f / PI;
+    const float mb = 1.f / (1 << 20);
+    std::cout << "Packed " << triangles.size() << " triangles: " << triangles.size() * sizeof(PackedTriangle) * mb
+              << " MB instead of " << triangles.size() * sizeof(Triangle) * mb << " MB; max error " << normalError * toDegrees
+              << " deg in normals, " << tangentError * toDegrees << " deg in tangents, " << uvError << " in UVs"
+              << std::endl;
+}
+#endif
+
+// World space bounds of all geoms.
+static AABB computeSceneBounds(const Scene& scene)
+{
+    AABB sceneBounds;
+    for (const Geom& geom : scene.geoms)
+    {
+        AABB aabb = geomBounds(geom);
+        sceneBounds.bound[0] = glm::min(sceneBounds.bound[0], aabb.bound[0]);
+        sceneBounds.bound[1] = glm::max(sceneBounds.bound[1], aabb.bound[1]);
+    }
+    return sceneBounds;
+}
+
+// Box the ray keys of SORT_BY_RAY_KEY are quantized in.
+static void updateSceneBounds(const Scene& scene)
+{
+    AABB sceneBounds = computeSceneBounds(scene);
+    sceneMin = sceneBounds.bound[0];
+    sceneInvExtent = 1.f / glm::max(sceneBounds.bound[1] - sceneBounds.bound[0], glm::vec3(EPSILON));
+}
+
+#if CAUSTIC_PHOTONS
+// Alias table picking the light each photon starts from, by the power the
+// light BVH's leaves record.
+static void updatePhotonLights(const Scene& scene)
+{
+    std::vector<float> power(scene.lights.size(), 0.f);
+    for (const LightBVHNode& node : scene.lightNodes)
+    {
+        if (node.leaf)
+        {
+            power[node.child] = node.power;
+        }
+    }
+    std::vector<AliasEntry> alias = buildAliasTable(power);
+    cudaMemcpy(dev_photonLightAlias, alias.data(), alias.size() * sizeof(AliasEntry), cudaMemcpyHostToDevice);
+}
+#endif
+
+#if PATH_GUIDING
+// Copies guideTree to the device, growing its arrays as needed, with empty
+// recording quadtrees and sample counts.
+static void uploadGuideTree()
+{
+    if (guideTree.spatial.size() > guideSpatialCapacity)
+    {
+        guideSpatialCapacity = guideTree.spatial.size();
+        cudaFree(dev_guideSpatial);
+        cudaFree(dev_guideSampleCounts);
+        cudaMalloc(&dev_guideSpatial, guideSpatialCapacity * sizeof(GuideSpatialNode));
+        cudaMalloc(&dev_guideSampleCounts, guideSpatialCapacity * sizeof(unsigned int));
+    }
+    if (guideTree.samplingNodes.size() > guideSamplingCapacity)
+    {
+        guideSamplingCapacity = guideTree.samplingNodes.size();
+        cudaFree(dev_guideSampling);
+        cudaMalloc(&dev_guideSampling, guideSamplingCapacity * sizeof(GuideDirNode));
+    }
+    if (guideTree.recordingNodes.size() > guideRecordingCapacity)
+    {
+        guideRecordingCapacity = guideTree.recordingNodes.size();
+        cudaFree(dev_guideRecording);
+        cudaMalloc(&dev_guideRecording, guideRecordingCapacity * sizeof(GuideDirNode));
+    }
+    cudaMemcpy(dev_guideSpatial, guideTree.spatial.data(), guideTree.spatial.size() * sizeof(GuideSpatialNode), cudaMemcpyHostToDevice);
+    cudaMemcpy(dev_guideSampling, guideTree.samplingNodes.data(), guideTree.samplingNodes.size() * sizeof(GuideDirNode), cudaMemcpyHostToDevice);
+    cudaMemcpy(dev_guideRecording, guideTree.recordingNodes.data(), guideTree.recordingNodes.size() * sizeof(GuideDirNode), cudaMemcpyHostToDevice);
+    cudaMemset(dev_guideSampleCounts, 0, guideTree.spatial.size() * sizeof(unsigned int));
+
+    pathGuide.spatial = dev_guideSpatial;
+    pathGuide.samplingNodes = dev_guideSampling;
+    pathGuide.recordingNodes = dev_guideRecording;
+    pathGuide.sampleCounts = dev_guideSampleCounts;
+    pathGuide.boundsMin = guideTree.boundsMin;
+    pathGuide.boundsSize = guideTree.boundsSize;
+}
+
+// Ends a training pass of samplesPerPixel samples: refines guideTree from what
+// the device recorded and uploads the result.
+static void refinePathGuide(int samplesPerPixel)
+{
+    std::vector<unsigned int> sampleCounts(guideTree.spatial.size());
+    cudaMemcpy(sampleCounts.data(), dev_guideSampleCounts, sampleCounts.size() * sizeof(unsigned int), cudaMemcpyDeviceToHost);
+    cudaMemcpy(guideTree.recordingNodes.data(), dev_guideRecording, guideTree.recordingNodes.size() * sizeof(GuideDirNode), cudaMemcpyDeviceToHost);
+    refineGuideTree(guideTree, sampleCounts, samplesPerPixel);
+    uploadGuideTree();
+    std::cout << "Path guiding: pass of " << samplesPerPixel << " spp, " << guideTree.spatial.size() << " spatial nodes, "
+              << guideTree.samplingNodes.size() << " sampling and " << guideTree.recordingNodes.size()
+              << " recording quadtree nodes" << std::endl;
+    checkCUDAError("refinePathGuide");
+}
+#endif
+
+#if RADIANCE_CACHE
+// Empties the radiance cache and sizes its cells for the scene.
+static void resetRadianceCache(const Scene& scene)
+{
+    AABB sceneBounds = computeSceneBounds(scene);
+    float diagonal = glm::length(sceneBounds.bound[1] - sceneBounds.bound[0]);
+    radianceCache.cellSize = RADIANCE_CACHE_CELL_SIZE * diagonal;
+    radianceCache.nearDistance = RADIANCE_CACHE_NEAR_DISTANCE * diagonal;
+    cudaMemset(dev_cacheKeys, 0, RADIANCE_CACHE_ENTRIES * sizeof(unsigned long long));
+    cudaMemset(dev_cacheAccum, 0, RADIANCE_CACHE_ENTRIES * sizeof(glm::vec4));
+    cudaMemset(dev_cacheResolved, 0, RADIANCE_CACHE_ENTRIES * sizeof(glm::vec4));
+    cudaMemset(dev_cacheAge, 0, RADIANCE_CACHE_ENTRIES * sizeof(unsigned int));
+}
+#endif
 
 void pathtraceInit(Scene *scene) {
     hst_scene = scene;
+#if SPECIALIZE_KERNELS
+    sceneFeatures = computeSceneFeatures(*scene);
+#else
+    sceneFeatures = FEATURE_ALL;
+#endif
     const Camera &cam = hst_scene->state.camera;
     const int pixelcount = cam.resolution.x * cam.resolution.y;
 
@@ -105,26 +726,179 @@ void pathtraceInit(Scene *scene) {
 
     cudaMalloc(&dev_paths, pixelcount * sizeof(PathSegment));
 
-    cudaMalloc(&dev_geoms, scene->geoms.size() * sizeof(Geom));
-    cudaMemcpy(dev_geoms, scene->geoms.data(), scene->geoms.size() * sizeof(Geom), cudaMemcpyHostToDevice);
-
-    cudaMalloc(&dev_triangles, scene->triangles.size() * sizeof(Triangle));
-    cudaMemcpy(dev_triangles, scene->triangles.data(), scene->triangles.size() * sizeof(Triangle), cudaMemcpyHostToDevice);
-
-    cudaMalloc(&dev_materials, scene->materials.size() * sizeof(Material));
-    cudaMemcpy(dev_materials, scene->materials.data(), scene->materials.size() * sizeof(Material), cudaMemcpyHostToDevice);
+    // the scene data goes up as one copy of one host buffer
+    std::chrono::steady_clock::time_point uploadStart = std::chrono::steady_clock::now();
+    stageScene(*scene, sceneArena);
+    cudaMalloc(&dev_sceneArena, sceneArena.totalBytes);
+    cudaMemcpy(dev_sceneArena, sceneArena.staging, sceneArena.totalBytes, cudaMemcpyHostToDevice);
+    float uploadTime = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - uploadStart).count();
+    std::cout << "Scene arena: " << sceneArena.totalBytes / float(1 << 20) << " MB in " << NUM_SCENE_SECTIONS
+              << " sections, staged and uploaded in " << uploadTime << " ms from "
+              << (sceneArena.pinned ? "pinned" : "pageable") << " memory; peak host memory "
+              << utilityCore::peakResidentBytes() / float(1 << 20) << " MB" << std::endl;
+
+    dev_geoms = sceneArena.section<Geom>(dev_sceneArena, SECTION_GEOMS);
+    dev_triangles = sceneArena.section<DeviceTriangle>(dev_sceneArena, SECTION_TRIANGLES);
+    dev_bvhNodes = sceneArena.section<WideBVHNode>(dev_sceneArena, SECTION_BVH_NODES);
+    bvhNodeCapacity = scene->bvhNodes.size();
+    bvhNodesOwned = false;
+    dev_materials = sceneArena.section<Material>(dev_sceneArena, SECTION_MATERIALS);
+    dev_texData = sceneArena.section<glm::vec3>(dev_sceneArena, SECTION_TEXTURES);
+#if COMPRESSED_ATTRIBUTES
+    reportAttributeError(scene->triangles, sceneArena.section<PackedTriangle>(sceneArena.staging, SECTION_TRIANGLES));
+#endif
+    if (scene->meshAnimations.empty())
+    {
+        freeSceneStaging(sceneArena);
+    }
+    releaseStagedArrays(*scene);
 
     cudaMalloc(&dev_intersections, pixelcount * sizeof(ShadeableIntersection));
     cudaMemset(dev_intersections, 0, pixelcount * sizeof(ShadeableIntersection));
 
-    cudaMalloc(&dev_cachedIntersections, pixelcount * sizeof(ShadeableIntersection));
-    cudaMemset(dev_cachedIntersections, 0, pixelcount * sizeof(ShadeableIntersection));
+#if CACHE_FIRST_BOUNCE
+    const size_t patternBytes = pixelcount * (sizeof(Ray) + sizeof(ShadeableIntersection));
+    const size_t budgetBytes = (size_t)CACHE_FIRST_BOUNCE_BUDGET_MB << 20;
+    numCachedPatterns = glm::clamp((int)(budgetBytes / patternBytes), 1, CACHE_FIRST_BOUNCE_PATTERNS);
+
+    cudaMalloc(&dev_cachedRays, numCachedPatterns * pixelcount * sizeof(Ray));
+    cudaMalloc(&dev_cachedIntersections, numCachedPatterns * pixelcount * sizeof(ShadeableIntersection));
+#endif
+
+#if SHADING_QUEUES
+    cudaMalloc(&dev_shadeQueues, NUM_SHADE_QUEUES * pixelcount * sizeof(int));
+    cudaMalloc(&dev_shadeQueueCounts, NUM_SHADE_QUEUES * sizeof(int));
+#endif
+
+#if RAY_STATS
+    cudaMalloc(&dev_pixelStats, pixelcount * sizeof(RayStats));
+    cudaMemset(dev_pixelStats, 0, pixelcount * sizeof(RayStats));
+#endif
+
+#if ERROR_ESTIMATE
+    cudaMalloc(&dev_imageEven, pixelcount * sizeof(glm::vec3));
+    cudaMemset(dev_imageEven, 0, pixelcount * sizeof(glm::vec3));
+    cudaMalloc(&dev_errorTerms, pixelcount * sizeof(glm::vec2));
+#endif
+
+#if TEMPORAL_REPROJECTION
+    cudaMalloc(&dev_firstHits, pixelcount * sizeof(FirstHit));
+    cudaMalloc(&dev_prevFirstHits, pixelcount * sizeof(FirstHit));
+    cudaMalloc(&dev_prevEstimate, pixelcount * sizeof(glm::vec4));
+    cudaMalloc(&dev_history, pixelcount * sizeof(glm::vec4));
+    cudaMemset(dev_history, 0, pixelcount * sizeof(glm::vec4));
+    lastIter = 0;
+    historyPending = false;
+#endif
+
+#if !THRUST_PRIMITIVES || SORT_BY_RAY_KEY
+    compactionWorkspace = StreamCompaction::Primitives::createWorkspace(pixelcount);
+    cudaMalloc(&dev_pathsScratch, pixelcount * sizeof(PathSegment));
+#endif
+
+#if SORT_BY_MATERIAL && !THRUST_PRIMITIVES
+    cudaMalloc(&dev_intersectionsScratch, pixelcount * sizeof(ShadeableIntersection));
+    // key 0 is for misses
+    materialKeyBits = ilog2ceil((int)scene->materials.size() + 1);
+#endif
+
+#if SORT_BY_RAY_KEY || (SORT_BY_MATERIAL && !THRUST_PRIMITIVES)
+    cudaMalloc(&dev_sortKeys, pixelcount * sizeof(int));
+    cudaMalloc(&dev_sortKeysScratch, pixelcount * sizeof(int));
+    cudaMalloc(&dev_sortIndices, pixelcount * sizeof(int));
+    cudaMalloc(&dev_sortIndicesScratch, pixelcount * sizeof(int));
+#endif
+
+#if SORT_BY_RAY_KEY
+    updateSceneBounds(*scene);
+#endif
+
+    environment = EnvironmentMap();
+    if (sceneArena.bytes[SECTION_ENV_RADIANCE] > 0)
+    {
+        dev_envRadiance = sceneArena.section<glm::vec3>(dev_sceneArena, SECTION_ENV_RADIANCE);
+        dev_envAlias = sceneArena.section<AliasEntry>(dev_sceneArena, SECTION_ENV_ALIAS);
+        environment.width = scene->envResolution.x;
+        environment.height = scene->envResolution.y;
+        environment.radiance = dev_envRadiance;
+        environment.alias = dev_envAlias;
+    }
+
+    lightBVH = LightBVH();
+    if (!scene->lights.empty())
+    {
+        dev_lights = sceneArena.section<Light>(dev_sceneArena, SECTION_LIGHTS);
+        dev_lightNodes = sceneArena.section<LightBVHNode>(dev_sceneArena, SECTION_LIGHT_NODES);
+        lightBVH.nodes = dev_lightNodes;
+        lightBVH.lights = dev_lights;
+        lightBVH.numLights = scene->lights.size();
+    }
+
+    if (environment.width > 0 || lightBVH.numLights > 0)
+    {
+        cudaMalloc(&dev_shadowRays, NUM_SHADOW_RAYS * pixelcount * sizeof(ShadowRay));
+    }
 
-    if (scene->texData.size() > 0)
+#if CAUSTIC_PHOTONS
+    // photons only pay off where some surface can focus an emitter's light
+    photonMap = PhotonMap();
+    bool hasSpecular = false;
+    for (const Material& mat : scene->materials)
+    {
+        hasSpecular = hasSpecular || (mat.emittance <= 0.f && (mat.hasReflective > 0.f || mat.hasRefractive > 0.f));
+    }
+    if (hasSpecular && lightBVH.numLights > 0)
     {
-        cudaMalloc(&dev_texData, scene->texData.size() * sizeof(glm::vec3));
-        cudaMemcpy(dev_texData, scene->texData.data(), scene->texData.size() * sizeof(glm::vec3), cudaMemcpyHostToDevice);
+        const int maxPhotons = CAUSTIC_PHOTONS_PER_ITERATION;
+        cudaMalloc(&dev_photons, maxPhotons * sizeof(Photon));
+        cudaMalloc(&dev_photonsSorted, maxPhotons * sizeof(Photon));
+        cudaMalloc(&dev_photonCount, sizeof(int));
+        cudaMalloc(&dev_photonKeys, maxPhotons * sizeof(int));
+        cudaMalloc(&dev_photonKeysScratch, maxPhotons * sizeof(int));
+        cudaMalloc(&dev_photonIndices, maxPhotons * sizeof(int));
+        cudaMalloc(&dev_photonIndicesScratch, maxPhotons * sizeof(int));
+        // the hash table has at most as many entries as photons, rounded up
+        cudaMalloc(&dev_photonCellStart, (1 << ilog2ceil(maxPhotons)) * sizeof(int));
+        cudaMalloc(&dev_photonCellEnd, (1 << ilog2ceil(maxPhotons)) * sizeof(int));
+        cudaMalloc(&dev_photonLightAlias, lightBVH.numLights * sizeof(AliasEntry));
+        updatePhotonLights(*scene);
+        photonWorkspace = StreamCompaction::Primitives::createWorkspace(maxPhotons);
+
+        AABB sceneBounds = computeSceneBounds(*scene);
+        causticInitialRadius = CAUSTIC_INITIAL_RADIUS * glm::length(sceneBounds.bound[1] - sceneBounds.bound[0]);
     }
+#endif
+
+#if PATH_GUIDING
+    pathGuide = PathGuide();
+    initGuideTree(guideTree, computeSceneBounds(*scene));
+    uploadGuideTree();
+    pathGuide.recordCapacity = PATH_GUIDING_RECORDS_PER_PIXEL * pixelcount;
+    cudaMalloc(&dev_guideRecords, pathGuide.recordCapacity * sizeof(GuideRecord));
+    cudaMalloc(&dev_guideRecordCount, sizeof(int));
+    pathGuide.records = dev_guideRecords;
+    pathGuide.recordCount = dev_guideRecordCount;
+    guideIterations = 0;
+#endif
+
+#if RADIANCE_CACHE
+    radianceCache = RadianceCache();
+    cudaMalloc(&dev_cacheKeys, RADIANCE_CACHE_ENTRIES * sizeof(unsigned long long));
+    cudaMalloc(&dev_cacheAccum, RADIANCE_CACHE_ENTRIES * sizeof(glm::vec4));
+    cudaMalloc(&dev_cacheResolved, RADIANCE_CACHE_ENTRIES * sizeof(glm::vec4));
+    cudaMalloc(&dev_cacheAge, RADIANCE_CACHE_ENTRIES * sizeof(unsigned int));
+    radianceCache.recordCapacity = RADIANCE_CACHE_RECORDS_PER_PIXEL * pixelcount;
+    cudaMalloc(&dev_cacheRecords, radianceCache.recordCapacity * sizeof(CacheRecord));
+    cudaMalloc(&dev_cacheRecordCount, sizeof(int));
+    radianceCache.keys = dev_cacheKeys;
+    radianceCache.accum = dev_cacheAccum;
+    radianceCache.resolved = dev_cacheResolved;
+    radianceCache.age = dev_cacheAge;
+    radianceCache.records = dev_cacheRecords;
+    radianceCache.recordCount = dev_cacheRecordCount;
+    radianceCache.size = RADIANCE_CACHE_ENTRIES;
+    resetRadianceCache(*scene);
+#endif
 
     checkCUDAError("pathtraceInit");
 }
@@ -132,234 +906,1592 @@ void pathtraceInit(Scene *scene) {
 void pathtraceFree() {
     cudaFree(dev_image);  // no-op if dev_image is null
     cudaFree(dev_paths);
-    cudaFree(dev_geoms);
-    cudaFree(dev_triangles);
-    cudaFree(dev_materials);
-    cudaFree(dev_texData);
+    if (bvhNodesOwned)
+    {
+        cudaFree(dev_bvhNodes);
+    }
+    bvhNodesOwned = false;
+    cudaFree(dev_sceneArena);
+    dev_sceneArena = nullptr;
+    dev_geoms = nullptr;
+    dev_triangles = nullptr;
+    dev_bvhNodes = nullptr;
+    dev_materials = nullptr;
+    dev_texData = nullptr;
+    if (sceneArena.staging)
+    {
+        freeSceneStaging(sceneArena);
+    }
     cudaFree(dev_intersections);
+    cudaFree(dev_cachedRays);
     cudaFree(dev_cachedIntersections);
+    dev_cachedRays = nullptr;
+    dev_cachedIntersections = nullptr;
+    cudaFree(dev_pathsScratch);
+    cudaFree(dev_intersectionsScratch);
+    cudaFree(dev_sortKeys);
+    cudaFree(dev_sortKeysScratch);
+    cudaFree(dev_sortIndices);
+    cudaFree(dev_sortIndicesScratch);
+    dev_pathsScratch = nullptr;
+    dev_intersectionsScratch = nullptr;
+    dev_sortKeys = nullptr;
+    dev_sortKeysScratch = nullptr;
+    dev_sortIndices = nullptr;
+    dev_sortIndicesScratch = nullptr;
+    StreamCompaction::Primitives::freeWorkspace(compactionWorkspace);
+    cudaFree(dev_shadeQueues);
+    cudaFree(dev_shadeQueueCounts);
+    dev_shadeQueues = nullptr;
+    dev_shadeQueueCounts = nullptr;
+    cudaFree(dev_pixelStats);
+    dev_pixelStats = nullptr;
+    cudaFree(dev_imageEven);
+    cudaFree(dev_errorTerms);
+    dev_imageEven = nullptr;
+    dev_errorTerms = nullptr;
+#if TEMPORAL_REPROJECTION
+    cudaFree(dev_firstHits);
+    cudaFree(dev_prevFirstHits);
+    cudaFree(dev_prevEstimate);
+    cudaFree(dev_history);
+    dev_firstHits = nullptr;
+    dev_prevFirstHits = nullptr;
+    dev_prevEstimate = nullptr;
+    dev_history = nullptr;
+#endif
+    cudaFree(dev_shadowRays);
+    dev_envRadiance = nullptr;
+    dev_envAlias = nullptr;
+    dev_lights = nullptr;
+    dev_lightNodes = nullptr;
+    dev_shadowRays = nullptr;
+    environment = EnvironmentMap();
+    lightBVH = LightBVH();
+    cudaFree(dev_photons);
+    cudaFree(dev_photonsSorted);
+    cudaFree(dev_photonCount);
+    cudaFree(dev_photonKeys);
+    cudaFree(dev_photonKeysScratch);
+    cudaFree(dev_photonIndices);
+    cudaFree(dev_photonIndicesScratch);
+    cudaFree(dev_photonCellStart);
+    cudaFree(dev_photonCellEnd);
+    cudaFree(dev_photonLightAlias);
+    dev_photons = nullptr;
+    dev_photonsSorted = nullptr;
+    dev_photonCount = nullptr;
+    dev_photonKeys = nullptr;
+    dev_photonKeysScratch = nullptr;
+    dev_photonIndices = nullptr;
+    dev_photonIndicesScratch = nullptr;
+    dev_photonCellStart = nullptr;
+    dev_photonCellEnd = nullptr;
+    dev_photonLightAlias = nullptr;
+    StreamCompaction::Primitives::freeWorkspace(photonWorkspace);
+    photonMap = PhotonMap();
+    cudaFree(dev_guideSpatial);
+    cudaFree(dev_guideSampling);
+    cudaFree(dev_guideRecording);
+    cudaFree(dev_guideSampleCounts);
+    cudaFree(dev_guideRecords);
+    cudaFree(dev_guideRecordCount);
+    dev_guideSpatial = nullptr;
+    dev_guideSampling = nullptr;
+    dev_guideRecording = nullptr;
+    dev_guideSampleCounts = nullptr;
+    dev_guideRecords = nullptr;
+    dev_guideRecordCount = nullptr;
+    guideSpatialCapacity = 0;
+    guideSamplingCapacity = 0;
+    guideRecordingCapacity = 0;
+    pathGuide = PathGuide();
+    cudaFree(dev_cacheKeys);
+    cudaFree(dev_cacheAccum);
+    cudaFree(dev_cacheResolved);
+    cudaFree(dev_cacheAge);
+    cudaFree(dev_cacheRecords);
+    cudaFree(dev_cacheRecordCount);
+    dev_cacheKeys = nullptr;
+    dev_cacheAccum = nullptr;
+    dev_cacheResolved = nullptr;
+    dev_cacheAge = nullptr;
+    dev_cacheRecords = nullptr;
+    dev_cacheRecordCount = nullptr;
+    radianceCache = RadianceCache();
 
     checkCUDAError("pathtraceFree");
 }
 
 // Generate PathSegments with rays from the camera through the screen into the 
 // scene, which is the first bounce of rays.
-__global__ void generateRayFromCamera(Camera cam, int iter, int traceDepth, PathSegment* pathSegments)
+// Starts the path of the pixel at the given pixel order index with a camera
+// ray jittered by the random numbers of sample `sample`.
+template <int Features>
+__device__ void generateCameraPath(const Camera& cam, int sample, int index, int traceDepth, PathSegment& path)
 {
-    int x = (blockIdx.x * blockDim.x) + threadIdx.x;
-    int y = (blockIdx.y * blockDim.y) + threadIdx.y;
+    glm::ivec2 pixel = pixelFromIndex(index, cam.resolution);
+    int x = pixel.x;
+    int y = pixel.y;
+
+    thrust::default_random_engine rng = makeSeededRandomEngine(sample, index, 0);
+
+    Ray r;
+    r.origin = cam.position;
 
-    if (x < cam.resolution.x && y < cam.resolution.y) 
+    // stochastic sampled anti-aliasing
+    thrust::uniform_real_distribution<float> offset(-0.5, 0.5);
+    glm::vec2 point(x + offset(rng), y + offset(rng));
+    r.direction = glm::normalize(cam.view
+                                 - cam.right * cam.pixelLength.x * ((float)point.x - (float)cam.resolution.x * 0.5f)
+                                 - cam.up * cam.pixelLength.y * ((float)point.y - (float)cam.resolution.y * 0.5f));
+
+    // depth-of-field
+    if ((Features & FEATURE_DOF) && cam.aperture > 0)
     {
-        int index = x + (y * cam.resolution.x);
+        thrust::uniform_real_distribution<float> u01(0, 1);
 
-        thrust::default_random_engine rng = makeSeededRandomEngine(iter, index, 0);
+        glm::vec3 forward = glm::normalize(cam.lookAt - cam.position);
+        glm::vec3 right = glm::normalize(glm::cross(forward, cam.up));
+        glm::vec3 focalPoint = r.origin + cam.focalDist * r.direction;
 
-        Ray r;
-        r.origin = cam.position;
+        float angle = u01(rng) * 2.f * PI;
+        float radius = cam.aperture * glm::sqrt(u01(rng));
 
-#if (CACHE_FIRST_BOUNCE == 0)
-        // stochastic sampled anti-aliasing
-        thrust::uniform_real_distribution<float> offset(-0.5, 0.5);
-        glm::vec2 point(x + offset(rng), y + offset(rng));
-        r.direction = glm::normalize(cam.view
-                                     - cam.right * cam.pixelLength.x * ((float)point.x - (float)cam.resolution.x * 0.5f)
-                                     - cam.up * cam.pixelLength.y * ((float)point.y - (float)cam.resolution.y * 0.5f));
-#else
-        r.direction = glm::normalize(cam.view
-                                     - cam.right * cam.pixelLength.x * ((float)x - (float)cam.resolution.x * 0.5f)
-                                     - cam.up * cam.pixelLength.y * ((float)y - (float)cam.resolution.y * 0.5f));
-#endif
+        r.origin += radius * (cos(angle) * right + sin(angle) * cam.up);
+        r.direction = glm::normalize(focalPoint - r.origin);
+    }
+
+    path.ray = r;
+    path.color = glm::vec3(1.0f, 1.0f, 1.0f);
+    path.pixelIndex = x + (y * cam.resolution.x);
+    path.remainingBounces = traceDepth;
+    path.bsdfPdf = 0.f;
+    path.causticState = CAUSTIC_BEFORE_GATHER;
+    path.guideRecord = -1;
+    path.cacheRecord = -1;
+    path.cameraSpread = 0.f;
+    path.spread = 0.f;
+}
+
+// If cachedRays is set, the rays of a previously generated pattern are reused
+// instead of sampling new ones.
+template <int Features>
+__global__ void generateRayFromCamera(Camera cam, int iter, int traceDepth, PathSegment* pathSegments,
+                                      const Ray* cachedRays)
+{
+    int index = (blockIdx.x * blockDim.x) + threadIdx.x;
 
-#if (CACHE_FIRST_BOUNCE == 0)
-        // depth-of-field
-        if (cam.aperture > 0)
+    if (index < cam.resolution.x * cam.resolution.y) 
+    {
+        generateCameraPath<Features>(cam, iter, index, traceDepth, pathSegments[index]);
+        if (cachedRays)
         {
-            thrust::uniform_real_distribution<float> u01(0, 1);
+            pathSegments[index].ray = cachedRays[index];
+        }
+    }
+}
+
+// Fills count path slots from firstSlot on with the samples numbered
+// firstSample onwards. Sample s of the iteration covers the pixel at pixel
+// order index s % pixelcount, as its (s / pixelcount)-th sample, so pixels
+// get their samples in the same order as without regeneration.
+template <int Features>
+__global__ void regeneratePaths(Camera cam, int iter, int traceDepth, int firstSlot, int count,
+                                int firstSample, PathSegment* pathSegments)
+{
+    int i = (blockIdx.x * blockDim.x) + threadIdx.x;
+
+    if (i < count)
+    {
+        const int pixelcount = cam.resolution.x * cam.resolution.y;
+        int sample = firstSample + i;
+        int sampleIter = (iter - 1) * SAMPLES_PER_ITERATION + sample / pixelcount + 1;
+        generateCameraPath<Features>(cam, sampleIter, sample % pixelcount, traceDepth, pathSegments[firstSlot + i]);
+    }
+}
+
+// Computes the Morton sort key of each path's ray, to group rays that start
+// close to each other and travel in similar directions.
+__global__ void computeRayKeys(int num_paths, const PathSegment* pathSegments,
+                               glm::vec3 sceneMin, glm::vec3 sceneInvExtent,
+                               int* keys, int* indices)
+{
+    int index = blockIdx.x * blockDim.x + threadIdx.x;
+    if (index < num_paths)
+    {
+        const Ray& r = pathSegments[index].ray;
+        keys[index] = rayMortonKey(r.origin, r.direction, sceneMin, sceneInvExtent);
+        indices[index] = index;
+    }
+}
 
-            glm::vec3 forward = glm::normalize(cam.lookAt - cam.position);
-            glm::vec3 right = glm::normalize(glm::cross(forward, cam.up));
-            glm::vec3 focalPoint = r.origin + cam.focalDist * r.direction;
+__global__ void gatherPaths(int num_paths, const int* indices, const PathSegment* src, PathSegment* dst)
+{
+    int index = blockIdx.x * blockDim.x + threadIdx.x;
+    if (index < num_paths)
+    {
+        dst[index] = src[indices[index]];
+    }
+}
+
+// Sort keys for grouping paths by material: 0 for misses, whose materialId is
+// stale, and materialId + 1 otherwise.
+__global__ void computeMaterialKeys(int num_paths, const ShadeableIntersection* intersections,
+                                    int* keys, int* indices)
+{
+    int index = blockIdx.x * blockDim.x + threadIdx.x;
+    if (index < num_paths)
+    {
+        const ShadeableIntersection& isect = intersections[index];
+        keys[index] = isect.t > 0.f ? isect.materialId + 1 : 0;
+        indices[index] = index;
+    }
+}
 
-            float angle = u01(rng) * 2.f * PI;
-            float radius = cam.aperture * glm::sqrt(u01(rng));
+__global__ void gatherPathsAndIntersections(int num_paths, const int* indices,
+                                            const PathSegment* srcPaths, const ShadeableIntersection* srcIntersections,
+                                            PathSegment* dstPaths, ShadeableIntersection* dstIntersections)
+{
+    int index = blockIdx.x * blockDim.x + threadIdx.x;
+    if (index < num_paths)
+    {
+        dstPaths[index] = srcPaths[indices[index]];
+        dstIntersections[index] = srcIntersections[indices[index]];
+    }
+}
 
-            r.origin += radius * (cos(angle) * right + sin(angle) * cam.up);
-            r.direction = glm::normalize(focalPoint - r.origin);
+// Tests the triangles of a BVH leaf and keeps the closest hit.
+template <int Features>
+struct MeshLeafIntersector
+{
+    const Geom& geom;
+    const DeviceTriangle* tris;
+    const Ray& ray;
+    const Material& mat;
+    const glm::vec3* texData;
+    float& t_min;
+    bool& hit;
+    glm::vec3& intersect_point;
+    glm::vec3& normal;
+    glm::vec2& uv;
+    int& tri;
+
+    __host__ __device__ void operator()(int triBegin, int triCount)
+    {
+        glm::vec3 tmp_intersect;
+        glm::vec3 tmp_normal;
+        glm::vec2 tmp_uv;
+        for (int j = triBegin; j < triBegin + triCount; ++j)
+        {
+            float t = triangleIntersectionTest<Features>(geom, tris[j], ray, mat, texData,
+                                               tmp_intersect, tmp_normal, tmp_uv);
+            if (t > 0.f && t_min > t)
+            {
+                t_min = t;
+                hit = true;
+                intersect_point = tmp_intersect;
+                normal = tmp_normal;
+                uv = tmp_uv;
+                tri = j;
+            }
         }
+    }
+};
+
+// Closest hit of a ray among all geoms; t is -1 if it hits nothing. The
+// traversal's work is counted in stats with RAY_STATS.
+template <int Features>
+__device__ void intersectScene(const Ray& ray,
+                               Geom* geoms, int geoms_size,
+                               DeviceTriangle* tris,
+                               WideBVHNode* bvhNodes,
+                               Material* mats,
+                               glm::vec3* texData,
+                               ShadeableIntersection& intersection,
+                               RayStats& stats)
+{
+    float t;
+    glm::vec3 intersect_point;
+    glm::vec3 normal;
+    glm::vec2 uv;
+    float t_min = FLT_MAX;
+    int hit_geom_index = -1;
+    int hit_tri_index = -1;
+    bool outside = true;
+
+    glm::vec3 tmp_intersect;
+    glm::vec3 tmp_normal;
+
+    // naive parse through global geoms
+
+    for (int i = 0; i < geoms_size; i++)
+    {
+        Geom& geom = geoms[i];
+        if (geom.type == MESH)
+        {
+            if ((Features & FEATURE_MESH) && geom.bvhRootIdx >= 0)
+            {
+                // the BVH is in object space; an untransformed direction keeps t in world units
+                Ray objRay;
+                objRay.origin = multiplyMV(geom.inverseTransform, glm::vec4(ray.origin, 1.0f));
+                objRay.direction = multiplyMV(geom.inverseTransform, glm::vec4(ray.direction, 0.0f));
+
+                bool hit = false;
+                int tri = -1;
+                MeshLeafIntersector<Features> leafFn = { geom, tris, ray, mats[geom.materialid], texData,
+                                               t_min, hit, intersect_point, normal, uv, tri };
+#if RAY_STATS
+                traverseWideBVH(bvhNodes, geom.bvhRootIdx, objRay, t_min, leafFn, stats);
+#else
+                traverseWideBVH(bvhNodes, geom.bvhRootIdx, objRay, t_min, leafFn);
 #endif
+                if (hit)
+                {
+                    hit_geom_index = i;
+                    hit_tri_index = tri;
+                }
+            }
+        }
+        else 
+        {
+            RAY_STAT(stats.count[STAT_PRIMITIVE_TESTS]++);
+            if (geom.type == CUBE)
+            {
+                t = boxIntersectionTest(geom, ray, tmp_intersect, tmp_normal, outside);
+            }
+            else if (geom.type == SPHERE)
+            {
+                t = sphereIntersectionTest(geom, ray, tmp_intersect, tmp_normal, outside);
+            }
+            if (t > 0.0f && t_min > t)
+            {
+                t_min = t;
+                hit_geom_index = i;
+                hit_tri_index = -1;
+                intersect_point = tmp_intersect;
+                normal = tmp_normal;
+            }
+        }
+    }
+
+    if (hit_geom_index == -1)
+    {
+        intersection.t = -1.0f;
+    }
+    else
+    {
+        //The ray hits something
+        intersection.t = t_min;
+        intersection.materialId = geoms[hit_geom_index].materialid;
+        intersection.surfaceNormal = normal;
+        intersection.uv = uv;
+        const Geom& geom = geoms[hit_geom_index];
+        intersection.lightIdx = geom.lightBeginIdx < 0 ? -1
+            : geom.lightBeginIdx + (hit_tri_index >= 0 ? hit_tri_index - geom.triBeginIdx : 0);
+    }
+}
+
+// handles generating ray intersections.
+template <int Features>
+__global__ void computeIntersections(int depth,  
+                                     PathSegment* pathSegments, int num_paths,
+                                     Geom* geoms, int geoms_size,
+                                     DeviceTriangle* tris,
+                                     WideBVHNode* bvhNodes,
+                                     Material* mats,
+                                     glm::vec3* texData,
+                                     ShadeableIntersection* intersections,
+                                     RayStats* pixelStats)
+{
+    int path_index = blockIdx.x * blockDim.x + threadIdx.x;
+
+    if (path_index < num_paths)
+    {
+        PathSegment pathSegment = pathSegments[path_index];
+
+#if (STREAM_COMPACTION == 0)
+        if (pathSegment.remainingBounces <= 0)
+        {
+            intersections[path_index].t = -1.f;
+            return;
+        }
+#endif
+
+        RayStats stats = {};
+        RAY_STAT(stats.count[STAT_BOUNCES] = 1);
+        intersectScene<Features>(pathSegment.ray, geoms, geoms_size, tris, bvhNodes, mats, texData,
+                                 intersections[path_index], stats);
+
+#if RAY_STATS
+        RayStats& pixel = pixelStats[pathSegment.pixelIndex];
+        for (int s = 0; s < NUM_RAY_STATS; ++s)
+        {
+#if PATH_REGENERATION
+            // several samples of a pixel can be in flight
+            atomicAdd(&pixel.count[s], stats.count[s]);
+#else
+            // a pixel has at most one path in flight, so no atomics are needed
+            pixel.count[s] += stats.count[s];
+#endif
+        }
+#endif
+    }
+}
+
+// Adds the radiance of a path that just reached a light to its pixel, and to
+// the even-iteration image if that is passed. Several paths of a pixel can
+// terminate in the same bounce with PATH_REGENERATION, hence atomics; paths
+// that terminate elsewhere carry no radiance and add nothing.
+__device__ inline void accumulateRadiance(glm::vec3* image, glm::vec3* imageEven, int pixelIndex, glm::vec3 radiance)
+{
+    glm::vec3& pixel = image[pixelIndex];
+    atomicAdd(&pixel.x, radiance.x);
+    atomicAdd(&pixel.y, radiance.y);
+    atomicAdd(&pixel.z, radiance.z);
+    if (imageEven)
+    {
+        glm::vec3& pixelEven = imageEven[pixelIndex];
+        atomicAdd(&pixelEven.x, radiance.x);
+        atomicAdd(&pixelEven.y, radiance.y);
+        atomicAdd(&pixelEven.z, radiance.z);
+    }
+}
+
+__device__ inline void accumulateRadiance(glm::vec3* image, glm::vec3* imageEven, const PathSegment& pathSeg)
+{
+    accumulateRadiance(image, imageEven, pathSeg.pixelIndex, pathSeg.color);
+}
+
+// Credits radiance a path found to the directions its recorded diffuse
+// vertices scattered in, from `record` back along the chain. The newest
+// vertex gets headRadiance, which can leave out the MIS weight since that
+// vertex did sample the direction the radiance came from.
+__device__ inline void recordRadiance(const PathGuide& guide, int record, glm::vec3 radiance, glm::vec3 headRadiance)
+{
+    const glm::vec3 luminance(0.2126f, 0.7152f, 0.0722f);
+    glm::vec3 r = headRadiance;
+    while (record >= 0)
+    {
+        const GuideRecord& rec = guide.records[record];
+        // incident radiance over the density of its direction
+        float energy = glm::dot(r / glm::max(rec.weight, glm::vec3(FLT_MIN)), luminance);
+        if (energy > 0.f)
+        {
+            atomicAdd(&guide.recordingNodes[rec.node].sum[rec.quadrant], energy);
+        }
+        record = rec.prev;
+        r = radiance;
+    }
+}
+
+// Adds radiance a path found to the outgoing radiance of the cache entries of
+// its recorded diffuse vertices, from `record` back along the chain.
+__device__ inline void cacheRadiance(const RadianceCache& cache, int record, glm::vec3 radiance)
+{
+    while (record >= 0)
+    {
+        const CacheRecord& rec = cache.records[record];
+        glm::vec3 r = radiance / glm::max(rec.weight, glm::vec3(FLT_MIN));
+        glm::vec4& accum = cache.accum[rec.entry];
+        atomicAdd(&accum.x, r.x);
+        atomicAdd(&accum.y, r.y);
+        atomicAdd(&accum.z, r.z);
+        record = rec.prev;
+    }
+}
+
+// Hands radiance a path found, as it adds it to its pixel, to what learns from
+// it: the path guide, whose newest vertex gets guideHeadRadiance (see
+// recordRadiance), and the radiance cache.
+__device__ inline void creditRadiance(const LightSampling& lighting, int guideRecord, int cacheRecord,
+                                      glm::vec3 radiance, glm::vec3 guideHeadRadiance)
+{
+    recordRadiance(lighting.guide, guideRecord, radiance, guideHeadRadiance);
+    cacheRadiance(lighting.cache, cacheRecord, radiance);
+}
+
+// Terminates a path whose ray left the scene. With an environment, the path
+// picks up its radiance; after a diffuse bounce that radiance is MIS-weighted
+// against the environment sample taken at the same vertex.
+__device__ inline void shadeMiss(PathSegment& pathSeg, const LightSampling& lighting,
+                                 glm::vec3* image, glm::vec3* imageEven)
+{
+    const EnvironmentMap& env = lighting.env;
+    pathSeg.remainingBounces = 0;
+    if (env.width == 0)
+    {
+        pathSeg.color = glm::vec3(0.f);
+        return;
+    }
+    glm::vec3 dir = pathSeg.ray.direction;
+    float weight = pathSeg.bsdfPdf > 0.f ? powerHeuristic(pathSeg.bsdfPdf, environmentPdf(env, dir)) : 1.f;
+    glm::vec3 radiance = pathSeg.color * environmentRadiance(env, dir);
+    pathSeg.color = radiance * weight;
+    accumulateRadiance(image, imageEven, pathSeg);
+    creditRadiance(lighting, pathSeg.guideRecord, pathSeg.cacheRecord, pathSeg.color, radiance);
+}
+
+// Density with which a diffuse vertex scatters into dir: cosine sampling, or
+// with path guiding in spatial leaf `leaf` (-1 without), the mixture of it
+// and the leaf's learned distribution.
+__device__ inline float scatterPdf(const PathGuide& guide, int leaf, glm::vec3 dir, glm::vec3 normal)
+{
+    float cosinePdf = glm::max(glm::dot(dir, normal), 0.f) / PI;
+#if PATH_GUIDING
+    if (leaf >= 0 && guide.spatial[leaf].samplingRoot >= 0)
+    {
+        return PATH_GUIDING_FRACTION * guidePdf(guide.samplingNodes, guide.spatial[leaf].samplingRoot, dir)
+               + (1.f - PATH_GUIDING_FRACTION) * cosinePdf;
+    }
+#endif
+    return cosinePdf;
+}
+
+// Samples the environment from a diffuse vertex the path has just scattered
+// off, in spatial leaf `leaf` of the path guide, and stores the shadow ray in
+// shadowRay; the slot stays empty if the direction is below the surface.
+// pathSeg.color already holds the throughput times the albedo, i.e. the
+// Lambertian BSDF times pi.
+__device__ inline void sampleEnvironmentLight(const LightSampling& lighting, const PathSegment& pathSeg,
+                                              glm::vec3 normal, int leaf, thrust::default_random_engine& rng,
+                                              ShadowRay& shadowRay)
+{
+    const EnvironmentMap& env = lighting.env;
+    float envPdf;
+    glm::vec3 dir = sampleEnvironment(env, rng, envPdf);
+    float cosTheta = glm::dot(dir, normal);
+    if (envPdf <= 0.f || cosTheta <= 0.f)
+    {
+        return;
+    }
+    float bsdfPdf = scatterPdf(lighting.guide, leaf, dir, normal);
+    shadowRay.ray.origin = pathSeg.ray.origin;
+    shadowRay.ray.direction = dir;
+    shadowRay.tMax = FLT_MAX;
+    shadowRay.radiance = pathSeg.color * environmentRadiance(env, dir)
+                         * (cosTheta / PI / envPdf * powerHeuristic(envPdf, bsdfPdf));
+    shadowRay.pixelIndex = pathSeg.pixelIndex;
+    shadowRay.guideRecord = pathSeg.guideRecord;
+    shadowRay.cacheRecord = pathSeg.cacheRecord;
+}
+
+// Samples an emitter from a diffuse vertex the path has just scattered off:
+// a light picked through the light BVH, then a point on it. Weighted against
+// the BSDF like sampleEnvironmentLight.
+__device__ inline void sampleEmitter(const LightSampling& lighting, const PathSegment& pathSeg, glm::vec3 normal,
+                                     int leaf, const Material* materials, thrust::default_random_engine& rng,
+                                     ShadowRay& shadowRay)
+{
+    thrust::uniform_real_distribution<float> u01(0, 1);
+    glm::vec3 origin = pathSeg.ray.origin;
+    float pmf;
+    int lightIdx = pickLight(lighting.lights, origin, u01(rng), pmf);
+    if (lightIdx < 0)
+    {
+        return;
+    }
+    const Light& light = lighting.lights.lights[lightIdx];
+    glm::vec3 lightNormal;
+    float areaPdf;
+    glm::vec3 toLight = sampleLightPoint(light, lighting.geoms, lighting.tris, rng, lightNormal, areaPdf) - origin;
+    float dist2 = glm::dot(toLight, toLight);
+    if (dist2 <= 0.f)
+    {
+        return;
+    }
+    float dist = sqrtf(dist2);
+    glm::vec3 dir = toLight / dist;
+    float cosTheta = glm::dot(dir, normal);
+    float cosLight = fabsf(glm::dot(dir, lightNormal));
+    if (cosTheta <= 0.f || cosLight <= 0.f)
+    {
+        return;
+    }
+    float lightPdf = pmf * areaPdf * dist2 / cosLight;
+    float bsdfPdf = scatterPdf(lighting.guide, leaf, dir, normal);
+    const Material& mat = materials[lighting.geoms[light.geom].materialid];
+    shadowRay.ray.origin = origin;
+    shadowRay.ray.direction = dir;
+    // stop short of the light itself
+    shadowRay.tMax = dist * (1.f - SHADOW_RAY_EPSILON);
+    shadowRay.radiance = pathSeg.color * mat.color * mat.emittance
+                         * (cosTheta / PI / lightPdf * powerHeuristic(lightPdf, bsdfPdf));
+    shadowRay.pixelIndex = pathSeg.pixelIndex;
+    shadowRay.guideRecord = pathSeg.guideRecord;
+    shadowRay.cacheRecord = pathSeg.cacheRecord;
+}
+
+// Takes one sample of each kind of light from a diffuse vertex in spatial
+// leaf `leaf` of the path guide.
+__device__ inline void sampleLights(const LightSampling& lighting, const PathSegment& pathSeg, glm::vec3 normal,
+                                    int leaf, const Material* materials, thrust::default_random_engine& rng, int idx)
+{
+    ShadowRay* slots = lighting.shadowRays + idx * NUM_SHADOW_RAYS;
+    if (lighting.env.width > 0)
+    {
+        sampleEnvironmentLight(lighting, pathSeg, normal, leaf, rng, slots[SHADOW_RAY_ENVIRONMENT]);
+    }
+    if (lighting.lights.numLights > 0)
+    {
+        sampleEmitter(lighting, pathSeg, normal, leaf, materials, rng, slots[SHADOW_RAY_EMITTER]);
+    }
+}
+
+// MIS weight of the emission a path sees on hitting a light. After a diffuse
+// bounce, sampleEmitter could have picked the same point from the previous
+// vertex, the ray's origin. Emission the caustic photons already carry gets
+// no weight.
+__device__ inline float emissionWeight(const LightSampling& lighting, const PathSegment& pathSeg,
+                                       const ShadeableIntersection& intersection)
+{
+    if (lighting.caustics.tableSize > 0 && pathSeg.causticState == CAUSTIC_SPECULAR_CHAIN)
+    {
+        return 0.f;
+    }
+    if (pathSeg.bsdfPdf <= 0.f || intersection.lightIdx < 0 || lighting.lights.numLights == 0)
+    {
+        return 1.f;
+    }
+    const Ray& ray = pathSeg.ray;
+    glm::vec3 lightNormal;
+    float areaPdf = lightPointPdf(lighting.lights.lights[intersection.lightIdx], lighting.geoms, lighting.tris,
+                                  ray.origin + intersection.t * ray.direction, lightNormal);
+    float cosLight = fabsf(glm::dot(ray.direction, lightNormal));
+    if (cosLight <= 0.f)
+    {
+        return 1.f;
+    }
+    float lightPdf = pickLightPmf(lighting.lights, ray.origin, intersection.lightIdx) * areaPdf
+                     * intersection.t * intersection.t / cosLight;
+    return powerHeuristic(pathSeg.bsdfPdf, lightPdf);
+}
+
+// Terminates a path that hit a light, adding its MIS-weighted emission.
+__device__ inline void shadeEmission(PathSegment& pathSeg, const LightSampling& lighting, const Material& mat,
+                                     const ShadeableIntersection& intersection,
+                                     glm::vec3* image, glm::vec3* imageEven)
+{
+    pathSeg.remainingBounces = 0;
+    float weight = emissionWeight(lighting, pathSeg, intersection);
+    glm::vec3 radiance = pathSeg.color * mat.color * mat.emittance;
+    pathSeg.color = radiance * weight;
+    accumulateRadiance(image, imageEven, pathSeg);
+    // emission the photons carry isn't learned either
+    creditRadiance(lighting, pathSeg.guideRecord, pathSeg.cacheRecord, pathSeg.color,
+                   weight > 0.f ? radiance : pathSeg.color);
+}
+
+// With a photon map, adds the caustics landing on the path's first diffuse
+// vertex, and tracks the bounces after it; see CausticState. Called once the
+// path has scattered, so its color already carries the vertex's albedo.
+__device__ inline void followCaustics(const LightSampling& lighting, PathSegment& pathSeg, glm::vec3 normal,
+                                      glm::vec3* image, glm::vec3* imageEven)
+{
+    if (lighting.caustics.tableSize == 0)
+    {
+        return;
+    }
+    bool diffuse = pathSeg.bsdfPdf > 0.f;
+    switch (pathSeg.causticState)
+    {
+    case CAUSTIC_BEFORE_GATHER:
+        if (diffuse)
+        {
+            // a Lambertian surface reflects albedo / pi of its irradiance
+            glm::vec3 irradiance = causticIrradiance(lighting.caustics, pathSeg.ray.origin, normal);
+            glm::vec3 radiance = pathSeg.color * irradiance / PI;
+            accumulateRadiance(image, imageEven, pathSeg.pixelIndex, radiance);
+            // no vertex before the first diffuse one to guide
+            cacheRadiance(lighting.cache, pathSeg.cacheRecord, radiance);
+            pathSeg.causticState = CAUSTIC_GATHERED;
+        }
+        break;
+    case CAUSTIC_GATHERED:
+        pathSeg.causticState = diffuse ? CAUSTIC_PAST : CAUSTIC_SPECULAR_CHAIN;
+        break;
+    case CAUSTIC_SPECULAR_CHAIN:
+        if (diffuse)
+        {
+            pathSeg.causticState = CAUSTIC_PAST;
+        }
+        break;
+    }
+}
+
+#if PATH_GUIDING
+// Resamples the direction a path scattered in at a diffuse vertex in spatial
+// leaf `leaf` from the mixture of the leaf's learned distribution and the
+// cosine-weighted one, and records the vertex. Called after the cosine-weighted
+// scatter, so pathSeg.color holds the throughput times the albedo.
+__device__ inline void guideScatter(const PathGuide& guide, int leaf, PathSegment& pathSeg, glm::vec3 normal,
+                                    thrust::default_random_engine& rng)
+{
+    const GuideSpatialNode& node = guide.spatial[leaf];
+    thrust::uniform_real_distribution<float> u01(0, 1);
+    if (node.samplingRoot >= 0 && u01(rng) < PATH_GUIDING_FRACTION)
+    {
+        pathSeg.ray.direction = sampleGuideDirection(guide.samplingNodes, node.samplingRoot, rng);
+    }
+    glm::vec3 dir = pathSeg.ray.direction;
+    float cosTheta = glm::dot(dir, normal);
+    float pdf = scatterPdf(guide, leaf, dir, normal);
+    if (cosTheta <= 0.f || pdf <= 0.f)
+    {
+        pathSeg.color = glm::vec3(0.f);
+        pathSeg.remainingBounces = 0;
+        return;
+    }
+    pathSeg.color *= cosTheta / PI / pdf;
+    pathSeg.bsdfPdf = pdf;
+
+    atomicAdd(&guide.sampleCounts[leaf], 1u);
+    int record = atomicAdd(guide.recordCount, 1);
+    if (record < guide.recordCapacity)
+    {
+        GuideRecord& rec = guide.records[record];
+        rec.node = guideLeafNode(guide.recordingNodes, node.recordingRoot, dir, rec.quadrant);
+        rec.weight = pathSeg.color * pdf;
+        rec.prev = pathSeg.guideRecord;
+        pathSeg.guideRecord = record;
+    }
+}
+#endif
+
+// Everything after the BSDF has scattered a path: light sampling and path
+// guiding at diffuse vertices, and the caustics.
+__device__ inline void finishScatter(const LightSampling& lighting, PathSegment& pathSeg, glm::vec3 normal,
+                                     bool diffuse, const Material* materials, thrust::default_random_engine& rng,
+                                     int idx, glm::vec3* image, glm::vec3* imageEven)
+{
+    int leaf = -1;
+#if PATH_GUIDING
+    if (diffuse && lighting.guide.spatial)
+    {
+        leaf = guideSpatialLeaf(lighting.guide, pathSeg.ray.origin);
+    }
+#endif
+    if (diffuse && lighting.shadowRays)
+    {
+        sampleLights(lighting, pathSeg, normal, leaf, materials, rng, idx);
+    }
+    followCaustics(lighting, pathSeg, normal, image, imageEven);
+#if PATH_GUIDING
+    if (leaf >= 0)
+    {
+        guideScatter(lighting.guide, leaf, pathSeg, normal, rng);
+    }
+#endif
+}
+
+// With the radiance cache, called on every hit a path will scatter from:
+// widens the path's spread by the bounce that led here, then at a diffuse
+// vertex either ends the path on the cached radiance, once it has spread far
+// enough and the cell has an estimate, or records the vertex so the cache
+// learns from the rest of the path. Returns whether the path ended.
+__device__ inline bool followRadianceCache(const LightSampling& lighting, PathSegment& pathSeg,
+                                           const ShadeableIntersection& intersection, bool diffuse,
+                                           glm::vec3* image, glm::vec3* imageEven)
+{
+#if RADIANCE_CACHE
+    const RadianceCache& cache = lighting.cache;
+    if (cache.size == 0)
+    {
+        return false;
+    }
+    float cosTheta = glm::max(fabsf(glm::dot(pathSeg.ray.direction, intersection.surfaceNormal)), 1e-4f);
+    if (pathSeg.cameraSpread == 0.f)
+    {
+        pathSeg.cameraSpread = intersection.t / sqrtf(4.f * PI * cosTheta);
+    }
+    else if (pathSeg.bsdfPdf > 0.f)
+    {
+        // specular bounces don't widen it
+        pathSeg.spread += intersection.t / sqrtf(pathSeg.bsdfPdf * cosTheta);
+    }
+    if (!diffuse)
+    {
+        return false;
+    }
+
+    unsigned long long key = radianceCacheKey(cache, getPointOnRay(pathSeg.ray, intersection.t),
+                                              intersection.surfaceNormal);
+    if (pathSeg.spread * pathSeg.spread > RADIANCE_CACHE_SPREAD * pathSeg.cameraSpread * pathSeg.cameraSpread)
+    {
+        int entry = findRadianceCacheEntry(cache, key);
+        if (entry >= 0 && cache.resolved[entry].w > 0.f)
+        {
+            cache.age[entry] = 0;
+            pathSeg.color *= glm::vec3(cache.resolved[entry]);
+            pathSeg.remainingBounces = 0;
+            accumulateRadiance(image, imageEven, pathSeg);
+            creditRadiance(lighting, pathSeg.guideRecord, pathSeg.cacheRecord, pathSeg.color, pathSeg.color);
+            return true;
+        }
+    }
+
+    int entry = insertRadianceCacheEntry(cache, key);
+    if (entry >= 0)
+    {
+        int record = atomicAdd(cache.recordCount, 1);
+        if (record < cache.recordCapacity)
+        {
+            atomicAdd(&cache.accum[entry].w, 1.f);
+            CacheRecord& rec = cache.records[record];
+            rec.entry = entry;
+            rec.weight = pathSeg.color;
+            rec.prev = pathSeg.cacheRecord;
+            pathSeg.cacheRecord = record;
+        }
+    }
+#endif
+    return false;
+}
+
+// Tests the triangles of a BVH leaf until one blocks the ray before
+// `limit`; then lowers tMax below every node so the traversal ends.
+struct MeshLeafOcclusion
+{
+    const Geom& geom;
+    const DeviceTriangle* tris;
+    const Ray& ray;
+    const Material& mat;
+    const glm::vec3* texData;
+    float limit;
+    float& tMax;
+    bool& occluded;
+
+    __host__ __device__ void operator()(int triBegin, int triCount)
+    {
+        glm::vec3 tmp_intersect;
+        glm::vec3 tmp_normal;
+        glm::vec2 tmp_uv;
+        for (int j = triBegin; j < triBegin + triCount && !occluded; ++j)
+        {
+            // only the distance matters, so no normal mapping
+            float t = triangleIntersectionTest<0>(geom, tris[j], ray, mat, texData, tmp_intersect, tmp_normal, tmp_uv);
+            if (t > 0.f && t < limit)
+            {
+                occluded = true;
+                tMax = -1.f;
+            }
+        }
+    }
+};
+
+// Whether anything in the scene blocks a ray before distance tMax.
+template <int Features>
+__device__ bool isOccluded(const Ray& ray, float tMax, const Geom* geoms, int geoms_size, const DeviceTriangle* tris,
+                           const WideBVHNode* bvhNodes, const Material* mats, const glm::vec3* texData)
+{
+    glm::vec3 tmp_intersect;
+    glm::vec3 tmp_normal;
+    bool outside;
+    for (int i = 0; i < geoms_size; i++)
+    {
+        const Geom& geom = geoms[i];
+        if (geom.type == MESH)
+        {
+            if ((Features & FEATURE_MESH) && geom.bvhRootIdx >= 0)
+            {
+                Ray objRay;
+                objRay.origin = multiplyMV(geom.inverseTransform, glm::vec4(ray.origin, 1.0f));
+                objRay.direction = multiplyMV(geom.inverseTransform, glm::vec4(ray.direction, 0.0f));
+
+                float tLeaf = tMax;
+                bool occluded = false;
+                MeshLeafOcclusion leafFn = { geom, tris, ray, mats[geom.materialid], texData, tMax, tLeaf, occluded };
+                traverseWideBVH(bvhNodes, geom.bvhRootIdx, objRay, tLeaf, leafFn);
+                if (occluded)
+                {
+                    return true;
+                }
+            }
+        }
+        else
+        {
+            float t = geom.type == CUBE ? boxIntersectionTest(geom, ray, tmp_intersect, tmp_normal, outside)
+                                        : sphereIntersectionTest(geom, ray, tmp_intersect, tmp_normal, outside);
+            if (t > 0.f && t < tMax)
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Adds the radiance of the light samples whose shadow rays get through;
+// there are num_slots of them, NUM_SHADOW_RAYS per path.
+template <int Features>
+__global__ void traceShadowRays(int num_slots,
+                                const ShadowRay* shadowRays,
+                                Geom* geoms, int geoms_size,
+                                DeviceTriangle* tris,
+                                WideBVHNode* bvhNodes,
+                                Material* mats,
+                                glm::vec3* texData,
+                                glm::vec3* image,
+                                glm::vec3* imageEven,
+                                LightSampling lighting)
+{
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx >= num_slots)
+    {
+        return;
+    }
+
+    const ShadowRay& shadowRay = shadowRays[idx];
+    if (shadowRay.radiance == glm::vec3(0.f))
+    {
+        return;
+    }
+    if (!isOccluded<Features>(shadowRay.ray, shadowRay.tMax, geoms, geoms_size, tris, bvhNodes, mats, texData))
+    {
+        accumulateRadiance(image, imageEven, shadowRay.pixelIndex, shadowRay.radiance);
+        creditRadiance(lighting, shadowRay.guideRecord, shadowRay.cacheRecord, shadowRay.radiance, shadowRay.radiance);
+    }
+}
+
+// processes rays based on intersections. 
+// For non-terminating rays calls scatterRay for scattering and shading.
+// Paths that hit a light add their radiance to image (and imageEven, if set).
+template <int Features>
+__global__ void shadeBSDF(int iter,
+                          int depth,
+                          int num_paths,
+                          ShadeableIntersection* shadeableIntersections,
+                          PathSegment* pathSegments,
+                          Material* materials,
+                          glm::vec3* dev_texData,
+                          glm::vec3* image,
+                          glm::vec3* imageEven,
+                          LightSampling lighting,
+                          RayStats* pixelStats) 
+{
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx >= num_paths) return;
+
+    PathSegment& pathSeg = pathSegments[idx];
+    RAY_STAT(atomicAdd(&pixelStats[pathSeg.pixelIndex].count[STAT_SHADING_CALLS], 1u));
+    ShadeableIntersection& intersection = shadeableIntersections[idx];
+
+    if (intersection.t > 0.f) 
+    {
+        Material mat = materials[intersection.materialId];
+        if (mat.emittance > 0.f) 
+        {
+            shadeEmission(pathSeg, lighting, mat, intersection, image, imageEven);
+        }
+        else 
+        {
+            int bounces = --pathSeg.remainingBounces;
+            if (bounces > 0) 
+            {
+                int type = bsdfType(mat);
+                if (followRadianceCache(lighting, pathSeg, intersection,
+                                        type == BSDF_DIFFUSE || type == BSDF_DIFFUSE_TEXTURED, image, imageEven))
+                {
+                    return;
+                }
+                thrust::default_random_engine rng = makeSeededRandomEngine(iter, idx, depth);
+                scatterRay<Features>(pathSeg, 
+                           getPointOnRay(pathSeg.ray, intersection.t), 
+                           intersection.surfaceNormal, 
+                           intersection.uv,
+                           mat, 
+                           dev_texData,
+                           rng);
+                finishScatter(lighting, pathSeg, intersection.surfaceNormal, pathSeg.bsdfPdf > 0.f,
+                              materials, rng, idx, image, imageEven);
+            }
+            else 
+            {
+                pathSeg.color = glm::vec3(0.f);
+            }
+        }
+    }
+    else 
+    {
+#if (STREAM_COMPACTION == 0)
+        if (pathSeg.remainingBounces > 0) 
+        {
+            shadeMiss(pathSeg, lighting, image, imageEven);
+        }
+#else
+        shadeMiss(pathSeg, lighting, image, imageEven);
+#endif
+    }
+}
+
+// Appends each path's index to the shading queue of the BSDF it hit, or to the
+// miss queue. Queue q starts at queues + q * queueStride. Slots are reserved
+// per block first, so each block does one global atomic per queue.
+__global__ void classifyPaths(int num_paths,
+                              const ShadeableIntersection* shadeableIntersections,
+                              const Material* materials,
+                              int* queueCounts,
+                              int* queues,
+                              int queueStride)
+{
+    __shared__ int blockCounts[NUM_SHADE_QUEUES];
+    __shared__ int blockBase[NUM_SHADE_QUEUES];
+
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (threadIdx.x < NUM_SHADE_QUEUES)
+    {
+        blockCounts[threadIdx.x] = 0;
+    }
+    __syncthreads();
+
+    int queue = -1;
+    int slot = 0;
+    if (idx < num_paths)
+    {
+        const ShadeableIntersection& intersection = shadeableIntersections[idx];
+        queue = intersection.t > 0.f ? bsdfType(materials[intersection.materialId]) : SHADE_QUEUE_MISS;
+        slot = atomicAdd(&blockCounts[queue], 1);
+    }
+    __syncthreads();
+
+    if (threadIdx.x < NUM_SHADE_QUEUES)
+    {
+        blockBase[threadIdx.x] = atomicAdd(&queueCounts[threadIdx.x], blockCounts[threadIdx.x]);
+    }
+    __syncthreads();
+
+    if (queue >= 0)
+    {
+        queues[queue * queueStride + blockBase[queue] + slot] = idx;
+    }
+}
+
+// Shades the paths in one queue. Same as shadeBSDF, for paths that all hit a
+// BSDF of type Queue (or missed, for SHADE_QUEUE_MISS).
+template <int Queue>
+__global__ void shadeQueue(int iter,
+                           int depth,
+                           int count,
+                           const int* queue,
+                           ShadeableIntersection* shadeableIntersections,
+                           PathSegment* pathSegments,
+                           Material* materials,
+                           glm::vec3* dev_texData,
+                           glm::vec3* image,
+                           glm::vec3* imageEven,
+                           LightSampling lighting,
+                           RayStats* pixelStats)
+{
+    int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= count) return;
+
+    int idx = queue[i];
+    PathSegment& pathSeg = pathSegments[idx];
+    RAY_STAT(atomicAdd(&pixelStats[pathSeg.pixelIndex].count[STAT_SHADING_CALLS], 1u));
+
+    if (Queue == SHADE_QUEUE_MISS)
+    {
+#if (STREAM_COMPACTION == 0)
+        if (pathSeg.remainingBounces > 0)
+        {
+            shadeMiss(pathSeg, lighting, image, imageEven);
+        }
+#else
+        shadeMiss(pathSeg, lighting, image, imageEven);
+#endif
+        return;
+    }
+
+    ShadeableIntersection& intersection = shadeableIntersections[idx];
+    Material mat = materials[intersection.materialId];
+    if (Queue == BSDF_EMISSIVE)
+    {
+        shadeEmission(pathSeg, lighting, mat, intersection, image, imageEven);
+        return;
+    }
+
+    int bounces = --pathSeg.remainingBounces;
+    if (bounces > 0)
+    {
+        if (followRadianceCache(lighting, pathSeg, intersection,
+                                Queue == BSDF_DIFFUSE || Queue == BSDF_DIFFUSE_TEXTURED, image, imageEven))
+        {
+            return;
+        }
+        thrust::default_random_engine rng = makeSeededRandomEngine(iter, idx, depth);
+        scatterBSDF<Queue>(pathSeg,
+                           getPointOnRay(pathSeg.ray, intersection.t),
+                           intersection.surfaceNormal,
+                           intersection.uv,
+                           mat,
+                           dev_texData,
+                           rng);
+        finishScatter(lighting, pathSeg, intersection.surfaceNormal,
+                      Queue == BSDF_DIFFUSE || Queue == BSDF_DIFFUSE_TEXTURED, materials, rng, idx, image, imageEven);
+    }
+    else
+    {
+        pathSeg.color = glm::vec3(0.f);
+    }
+}
+
+#if CAUSTIC_PHOTONS
+// Starts a photon on a light picked by power, from a point sampled on it into
+// the cosine-weighted hemisphere of one of its faces. Its color is its share
+// of the flux of numPhotons photons.
+__device__ void emitPhoton(const LightSampling& lighting, const AliasEntry* lightAlias, const Material* mats,
+                           int numPhotons, thrust::default_random_engine& rng, PathSegment& photon)
+{
+    thrust::uniform_real_distribution<float> u01(0, 1);
+    const int numLights = lighting.lights.numLights;
+    int cell = glm::min((int)(u01(rng) * numLights), numLights - 1);
+    int lightIdx = u01(rng) < lightAlias[cell].prob ? cell : lightAlias[cell].alias;
+    const Light& light = lighting.lights.lights[lightIdx];
+
+    glm::vec3 normal;
+    float areaPdf;
+    glm::vec3 p = sampleLightPoint(light, lighting.geoms, lighting.tris, rng, normal, areaPdf);
+    // triangles emit from both faces
+    float numFaces = 1.f;
+    if (light.tri >= 0)
+    {
+        numFaces = 2.f;
+        normal = u01(rng) < .5f ? normal : -normal;
+    }
+
+    const Material& mat = mats[lighting.geoms[light.geom].materialid];
+    photon.ray.origin = p + .0001f * normal;
+    photon.ray.direction = calculateRandomDirectionInHemisphere(normal, rng);
+    // radiance times cosine over the density of light, point, face and
+    // direction; the cosines cancel
+    photon.color = mat.color * mat.emittance * (PI * numFaces / (lightAlias[lightIdx].pdf * areaPdf * numPhotons));
+    photon.bsdfPdf = 0.f;
+}
+
+// Traces one photon per thread through specular bounces. Those that then
+// land on a diffuse surface are appended to photons; the others are dropped.
+template <int Features>
+__global__ void tracePhotons(int iter, int numPhotons, int traceDepth,
+                             LightSampling lighting, const AliasEntry* lightAlias,
+                             Geom* geoms, int geoms_size,
+                             DeviceTriangle* tris,
+                             WideBVHNode* bvhNodes,
+                             Material* mats,
+                             glm::vec3* texData,
+                             Photon* photons,
+                             int* photonCount)
+{
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx >= numPhotons)
+    {
+        return;
+    }
+
+    thrust::default_random_engine rng = makeSeededRandomEngine(iter, idx, CAUSTIC_PHOTON_SEED_DEPTH);
+    PathSegment photon;
+    emitPhoton(lighting, lightAlias, mats, numPhotons, rng, photon);
+
+    bool specular = false;
+    for (int bounce = 0; bounce < traceDepth; ++bounce)
+    {
+        ShadeableIntersection hit;
+        RayStats stats = {};
+        intersectScene<Features>(photon.ray, geoms, geoms_size, tris, bvhNodes, mats, texData, hit, stats);
+        if (hit.t <= 0.f)
+        {
+            return;
+        }
+        const Material& mat = mats[hit.materialId];
+        int type = bsdfType(mat);
+        glm::vec3 p = getPointOnRay(photon.ray, hit.t);
+        if (type == BSDF_DIFFUSE || type == BSDF_DIFFUSE_TEXTURED)
+        {
+            if (specular)
+            {
+                photons[atomicAdd(photonCount, 1)] = { p, photon.color, photon.ray.direction };
+            }
+            return;
+        }
+        if (type == BSDF_EMISSIVE)
+        {
+            return;
+        }
+        scatterRay<Features>(photon, p, hit.surfaceNormal, hit.uv, mat, texData, rng);
+        specular = true;
+    }
+}
+
+__global__ void computePhotonKeys(int numPhotons, const Photon* photons, PhotonMap map, int* keys, int* indices)
+{
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx < numPhotons)
+    {
+        keys[idx] = photonCellHash(photonCell(map, photons[idx].position), map.tableSize);
+        indices[idx] = idx;
+    }
+}
+
+__global__ void gatherPhotons(int numPhotons, const int* indices, const Photon* src, Photon* dst)
+{
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx < numPhotons)
+    {
+        dst[idx] = src[indices[idx]];
+    }
+}
+
+// Marks where each hash's run starts and ends in the sorted keys.
+__global__ void findPhotonCells(int numPhotons, const int* keys, int* cellStart, int* cellEnd)
+{
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx >= numPhotons)
+    {
+        return;
+    }
+    int key = keys[idx];
+    if (idx == 0 || keys[idx - 1] != key)
+    {
+        cellStart[key] = idx;
+    }
+    if (idx == numPhotons - 1 || keys[idx + 1] != key)
+    {
+        cellEnd[key] = idx + 1;
+    }
+}
+#endif
+
+#if RADIANCE_CACHE
+// Folds what each cache entry learned this iteration into its estimate, and
+// ages and evicts the entries nobody touched.
+__global__ void resolveRadianceCache(RadianceCache cache)
+{
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx >= cache.size || cache.keys[idx] == 0ull)
+    {
+        return;
+    }
+
+    glm::vec4 accum = cache.accum[idx];
+    if (accum.w > 0.f)
+    {
+        // older samples count for less once there are enough
+        glm::vec4 resolved = cache.resolved[idx];
+        float samples = glm::max(glm::min(resolved.w, RADIANCE_CACHE_MAX_SAMPLES - accum.w), 0.f);
+        glm::vec3 radiance = (glm::vec3(resolved) * samples + glm::vec3(accum)) / (samples + accum.w);
+        cache.resolved[idx] = glm::vec4(radiance, samples + accum.w);
+        cache.accum[idx] = glm::vec4(0.f);
+        cache.age[idx] = 0;
+    }
+    else if (++cache.age[idx] > RADIANCE_CACHE_MAX_AGE)
+    {
+        cache.keys[idx] = 0ull;
+        cache.resolved[idx] = glm::vec4(0.f);
+        cache.age[idx] = 0;
+    }
+}
+#endif
+
+// Squared luminance difference between the mean of the even iterations and
+// the mean of all of them, and the luminance of the latter.
+__global__ void computeErrorTerms(int pixelcount, int iter, const glm::vec3* image,
+                                  const glm::vec3* imageEven, glm::vec2* terms)
+{
+    int index = (blockIdx.x * blockDim.x) + threadIdx.x;
 
-        pathSegments[index].ray = r;
-        pathSegments[index].color = glm::vec3(1.0f, 1.0f, 1.0f);
-        pathSegments[index].pixelIndex = index;
-        pathSegments[index].remainingBounces = traceDepth;
+    if (index < pixelcount)
+    {
+        const glm::vec3 luminance(0.2126f, 0.7152f, 0.0722f);
+        float all = glm::dot(image[index], luminance) / (iter * SAMPLES_PER_ITERATION);
+        float even = glm::dot(imageEven[index], luminance) / (iter / 2 * SAMPLES_PER_ITERATION);
+        terms[index] = glm::vec2((even - all) * (even - all), all);
     }
 }
 
-// handles generating ray intersections.
-__global__ void computeIntersections(int depth,  
-                                     PathSegment* pathSegments, int num_paths,
-                                     Geom* geoms, int geoms_size,
-                                     Triangle* tris,
-                                     Material* mats,
-                                     glm::vec3* texData,
-                                     ShadeableIntersection* intersections)
+#if TEMPORAL_REPROJECTION
+__global__ void recordFirstHits(int nPaths, const PathSegment* paths,
+                                const ShadeableIntersection* intersections, FirstHit* firstHits)
 {
-    int path_index = blockIdx.x * blockDim.x + threadIdx.x;
+    int index = (blockIdx.x * blockDim.x) + threadIdx.x;
 
-    if (path_index < num_paths)
+    if (index < nPaths)
     {
-        PathSegment pathSegment = pathSegments[path_index];
-
-#if (STREAM_COMPACTION == 0)
-        if (pathSegment.remainingBounces <= 0)
-        {
-            intersections[path_index].t = -1.f;
-            return;
-        }
-#endif
+        const Ray& ray = paths[index].ray;
+        const ShadeableIntersection& isect = intersections[index];
+        FirstHit& firstHit = firstHits[paths[index].pixelIndex];
+        firstHit.hit = isect.t > 0.f;
+        firstHit.position = ray.origin + isect.t * ray.direction;
+        firstHit.normal = isect.surfaceNormal;
+    }
+}
 
-        float t;
-        glm::vec3 intersect_point;
-        glm::vec3 normal;
-        glm::vec2 uv;
-        float t_min = FLT_MAX;
-        int hit_geom_index = -1;
-        bool outside = true;
+// Mean radiance of the accumulation so far, history included, and the number
+// of samples it counts as when reprojected.
+__global__ void resolveEstimate(int pixelcount, int numSamples, const glm::vec3* image,
+                                const glm::vec4* history, glm::vec4* estimate)
+{
+    int index = (blockIdx.x * blockDim.x) + threadIdx.x;
 
-        glm::vec3 tmp_intersect;
-        glm::vec3 tmp_normal;
-        glm::vec2 tmp_uv;
+    if (index < pixelcount)
+    {
+        glm::vec4 h = history[index];
+        float samples = numSamples + h.w;
+        glm::vec3 mean = (image[index] + glm::vec3(h) * h.w) / samples;
+        estimate[index] = glm::vec4(mean, glm::min(samples, (float)TEMPORAL_HISTORY_SAMPLES));
+    }
+}
 
-        // naive parse through global geoms
+// Looks up each pixel's first hit in the previous camera's image, bilinearly
+// over the four nearest pixels that saw the same surface.
+__global__ void reprojectHistory(glm::ivec2 resolution, Camera prevCam, glm::mat3 prevInvBasis,
+                                 const FirstHit* firstHits, const FirstHit* prevFirstHits,
+                                 const glm::vec4* prevEstimate, glm::vec4* history)
+{
+    int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+    if (index >= resolution.x * resolution.y)
+    {
+        return;
+    }
 
-        for (int i = 0; i < geoms_size; i++)
+    const FirstHit current = firstHits[index];
+    glm::vec4 result(0.f);
+    // camera rays are view - a * right - b * up, with a and b linear in the
+    // pixel coordinates; solve for them without assuming an orthonormal basis
+    glm::vec3 c = prevInvBasis * (current.position - prevCam.position);
+    if (current.hit && c.x > 0.f)
+    {
+        float px = -c.y / (c.x * prevCam.pixelLength.x) + prevCam.resolution.x * 0.5f;
+        float py = -c.z / (c.x * prevCam.pixelLength.y) + prevCam.resolution.y * 0.5f;
+        int x0 = (int)floorf(px);
+        int y0 = (int)floorf(py);
+        float fx = px - x0;
+        float fy = py - y0;
+        float tolerance = TEMPORAL_DEPTH_TOLERANCE * glm::length(current.position - prevCam.position);
+
+        float totalWeight = 0.f;
+        for (int dy = 0; dy < 2; ++dy)
         {
-            Geom& geom = geoms[i];
-            if (geom.type == MESH)
-            {
-                if (aabbIntersectionTest(geom.aabb, pathSegment.ray))
-                {
-                    for (int j = geom.triBeginIdx; j < geom.triEndIdx; ++j)
-                    {
-                        t = triangleIntersectionTest(geom, tris[j], pathSegment.ray, mats[geom.materialid], texData,
-                                                     tmp_intersect, tmp_normal, tmp_uv);
-                        if (t > 0.f && t_min > t)
-                        {
-                            t_min = t;
-                            hit_geom_index = i;
-                            intersect_point = tmp_intersect;
-                            normal = tmp_normal;
-                            uv = tmp_uv;
-                        }
-                    }
-                }
-            }
-            else 
+            for (int dx = 0; dx < 2; ++dx)
             {
-                if (geom.type == CUBE)
-                {
-                    t = boxIntersectionTest(geom, pathSegment.ray, tmp_intersect, tmp_normal, outside);
-                }
-                else if (geom.type == SPHERE)
+                int x = x0 + dx;
+                int y = y0 + dy;
+                if (x < 0 || y < 0 || x >= prevCam.resolution.x || y >= prevCam.resolution.y)
                 {
-                    t = sphereIntersectionTest(geom, pathSegment.ray, tmp_intersect, tmp_normal, outside);
+                    continue;
                 }
-                if (t > 0.0f && t_min > t)
+                int prevIndex = x + y * prevCam.resolution.x;
+                const FirstHit& prev = prevFirstHits[prevIndex];
+                if (!prev.hit || glm::distance(prev.position, current.position) > tolerance
+                    || glm::dot(prev.normal, current.normal) < TEMPORAL_NORMAL_TOLERANCE)
                 {
-                    t_min = t;
-                    hit_geom_index = i;
-                    intersect_point = tmp_intersect;
-                    normal = tmp_normal;
+                    continue;
                 }
+                float w = (dx ? fx : 1.f - fx) * (dy ? fy : 1.f - fy);
+                result += w * prevEstimate[prevIndex];
+                totalWeight += w;
             }
         }
-
-        if (hit_geom_index == -1)
-        {
-            intersections[path_index].t = -1.0f;
-        }
-        else
+        if (totalWeight > 0.f)
         {
-            //The ray hits something
-            intersections[path_index].t = t_min;
-            intersections[path_index].materialId = geoms[hit_geom_index].materialid;
-            intersections[path_index].surfaceNormal = normal;
-            intersections[path_index].uv = uv;
+            result /= totalWeight;
         }
     }
+    history[index] = result;
 }
+#endif
 
-// processes rays based on intersections. 
-// For non-terminating rays calls scatterRay for scattering and shading.
-__global__ void shadeBSDF(int iter,
-                          int depth,
-                          int num_paths,
-                          ShadeableIntersection* shadeableIntersections,
-                          PathSegment* pathSegments,
-                          Material* materials,
-                          glm::vec3* dev_texData) 
+static LightSampling currentLightSampling()
 {
-    int idx = blockIdx.x * blockDim.x + threadIdx.x;
-    if (idx >= num_paths) return;
+    return LightSampling{ environment, lightBVH, dev_geoms, dev_triangles, dev_shadowRays, photonMap, pathGuide, radianceCache };
+}
 
-    PathSegment& pathSeg = pathSegments[idx];
-    ShadeableIntersection& intersection = shadeableIntersections[idx];
+// Launchers passed to FeatureDispatch, holding the arguments of a kernel
+// launch until its variant is known.
+struct GenerateRaysLaunch
+{
+    dim3 numBlocks;
+    int blockSize;
+    Camera cam;
+    int iter;
+    int traceDepth;
+    PathSegment* paths;
+    const Ray* cachedRays;
+
+    template <int Features>
+    void run() const
+    {
+        generateRayFromCamera<Features><<<numBlocks, blockSize>>>(cam, iter, traceDepth, paths, cachedRays);
+    }
+};
 
-    if (intersection.t > 0.f) 
+struct RegeneratePathsLaunch
+{
+    dim3 numBlocks;
+    int blockSize;
+    Camera cam;
+    int iter;
+    int traceDepth;
+    int firstSlot;
+    int count;
+    int firstSample;
+
+    template <int Features>
+    void run() const
     {
-        Material mat = materials[intersection.materialId];
-        if (mat.emittance > 0.f) 
-        {
-            pathSeg.remainingBounces = 0;
-            pathSeg.color *= mat.color * mat.emittance;
-        }
-        else 
-        {
-            int bounces = --pathSeg.remainingBounces;
-            if (bounces > 0) 
-            {
-                thrust::default_random_engine rng = makeSeededRandomEngine(iter, idx, depth);
-                scatterRay(pathSeg, 
-                           getPointOnRay(pathSeg.ray, intersection.t), 
-                           intersection.surfaceNormal, 
-                           intersection.uv,
-                           mat, 
-                           dev_texData,
-                           rng);
-            }
-            else 
-            {
-                pathSeg.color = glm::vec3(0.f);
-            }
-        }
+        regeneratePaths<Features><<<numBlocks, blockSize>>>(cam, iter, traceDepth, firstSlot, count, firstSample, dev_paths);
     }
-    else 
+};
+
+struct IntersectLaunch
+{
+    dim3 numBlocks;
+    int blockSize;
+    int depth;
+    int num_paths;
+
+    template <int Features>
+    void run() const
     {
-#if (STREAM_COMPACTION == 0)
-        if (pathSeg.remainingBounces > 0) 
+        computeIntersections<Features><<<numBlocks, blockSize>>>
+            (depth, dev_paths, num_paths, dev_geoms, hst_scene->geoms.size(), dev_triangles, dev_bvhNodes, dev_materials, dev_texData, dev_intersections, dev_pixelStats);
+    }
+};
+
+// Launches the intersection kernel variant of the scene's features.
+static void launchIntersections(const IntersectLaunch& launch, int iter)
+{
+#if PERFORMANCE_ANALYSIS && !RAY_STATS
+    // the all-features run goes first, so the variant's hits are the ones shaded
+    if (iter > numIters && iter <= 2 * numIters && (sceneFeatures & INTERSECT_FEATURES) != INTERSECT_FEATURES)
+    {
+        variantTimer().startGpuTimer();
+        launch.run<INTERSECT_FEATURES>();
+        variantTimer().endGpuTimer();
+        allFeaturesIntersectTime += variantTimer().getGpuElapsedTimeForPreviousOperation();
+
+        variantTimer().startGpuTimer();
+        FeatureDispatch<INTERSECT_FEATURES>::run(sceneFeatures, launch);
+        variantTimer().endGpuTimer();
+        variantIntersectTime += variantTimer().getGpuElapsedTimeForPreviousOperation();
+        return;
+    }
+#endif
+    FeatureDispatch<INTERSECT_FEATURES>::run(sceneFeatures, launch);
+}
+
+struct ShadeLaunch
+{
+    dim3 numBlocks;
+    int blockSize;
+    int iter;
+    int depth;
+    int num_paths;
+    glm::vec3* imageEven;
+
+    template <int Features>
+    void run() const
+    {
+        shadeBSDF<Features><<<numBlocks, blockSize>>>(iter, depth, num_paths, dev_intersections, dev_paths, dev_materials, dev_texData,
+                                                      dev_image, imageEven, currentLightSampling(), dev_pixelStats);
+    }
+};
+
+struct ShadowRaysLaunch
+{
+    dim3 numBlocks;
+    int blockSize;
+    int num_slots;
+    glm::vec3* imageEven;
+
+    template <int Features>
+    void run() const
+    {
+        traceShadowRays<Features><<<numBlocks, blockSize>>>
+            (num_slots, dev_shadowRays, dev_geoms, hst_scene->geoms.size(), dev_triangles, dev_bvhNodes, dev_materials, dev_texData,
+             dev_image, imageEven, currentLightSampling());
+    }
+};
+
+// Launches shadeQueue for every non-empty queue from Queue on.
+template <int Queue = 0>
+struct ShadeQueuesLaunch
+{
+    static void run(const int* counts, int blockSize, int iter, int depth, int queueStride, glm::vec3* imageEven)
+    {
+        if (counts[Queue] > 0)
         {
-            pathSeg.remainingBounces = 0;
-            pathSeg.color = glm::vec3(0.f);
+            dim3 numBlocks = (counts[Queue] + blockSize - 1) / blockSize;
+            shadeQueue<Queue><<<numBlocks, blockSize>>>(iter, depth, counts[Queue], dev_shadeQueues + Queue * queueStride,
+                                                       dev_intersections, dev_paths, dev_materials, dev_texData,
+                                                       dev_image, imageEven, currentLightSampling(), dev_pixelStats);
         }
-#else
-        pathSeg.remainingBounces = 0;
-        pathSeg.color = glm::vec3(0.f);
-#endif
+        ShadeQueuesLaunch<Queue + 1>::run(counts, blockSize, iter, depth, queueStride, imageEven);
     }
-}
+};
 
-// Add the current iteration's output to the overall image
-__global__ void finalGather(int nPaths, glm::vec3 * image, PathSegment * iterationPaths)
+template <>
+struct ShadeQueuesLaunch<NUM_SHADE_QUEUES>
 {
-    int index = (blockIdx.x * blockDim.x) + threadIdx.x;
+    static void run(const int* counts, int blockSize, int iter, int depth, int queueStride, glm::vec3* imageEven)
+    {
+    }
+};
 
-    if (index < nPaths)
+#if CAUSTIC_PHOTONS
+struct TracePhotonsLaunch
+{
+    dim3 numBlocks;
+    int blockSize;
+    int iter;
+    int numPhotons;
+    int traceDepth;
+
+    template <int Features>
+    void run() const
     {
-        PathSegment iterationPath = iterationPaths[index];
-        image[iterationPath.pixelIndex] += iterationPath.color;
+        tracePhotons<Features><<<numBlocks, blockSize>>>
+            (iter, numPhotons, traceDepth, currentLightSampling(), dev_photonLightAlias,
+             dev_geoms, hst_scene->geoms.size(), dev_triangles, dev_bvhNodes, dev_materials, dev_texData,
+             dev_photons, dev_photonCount);
     }
+};
+
+// Traces the caustic photons of iteration iter and sorts them into the hash
+// grid of photonMap, at the iteration's gather radius.
+static void buildCausticPhotonMap(int iter, int traceDepth, int blockSize)
+{
+    float radius2 = causticInitialRadius * causticInitialRadius;
+    for (int i = 2; i <= iter; ++i)
+    {
+        radius2 *= (i - 1 + CAUSTIC_RADIUS_ALPHA) / i;
+    }
+    photonMap.photons = dev_photonsSorted;
+    photonMap.cellStart = dev_photonCellStart;
+    photonMap.cellEnd = dev_photonCellEnd;
+    photonMap.radius = sqrtf(radius2);
+
+    const int numEmitted = CAUSTIC_PHOTONS_PER_ITERATION;
+    cudaMemset(dev_photonCount, 0, sizeof(int));
+    FeatureDispatch<INTERSECT_FEATURES | SHADE_FEATURES>::run(sceneFeatures,
+        TracePhotonsLaunch{ dim3((numEmitted + blockSize - 1) / blockSize), blockSize, iter, numEmitted, traceDepth });
+    int numPhotons;
+    cudaMemcpy(&numPhotons, dev_photonCount, sizeof(int), cudaMemcpyDeviceToHost);
+
+    // a table of at least one entry keeps the map on when no photon got through
+    photonMap.tableSize = 1 << ilog2ceil(glm::max(numPhotons, 1));
+    cudaMemset(dev_photonCellStart, 0xff, photonMap.tableSize * sizeof(int));
+    cudaMemset(dev_photonCellEnd, 0xff, photonMap.tableSize * sizeof(int));
+    if (numPhotons > 0)
+    {
+        const dim3 numBlocks = (numPhotons + blockSize - 1) / blockSize;
+        computePhotonKeys<<<numBlocks, blockSize>>>(numPhotons, dev_photons, photonMap, dev_photonKeys, dev_photonIndices);
+        StreamCompaction::Primitives::sortByKey(numPhotons, dev_photonKeys, dev_photonIndices,
+            dev_photonKeysScratch, dev_photonIndicesScratch, ilog2ceil(photonMap.tableSize), photonWorkspace);
+        gatherPhotons<<<numBlocks, blockSize>>>(numPhotons, dev_photonIndices, dev_photons, dev_photonsSorted);
+        findPhotonCells<<<numBlocks, blockSize>>>(numPhotons, dev_photonKeys, dev_photonCellStart, dev_photonCellEnd);
+    }
+    checkCUDAError("buildCausticPhotonMap");
 }
+#endif
 
 /**
  * Wrapper for the __global__ call that sets up the kernel calls and does a ton
@@ -368,16 +2500,17 @@ __global__ void finalGather(int nPaths, glm::vec3 * image, PathSegment * iterati
 void pathtrace(uchar4 *pbo, int frame, int iter) 
 {
     const int traceDepth = hst_scene->state.traceDepth;
-    const Camera &cam = hst_scene->state.camera;
+    const Camera cam = renderCamera();
+    const glm::ivec2 displayResolution = hst_scene->state.camera.resolution;
     const int pixelcount = cam.resolution.x * cam.resolution.y;
+    // random number sequence of the iteration's first sample of each pixel
+    const int firstSample = (iter - 1) * SAMPLES_PER_ITERATION + 1;
 
-    // 2D block for generating ray from camera
-    const dim3 blockSize2d(8, 8);
-    const dim3 blocksPerGrid2d((cam.resolution.x + blockSize2d.x - 1) / blockSize2d.x,
-                               (cam.resolution.y + blockSize2d.y - 1) / blockSize2d.y);
-
-    // 1D block for path tracing
+    // 1D block for path tracing; camera rays and the preview image are also
+    // launched in 1D and map thread indices to pixels with pixelFromIndex
     const int blockSize1d = 128;
+    const dim3 numBlocksPixels = (pixelcount + blockSize1d - 1) / blockSize1d;
+    const dim3 numBlocksDisplay = (displayResolution.x * displayResolution.y + blockSize1d - 1) / blockSize1d;
 
     ///////////////////////////////////////////////////////////////////////////
 
@@ -397,7 +2530,7 @@ void pathtrace(uchar4 *pbo, int frame, int iter)
     //   * Shade the rays that intersected something or didn't bottom out.
     //     That is, color the ray by performing a color computation according
     //     to the shader, then generate a new ray to continue the ray path.
-    // * Finally, add this iteration's results to the image. 
+    //     Paths that reach a light add their color to the image right there.
 
     // perform one iteration of path tracing
 
@@ -406,13 +2539,66 @@ void pathtrace(uchar4 *pbo, int frame, int iter)
     {
         timer().startCpuTimer();
     }
+    else if (iter == numIters + 1)
+    {
+        variantIntersectTime = allFeaturesIntersectTime = 0.f;
+    }
+#endif
+
+#if CAUSTIC_PHOTONS
+    if (dev_photons)
+    {
+        buildCausticPhotonMap(iter, traceDepth, blockSize1d);
+    }
+#endif
+
+#if PATH_GUIDING
+    // records only live for the iteration; the recording quadtrees keep the sums
+    cudaMemsetAsync(dev_guideRecordCount, 0, sizeof(int));
+#endif
+#if RADIANCE_CACHE
+    // cells grow with the distance to this iteration's camera
+    radianceCache.cameraPosition = cam.position;
+    cudaMemsetAsync(dev_cacheRecordCount, 0, sizeof(int));
+#endif
+
+#if CACHE_FIRST_BOUNCE
+    // Iterations cycle through the cached patterns; each pattern is traced
+    // and stored the first time it comes up.
+    const int pattern = (iter - 1) % numCachedPatterns;
+    const bool patternCached = iter > numCachedPatterns;
+    Ray* patternRays = dev_cachedRays + pattern * pixelcount;
+    ShadeableIntersection* patternIntersections = dev_cachedIntersections + pattern * pixelcount;
+
+    FeatureDispatch<RAY_GEN_FEATURES>::run(sceneFeatures,
+        GenerateRaysLaunch{ numBlocksPixels, blockSize1d, cam, firstSample, traceDepth, dev_paths,
+                            patternCached ? patternRays : nullptr });
+    if (!patternCached)
+    {
+        cudaMemcpy2D(patternRays, sizeof(Ray), &dev_paths[0].ray, sizeof(PathSegment),
+                     sizeof(Ray), pixelcount, cudaMemcpyDeviceToDevice);
+    }
+#else
+    FeatureDispatch<RAY_GEN_FEATURES>::run(sceneFeatures,
+        GenerateRaysLaunch{ numBlocksPixels, blockSize1d, cam, firstSample, traceDepth, dev_paths, nullptr });
 #endif
 
-    generateRayFromCamera<<<blocksPerGrid2d, blockSize2d>>>(cam, iter, traceDepth, dev_paths);
+    // paths add their radiance to the image in the shading stage as they
+    // reach a light; even iterations also go to the error estimate's image
+#if ERROR_ESTIMATE
+    glm::vec3* imageEven = iter % 2 == 0 ? dev_imageEven : nullptr;
+#else
+    glm::vec3* imageEven = nullptr;
+#endif
 
     int depth = 0;
     PathSegment* dev_paths_end = dev_paths + pixelcount;
     int num_paths = dev_paths_end - dev_paths;
+#if PATH_REGENERATION
+    // samples of this iteration not yet started; the first pixelcount are in the pool
+    int nextSample = pixelcount;
+    const int iterationSamples = pixelcount * PATH_REGENERATION_SAMPLES;
+#endif
 
     // --- PathSegment Tracing Stage ---
     // Shoot ray into scene, bounce between objects, push shading chunks
@@ -421,28 +2607,61 @@ void pathtrace(uchar4 *pbo, int frame, int iter)
     {
         dim3 numblocksPathSegmentTracing = (num_paths + blockSize1d - 1) / blockSize1d;
 
+#if PERFORMANCE_ANALYSIS
+        if (iter <= numIters)
+        {
+            timer().startGpuTimer();
+        }
+#endif
+
+#if SORT_BY_RAY_KEY
+        // Camera rays are already coherent; reorder the scattered ones
+        if (depth > 0)
+        {
+            computeRayKeys<<<numblocksPathSegmentTracing, blockSize1d>>>
+                (num_paths, dev_paths, sceneMin, sceneInvExtent, dev_sortKeys, dev_sortIndices);
+            StreamCompaction::Primitives::sortByKey(num_paths, dev_sortKeys, dev_sortIndices,
+                dev_sortKeysScratch, dev_sortIndicesScratch, 30, compactionWorkspace);
+            gatherPaths<<<numblocksPathSegmentTracing, blockSize1d>>>(num_paths, dev_sortIndices, dev_paths, dev_pathsScratch);
+            cudaMemcpy(dev_paths, dev_pathsScratch, num_paths * sizeof(PathSegment), cudaMemcpyDeviceToDevice);
+        }
+#endif
+
 #if CACHE_FIRST_BOUNCE
         if (depth == 0)
         {
-            if (iter == 1)
+            if (!patternCached)
             {
-                computeIntersections<<<numblocksPathSegmentTracing, blockSize1d>>>
-                    (depth, dev_paths, num_paths, dev_geoms, hst_scene->geoms.size(), dev_triangles, dev_materials, dev_texData, dev_intersections);
-                cudaMemcpy(dev_cachedIntersections, dev_intersections, num_paths * sizeof(ShadeableIntersection), cudaMemcpyDeviceToDevice);
+                launchIntersections(IntersectLaunch{ numblocksPathSegmentTracing, blockSize1d, depth, num_paths }, iter);
+                cudaMemcpy(patternIntersections, dev_intersections, num_paths * sizeof(ShadeableIntersection), cudaMemcpyDeviceToDevice);
             }
             else
             {
-                cudaMemcpy(dev_intersections, dev_cachedIntersections, num_paths * sizeof(ShadeableIntersection), cudaMemcpyDeviceToDevice);
+                cudaMemcpy(dev_intersections, patternIntersections, num_paths * sizeof(ShadeableIntersection), cudaMemcpyDeviceToDevice);
             }
         }
         else
         {
-            computeIntersections<<<numblocksPathSegmentTracing, blockSize1d>>>
-                (depth, dev_paths, num_paths, dev_geoms, hst_scene->geoms.size(), dev_triangles, dev_materials, dev_texData, dev_intersections);
+            launchIntersections(IntersectLaunch{ numblocksPathSegmentTracing, blockSize1d, depth, num_paths }, iter);
         }
 #else
-        computeIntersections<<<numblocksPathSegmentTracing, blockSize1d>>>
-            (depth, dev_paths, num_paths, dev_geoms, hst_scene->geoms.size(), dev_triangles, dev_materials, dev_texData, dev_intersections);
+        launchIntersections(IntersectLaunch{ numblocksPathSegmentTracing, blockSize1d, depth, num_paths }, iter);
+#endif
+
+#if TEMPORAL_REPROJECTION
+        // the first sample of an accumulation decides which surface each pixel sees
+        if (depth == 0 && iter == 1)
+        {
+            recordFirstHits<<<numblocksPathSegmentTracing, blockSize1d>>>
+                (num_paths, dev_paths, dev_intersections, dev_firstHits);
+            if (historyPending)
+            {
+                glm::mat3 prevInvBasis = glm::inverse(glm::mat3(historyCamera.view, historyCamera.right, historyCamera.up));
+                reprojectHistory<<<numBlocksPixels, blockSize1d>>>(cam.resolution, historyCamera, prevInvBasis,
+                    dev_firstHits, dev_prevFirstHits, dev_prevEstimate, dev_history);
+                historyPending = false;
+            }
+        }
 #endif
 
         depth++;
@@ -451,34 +2670,123 @@ void pathtrace(uchar4 *pbo, int frame, int iter)
         // Shade path segments based on intersections and generate new rays by
         // evaluating the BSDF.
 
-#if SORT_BY_MATERIAL
+#if SORT_BY_MATERIAL && THRUST_PRIMITIVES
         thrust::sort_by_key(thrust::device, dev_intersections, dev_intersections + num_paths, dev_paths);
+#elif SORT_BY_MATERIAL
+        // sort small keys and indices, then move the paths and intersections once;
+        // the intersections are only used this bounce, so their buffers just swap
+        computeMaterialKeys<<<numblocksPathSegmentTracing, blockSize1d>>>
+            (num_paths, dev_intersections, dev_sortKeys, dev_sortIndices);
+        StreamCompaction::Primitives::sortByKey(num_paths, dev_sortKeys, dev_sortIndices,
+            dev_sortKeysScratch, dev_sortIndicesScratch, materialKeyBits, compactionWorkspace);
+        gatherPathsAndIntersections<<<numblocksPathSegmentTracing, blockSize1d>>>
+            (num_paths, dev_sortIndices, dev_paths, dev_intersections, dev_pathsScratch, dev_intersectionsScratch);
+        cudaMemcpyAsync(dev_paths, dev_pathsScratch, num_paths * sizeof(PathSegment), cudaMemcpyDeviceToDevice);
+        std::swap(dev_intersections, dev_intersectionsScratch);
+#endif
+
+        // diffuse vertices fill their slots with light samples
+        if (dev_shadowRays)
+        {
+            cudaMemsetAsync(dev_shadowRays, 0, NUM_SHADOW_RAYS * num_paths * sizeof(ShadowRay));
+        }
+
+#if SHADING_QUEUES
+        int queueCounts[NUM_SHADE_QUEUES];
+        cudaMemset(dev_shadeQueueCounts, 0, NUM_SHADE_QUEUES * sizeof(int));
+        classifyPaths<<<numblocksPathSegmentTracing, blockSize1d>>>
+            (num_paths, dev_intersections, dev_materials, dev_shadeQueueCounts, dev_shadeQueues, pixelcount);
+        cudaMemcpy(queueCounts, dev_shadeQueueCounts, NUM_SHADE_QUEUES * sizeof(int), cudaMemcpyDeviceToHost);
+        ShadeQueuesLaunch<>::run(queueCounts, blockSize1d, iter, depth, pixelcount, imageEven);
+#else
+        FeatureDispatch<SHADE_FEATURES>::run(sceneFeatures,
+            ShadeLaunch{ numblocksPathSegmentTracing, blockSize1d, iter, depth, num_paths, imageEven });
 #endif
-        
-        shadeBSDF<<<numblocksPathSegmentTracing, blockSize1d>>>(iter, depth, num_paths, dev_intersections, dev_paths, dev_materials, dev_texData);
 
-#if STREAM_COMPACTION
+        if (dev_shadowRays)
+        {
+            const int numShadowRays = NUM_SHADOW_RAYS * num_paths;
+            FeatureDispatch<FEATURE_MESH>::run(sceneFeatures,
+                ShadowRaysLaunch{ dim3((numShadowRays + blockSize1d - 1) / blockSize1d), blockSize1d, numShadowRays, imageEven });
+        }
+
+#if STREAM_COMPACTION && THRUST_PRIMITIVES
         dev_paths_end = thrust::partition(thrust::device, dev_paths, dev_paths_end, pathRemains());
         num_paths = dev_paths_end - dev_paths;
+#elif STREAM_COMPACTION
+        // terminated paths have already added their radiance, so they're dropped
+        num_paths = StreamCompaction::Primitives::compact(num_paths, dev_pathsScratch, dev_paths,
+                                                          pathRemains(), compactionWorkspace);
+        std::swap(dev_paths, dev_pathsScratch);
+        dev_paths_end = dev_paths + num_paths;
 #else
         if (depth >= hst_scene->state.traceDepth)
         {
-            break;
+            num_paths = 0;
+        }
+#endif
+
+#if PATH_REGENERATION
+        // start new samples in the slots of the paths that just terminated
+        const int numRegenerated = glm::min(pixelcount - num_paths, iterationSamples - nextSample);
+        if (numRegenerated > 0)
+        {
+            FeatureDispatch<RAY_GEN_FEATURES>::run(sceneFeatures,
+                RegeneratePathsLaunch{ dim3((numRegenerated + blockSize1d - 1) / blockSize1d), blockSize1d, cam, iter,
+                                       traceDepth, num_paths, numRegenerated, nextSample });
+            nextSample += numRegenerated;
+            num_paths += numRegenerated;
+            dev_paths_end = dev_paths + num_paths;
         }
 #endif
-    }
 
-    // Assemble this iteration and apply it to the image
-    dim3 numBlocksPixels = (pixelcount + blockSize1d - 1) / blockSize1d;
-    finalGather<<<numBlocksPixels, blockSize1d>>>(pixelcount, dev_image, dev_paths);
+#if PERFORMANCE_ANALYSIS
+        if (iter <= numIters)
+        {
+            timer().endGpuTimer();
+            if (depthTime.size() < depth)
+            {
+                depthTime.resize(depth, 0.f);
+            }
+            depthTime[depth - 1] += timer().getGpuElapsedTimeForPreviousOperation();
+        }
+#endif
+    }
 
     ///////////////////////////////////////////////////////////////////////////
 
+#if PATH_GUIDING
+    // training passes double in length, so a pass ends after iteration 2^k - 1
+    ++guideIterations;
+    if ((guideIterations & (guideIterations + 1)) == 0)
+    {
+        refinePathGuide((guideIterations + 1) / 2 * SAMPLES_PER_ITERATION);
+    }
+#endif
+#if RADIANCE_CACHE
+    resolveRadianceCache<<<(RADIANCE_CACHE_ENTRIES + blockSize1d - 1) / blockSize1d, blockSize1d>>>(radianceCache);
+#endif
+
     // Send results to OpenGL buffer for rendering
-    sendImageToPBO<<<blocksPerGrid2d, blockSize2d>>>(pbo, cam.resolution, iter, dev_image);
+#if TEMPORAL_REPROJECTION
+    sendImageToPBO<<<numBlocksDisplay, blockSize1d>>>(pbo, displayResolution, cam.resolution,
+        iter * SAMPLES_PER_ITERATION, dev_image, dev_history);
+    lastCamera = cam;
+    lastIter = iter;
+#else
+    sendImageToPBO<<<numBlocksDisplay, blockSize1d>>>(pbo, displayResolution, cam.resolution,
+        iter * SAMPLES_PER_ITERATION, dev_image, nullptr);
+#endif
 
-    // Retrieve image from GPU
-    cudaMemcpy(hst_scene->state.image.data(), dev_image, pixelcount * sizeof(glm::vec3), cudaMemcpyDeviceToHost);
+    // Retrieve image from GPU; reduced-resolution previews aren't saved
+    if (renderScale == 1)
+    {
+        cudaMemcpy(hst_scene->state.image.data(), dev_image, pixelcount * sizeof(glm::vec3), cudaMemcpyDeviceToHost);
+    }
+    else
+    {
+        cudaDeviceSynchronize();
+    }
 
 #if PERFORMANCE_ANALYSIS
     if (iter <= numIters) 
@@ -488,7 +2796,150 @@ void pathtrace(uchar4 *pbo, int frame, int iter)
         if (iter == numIters)
         {
             cout << "Path-trace time for " << numIters << " iterations: " << totalTime << "ms" << endl;
+            cout << "Ray sort: " << (SORT_BY_RAY_KEY ? "ray key" : "none")
+                 << ", material sort: " << (SORT_BY_MATERIAL ? "on" : "off")
+                 << ", compaction and sort: " << (THRUST_PRIMITIVES ? "thrust" : "primitives")
+                 << ", shading queues: " << (SHADING_QUEUES ? "on" : "off")
+                 << ", caustic photons: " << (dev_photons ? "on" : "off") << endl;
+            cout << "Kernel variant: " << featureString(sceneFeatures)
+                 << (SPECIALIZE_KERNELS ? "" : " (specialization off)") << endl;
+            for (size_t d = 0; d < depthTime.size(); ++d)
+            {
+                cout << "  depth " << d << ": " << depthTime[d] / numIters << "ms per iteration" << endl;
+            }
+        }
+    }
+    if (iter == 2 * numIters && allFeaturesIntersectTime > 0.f)
+    {
+        cout << "Intersection kernel over iterations " << numIters + 1 << "-" << 2 * numIters << ": "
+             << featureString(sceneFeatures & INTERSECT_FEATURES) << " variant " << variantIntersectTime / numIters
+             << "ms, all features " << allFeaturesIntersectTime / numIters << "ms per iteration, "
+             << allFeaturesIntersectTime / variantIntersectTime << "x" << endl;
+    }
+#endif
+}
+
+void pathtraceUpdateScene(bool meshesChanged)
+{
+    Scene* scene = hst_scene;
+    cudaMemcpy(dev_geoms, scene->geoms.data(), scene->geoms.size() * sizeof(Geom), cudaMemcpyHostToDevice);
+    if (meshesChanged)
+    {
+        uploadTriangles(scene->triangles);
+        // a rebuilt BVH can have another node count
+        if (scene->bvhNodes.size() > bvhNodeCapacity)
+        {
+            bvhNodeCapacity = scene->bvhNodes.size();
+            if (bvhNodesOwned)
+            {
+                cudaFree(dev_bvhNodes);
+            }
+            cudaMalloc(&dev_bvhNodes, bvhNodeCapacity * sizeof(WideBVHNode));
+            bvhNodesOwned = true;
         }
+        cudaMemcpy(dev_bvhNodes, scene->bvhNodes.data(), scene->bvhNodes.size() * sizeof(WideBVHNode), cudaMemcpyHostToDevice);
+    }
+#if SORT_BY_RAY_KEY
+    updateSceneBounds(*scene);
+#endif
+    // emitters that moved got a new light BVH of the same size
+    if (lightBVH.numLights > 0)
+    {
+        cudaMemcpy(dev_lights, scene->lights.data(), scene->lights.size() * sizeof(Light), cudaMemcpyHostToDevice);
+        cudaMemcpy(dev_lightNodes, scene->lightNodes.data(), scene->lightNodes.size() * sizeof(LightBVHNode), cudaMemcpyHostToDevice);
+    }
+#if CAUSTIC_PHOTONS
+    if (dev_photonLightAlias)
+    {
+        updatePhotonLights(*scene);
+    }
+#endif
+#if PATH_GUIDING
+    // what was learned is about the old scene; the camera alone doesn't matter
+    initGuideTree(guideTree, computeSceneBounds(*scene));
+    uploadGuideTree();
+    guideIterations = 0;
+#endif
+#if RADIANCE_CACHE
+    resetRadianceCache(*scene);
+#endif
+
+    checkCUDAError("pathtraceUpdateScene");
+}
+
+int pathtraceSamplesPerIteration()
+{
+    return SAMPLES_PER_ITERATION;
+}
+
+void pathtraceSetRenderScale(int scale)
+{
+    renderScale = glm::max(scale, 1);
+}
+
+void pathtraceRestart()
+{
+    // buffers are cleared at full resolution, whatever the render scale
+    const Camera& cam = hst_scene->state.camera;
+    const int pixelcount = cam.resolution.x * cam.resolution.y;
+
+#if TEMPORAL_REPROJECTION
+    if (lastIter > 0)
+    {
+        // the previous accumulation may have had another render scale
+        const int blockSize1d = 128;
+        const int lastPixelcount = lastCamera.resolution.x * lastCamera.resolution.y;
+        const dim3 numBlocksLast = (lastPixelcount + blockSize1d - 1) / blockSize1d;
+        resolveEstimate<<<numBlocksLast, blockSize1d>>>(lastPixelcount, lastIter * SAMPLES_PER_ITERATION,
+                                                         dev_image, dev_history, dev_prevEstimate);
+        std::swap(dev_firstHits, dev_prevFirstHits);
+        historyCamera = lastCamera;
+        historyPending = true;
+    }
+    cudaMemset(dev_history, 0, pixelcount * sizeof(glm::vec4));
+    lastIter = 0;
+#endif
+    cudaMemset(dev_image, 0, pixelcount * sizeof(glm::vec3));
+#if ERROR_ESTIMATE
+    cudaMemset(dev_imageEven, 0, pixelcount * sizeof(glm::vec3));
+#endif
+#if RAY_STATS
+    cudaMemset(dev_pixelStats, 0, pixelcount * sizeof(RayStats));
+#endif
+
+    checkCUDAError("pathtraceRestart");
+}
+
+float pathtraceRelativeError(int iter)
+{
+#if ERROR_ESTIMATE
+    if (iter < 2)
+    {
+        return -1.f;
     }
+    const Camera cam = renderCamera();
+    const int pixelcount = cam.resolution.x * cam.resolution.y;
+    const int blockSize1d = 128;
+    const dim3 numBlocksPixels = (pixelcount + blockSize1d - 1) / blockSize1d;
+
+    computeErrorTerms<<<numBlocksPixels, blockSize1d>>>(pixelcount, iter, dev_image, dev_imageEven, dev_errorTerms);
+    glm::vec2 sums = thrust::reduce(thrust::device, dev_errorTerms, dev_errorTerms + pixelcount,
+                                    glm::vec2(0.f), thrust::plus<glm::vec2>());
+    checkCUDAError("pathtraceRelativeError");
+    // RMS error relative to the mean luminance of the image
+    return glm::sqrt(sums.x / pixelcount) / glm::max(sums.y / pixelcount, ERROR_ESTIMATE_EPSILON);
+#else
+    return -1.f;
+#endif
+}
+
+void pathtraceSaveStats(const std::string& baseFilename, int samples)
+{
+#if RAY_STATS
+    const Camera& cam = hst_scene->state.camera;
+    std::vector<RayStats> pixelStats(cam.resolution.x * cam.resolution.y);
+    cudaMemcpy(pixelStats.data(), dev_pixelStats, pixelStats.size() * sizeof(RayStats), cudaMemcpyDeviceToHost);
+    checkCUDAError("pathtraceSaveStats");
+    saveRayStats(pixelStats, cam.resolution, samples, baseFilename);
 #endif
 }
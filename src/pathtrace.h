@@ -6,3 +6,19 @@
 void pathtraceInit(Scene *scene);
 void pathtraceFree();
 void pathtrace(uchar4 *pbo, int frame, int iteration);
+// Starts a new accumulation after a camera change without reloading the scene.
+void pathtraceRestart();
+// Uploads the scene's geoms after an animation step, and its triangles and BVH
+// nodes if meshesChanged; other scene data stays on the device.
+void pathtraceUpdateScene(bool meshesChanged);
+// Samples per pixel each pathtrace() call adds to the image (more than one
+// with PATH_REGENERATION).
+int pathtraceSamplesPerIteration();
+// Renders with 1/scale of the resolution in each direction and upscales the
+// preview to the window. Restart the accumulation after changing it.
+void pathtraceSetRenderScale(int scale);
+// Estimated RMS error of the image after iter iterations, relative to its mean
+// luminance; negative if unknown (ERROR_ESTIMATE off or fewer than 2 iterations).
+float pathtraceRelativeError(int iter);
+// Saves ray statistics heatmaps if they are compiled in (RAY_STATS).
+void pathtraceSaveStats(const std::string& baseFilename, int samples);
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cuda_runtime.h>
+#include "glm/glm.hpp"
+#include "utilities.h"
+
+/**
+ * A photon that reached a diffuse surface through one or more specular
+ * bounces. power is its share of the emitted flux; direction is the way it
+ * was travelling when it landed.
+ */
+struct Photon
+{
+    glm::vec3 position;
+    glm::vec3 power;
+    glm::vec3 direction;
+};
+
+/**
+ * Caustic photons of one iteration in a spatial hash grid. Cells are
+ * 2 * radius wide, so the photons within radius of a point lie in 2x2x2
+ * cells. The photons are sorted by the hash of their cell; those of hash h are
+ * photons[cellStart[h]] to photons[cellEnd[h] - 1], or none if cellStart[h]
+ * is -1. A tableSize of 0 means there is no photon map.
+ */
+struct PhotonMap
+{
+    const Photon* photons = nullptr;
+    const int* cellStart = nullptr;
+    const int* cellEnd = nullptr;
+    int tableSize = 0;
+    float radius = 0.f;
+};
+
+__host__ __device__ inline glm::ivec3 photonCell(const PhotonMap& map, glm::vec3 p)
+{
+    return glm::ivec3(glm::floor(p / (2.f * map.radius)));
+}
+
+__host__ __device__ inline int photonCellHash(glm::ivec3 cell, int tableSize)
+{
+    // tableSize is a power of two
+    unsigned int h = (unsigned int)cell.x * 73856093u ^ (unsigned int)cell.y * 19349663u
+                     ^ (unsigned int)cell.z * 83492791u;
+    return h & (tableSize - 1);
+}
+
+/**
+ * Density estimate of the caustic irradiance at point p of a surface facing
+ * normal: the power of the photons within radius that landed on its front,
+ * over the area of the disc.
+ */
+__host__ __device__ inline glm::vec3 causticIrradiance(const PhotonMap& map, glm::vec3 p, glm::vec3 normal)
+{
+    const float radius2 = map.radius * map.radius;
+    const glm::ivec3 lo = photonCell(map, p - map.radius);
+
+    // distinct cells can share a hash; each hash is visited once
+    int visited[8];
+    int numVisited = 0;
+    glm::vec3 power(0.f);
+    for (int i = 0; i < 8; ++i)
+    {
+        int h = photonCellHash(lo + glm::ivec3(i & 1, (i >> 1) & 1, i >> 2), map.tableSize);
+        bool seen = false;
+        for (int j = 0; j < numVisited; ++j)
+        {
+            seen = seen || visited[j] == h;
+        }
+        if (seen)
+        {
+            continue;
+        }
+        visited[numVisited++] = h;
+
+        for (int k = map.cellStart[h]; k >= 0 && k < map.cellEnd[h]; ++k)
+        {
+            const Photon& photon = map.photons[k];
+            glm::vec3 d = photon.position - p;
+            if (glm::dot(d, d) <= radius2 && glm::dot(photon.direction, normal) < 0.f)
+            {
+                power += photon.power;
+            }
+        }
+    }
+    return power / (PI * radius2);
+}
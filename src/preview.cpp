@@ -174,6 +174,9 @@ void mainLoop() {
         runCuda();
 
         string title = "CIS565 Path Tracer | " + utilityCore::convertIntToString(iteration) + " Iterations";
+        if (renderScale > 1) {
+            title += " | 1/" + utilityCore::convertIntToString(renderScale) + " resolution";
+        }
         glfwSetWindowTitle(window, title.c_str());
 
         glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cuda_runtime.h>
+#include "glm/glm.hpp"
+#include "utilities.h"
+
+/**
+ * Diffuse vertex of a path whose outgoing radiance is learned by the
+ * radiance cache: the radiance the path finds from the vertex on, over
+ * weight, the path's throughput on reaching it, goes to cache entry `entry`.
+ * prev is the path's previous record or -1.
+ */
+struct CacheRecord
+{
+    int entry;
+    glm::vec3 weight;
+    int prev;
+};
+
+/**
+ * World space hash grid of the radiance leaving diffuse surfaces, in a fixed
+ * table of `size` entries (a power of two). Entries are keyed by a cell of
+ * the position, whose size grows with the distance to the camera, and the
+ * dominant axis of the normal. An entry holds:
+ *  - keys: the key, or 0 if the entry is free;
+ *  - accum: radiance and number of records added this iteration;
+ *  - resolved: the estimate so far, radiance and the number of samples
+ *    behind it, or 0 samples if there's none yet;
+ *  - age: iterations since the entry was last updated or looked up.
+ * A size of 0 means there is no cache.
+ */
+struct RadianceCache
+{
+    unsigned long long* keys = nullptr;
+    glm::vec4* accum = nullptr;
+    glm::vec4* resolved = nullptr;
+    unsigned int* age = nullptr;
+    CacheRecord* records = nullptr;
+    int* recordCount = nullptr;
+    int recordCapacity = 0;
+    int size = 0;
+    glm::vec3 cameraPosition;
+    float cellSize = 0.f;       // cells within nearDistance of the camera
+    float nearDistance = 0.f;   // cells double in size every doubling beyond
+};
+
+// Entries a key is looked for in, from its hash on.
+#define RADIANCE_CACHE_PROBES 8
+
+/**
+ * Key of the cell around p, on a surface facing normal; never 0. Cells are
+ * cellSize wide up to nearDistance from the camera and twice as wide every
+ * time the distance doubles.
+ */
+__device__ inline unsigned long long radianceCacheKey(const RadianceCache& cache, glm::vec3 p, glm::vec3 normal)
+{
+    float distance = glm::length(p - cache.cameraPosition);
+    int level = glm::clamp((int)floorf(log2f(glm::max(distance / cache.nearDistance, 1.f))), 0, 15);
+    glm::ivec3 cell = glm::ivec3(glm::floor(p / (cache.cellSize * (float)(1 << level))));
+
+    glm::vec3 a = glm::abs(normal);
+    int axis = a.x > a.y ? (a.x > a.z ? 0 : 2) : (a.y > a.z ? 1 : 2);
+    unsigned long long face = axis * 2 + (normal[axis] < 0.f ? 1 : 0);
+
+    // 17 bits per coordinate, wrapping around far from the origin
+    const unsigned long long mask = (1ull << 17) - 1;
+    return 1ull << 63 | face << 55 | (unsigned long long)level << 51 | ((unsigned long long)cell.x & mask) << 34
+           | ((unsigned long long)cell.y & mask) << 17 | ((unsigned long long)cell.z & mask);
+}
+
+__device__ inline int radianceCacheSlot(const RadianceCache& cache, unsigned long long key, int probe)
+{
+    unsigned long long h = key * 0x9E3779B97F4A7C15ull;
+    return (int)((h >> 32) + probe) & (cache.size - 1);
+}
+
+/**
+ * Entry of key, or -1 if it isn't cached. Eviction leaves holes, so all
+ * RADIANCE_CACHE_PROBES entries are looked at.
+ */
+__device__ inline int findRadianceCacheEntry(const RadianceCache& cache, unsigned long long key)
+{
+    for (int probe = 0; probe < RADIANCE_CACHE_PROBES; ++probe)
+    {
+        int slot = radianceCacheSlot(cache, key, probe);
+        if (cache.keys[slot] == key)
+        {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Entry of key, claiming a free one if it isn't cached yet; -1 if all its
+ * entries are taken. Two threads inserting the same key at once can end up
+ * with an entry each; lookups then find the first.
+ */
+__device__ inline int insertRadianceCacheEntry(const RadianceCache& cache, unsigned long long key)
+{
+    int entry = findRadianceCacheEntry(cache, key);
+    for (int probe = 0; entry < 0 && probe < RADIANCE_CACHE_PROBES; ++probe)
+    {
+        int slot = radianceCacheSlot(cache, key, probe);
+        unsigned long long prev = atomicCAS(&cache.keys[slot], 0ull, key);
+        if (prev == 0ull || prev == key)
+        {
+            entry = slot;
+        }
+    }
+    return entry;
+}
@@ -0,0 +1,122 @@
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+
+#include "raystats.h"
+#include "image.h"
+
+namespace {
+
+const char* statNames[NUM_RAY_STATS] = {
+    "box_tests",
+    "box_hits",
+    "triangle_tests",
+    "primitive_tests",
+    "bounces",
+    "shading_calls"
+};
+
+const int numHistogramBuckets = 16;
+
+// Blue to red color ramp for t in [0, 1].
+glm::vec3 falseColor(float t)
+{
+    static const glm::vec3 ramp[] = {
+        glm::vec3(0.f, 0.f, 0.5f),
+        glm::vec3(0.f, 0.3f, 1.f),
+        glm::vec3(0.f, 0.9f, 0.9f),
+        glm::vec3(0.3f, 1.f, 0.2f),
+        glm::vec3(1.f, 0.9f, 0.f),
+        glm::vec3(1.f, 0.3f, 0.f),
+        glm::vec3(0.6f, 0.f, 0.f)
+    };
+    const int last = sizeof(ramp) / sizeof(ramp[0]) - 1;
+    float x = glm::clamp(t, 0.f, 1.f) * last;
+    int i = std::min((int)x, last - 1);
+    return glm::mix(ramp[i], ramp[i + 1], x - i);
+}
+
+float percentile(const std::vector<float>& sorted, float p)
+{
+    return sorted[std::min((size_t)(p * sorted.size()), sorted.size() - 1)];
+}
+
+}
+
+void saveRayStats(const std::vector<RayStats>& pixelStats, glm::ivec2 resolution, int samples,
+                  const std::string& baseFilename)
+{
+    const int pixelcount = resolution.x * resolution.y;
+    if (samples <= 0 || pixelcount <= 0 || (int)pixelStats.size() < pixelcount)
+    {
+        return;
+    }
+
+    std::string summaryName = baseFilename + ".stats.txt";
+    std::ofstream summary(summaryName);
+    summary << "Ray statistics per sample, " << resolution.x << "x" << resolution.y
+            << ", " << samples << " samples" << std::endl;
+
+    std::vector<float> values(pixelcount);
+    std::vector<float> sorted(pixelcount);
+    for (int s = 0; s < NUM_RAY_STATS; ++s)
+    {
+        double total = 0.0;
+        int hottest = 0;
+        for (int i = 0; i < pixelcount; ++i)
+        {
+            values[i] = (float)pixelStats[i].count[s] / samples;
+            total += values[i];
+            if (values[i] > values[hottest])
+            {
+                hottest = i;
+            }
+        }
+        sorted = values;
+        std::sort(sorted.begin(), sorted.end());
+        float maxValue = sorted.back();
+        float p99 = percentile(sorted, .99f);
+        float scale = p99 > 0.f ? 1.f / p99 : 0.f;
+
+        // same orientation as the rendered image
+        image heatmap(resolution.x, resolution.y);
+        for (int y = 0; y < resolution.y; ++y)
+        {
+            for (int x = 0; x < resolution.x; ++x)
+            {
+                heatmap.setPixel(resolution.x - 1 - x, y, falseColor(values[x + y * resolution.x] * scale));
+            }
+        }
+        heatmap.savePNG(baseFilename + ".stats." + statNames[s]);
+
+        summary << std::endl << statNames[s] << ": mean " << total / pixelcount
+                << ", median " << percentile(sorted, .5f)
+                << ", p99 " << p99
+                << ", max " << maxValue
+                << " at pixel (" << resolution.x - 1 - hottest % resolution.x << ", " << hottest / resolution.x << ")"
+                << std::endl;
+
+        // buckets cover [0, p99]; the last one also takes everything above
+        int buckets[numHistogramBuckets] = {};
+        float range = p99 > 0.f ? p99 : maxValue;
+        float bucketWidth = range > 0.f ? range / (numHistogramBuckets - 1) : 1.f;
+        for (float v : values)
+        {
+            buckets[std::min((int)(v / bucketWidth), numHistogramBuckets - 1)]++;
+        }
+        for (int b = 0; b < numHistogramBuckets; ++b)
+        {
+            float share = (float)buckets[b] / pixelcount;
+            float upper = b + 1 < numHistogramBuckets ? (b + 1) * bucketWidth : maxValue;
+            summary << "  [" << std::setw(10) << b * bucketWidth << ", " << std::setw(10) << upper << ") "
+                    << std::setw(6) << std::fixed << std::setprecision(2) << share * 100.f << "% "
+                    << std::string((int)(share * 50.f + .5f), '#') << std::endl;
+            summary.unsetf(std::ios::floatfield);
+            summary << std::setprecision(6);
+        }
+        std::cout << statNames[s] << ": mean " << total / pixelcount << ", p99 " << p99 << ", max " << maxValue << std::endl;
+    }
+
+    std::cout << "Saved " << summaryName << "." << std::endl;
+}
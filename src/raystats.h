@@ -0,0 +1,48 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cuda_runtime.h>
+#include "glm/glm.hpp"
+
+enum RayStat {
+    STAT_BOX_TESTS,         // BVH child boxes tested
+    STAT_BOX_HITS,          // BVH child boxes hit
+    STAT_TRIANGLE_TESTS,
+    STAT_PRIMITIVE_TESTS,   // spheres and cubes tested
+    STAT_BOUNCES,
+    STAT_SHADING_CALLS,
+    NUM_RAY_STATS
+};
+
+/**
+ * Work done for one path, or accumulated for one pixel over all iterations.
+ * Can be passed to traverseWideBVH as its traversal stats.
+ */
+struct RayStats
+{
+    unsigned int count[NUM_RAY_STATS];
+
+    __host__ __device__ void node(int boxesTested, int boxesHit)
+    {
+        count[STAT_BOX_TESTS] += boxesTested;
+        count[STAT_BOX_HITS] += boxesHit;
+    }
+
+    __host__ __device__ void leaf(int triCount)
+    {
+        count[STAT_TRIANGLE_TESTS] += triCount;
+    }
+};
+
+/**
+ * Writes one false-color heatmap per counter, named
+ * baseFilename.stats.<counter>.png, and a histogram summary of all counters
+ * to baseFilename.stats.txt. Counters are shown per sample. Heatmaps are
+ * scaled to the 99th percentile of each counter so that a few extreme pixels
+ * don't wash out the rest.
+ *
+ * @param pixelStats  Counters of each pixel, indexed x + y * resolution.x.
+ */
+void saveRayStats(const std::vector<RayStats>& pixelStats, glm::ivec2 resolution, int samples,
+                  const std::string& baseFilename);
@@ -1,10 +1,13 @@
 #include <iostream>
 #include "scene.h"
 #include <cstring>
+#include <map>
 #include <glm/gtc/matrix_inverse.hpp>
 #include <glm/gtx/string_cast.hpp>
 #include <tiny_gltf.h>
 #include <stb_image.h>
+#include "gltffile.h"
+#include "../stream_compaction/parallel.h"
 
 Scene::Scene(string filename) {
     cout << "Reading scene from " << filename << " ..." << endl;
@@ -29,9 +32,13 @@ Scene::Scene(string filename) {
             } else if (strcmp(tokens[0].c_str(), "CAMERA") == 0) {
                 loadCamera();
                 cout << " " << endl;
+            } else if (strcmp(tokens[0].c_str(), "ENVMAP") == 0) {
+                loadEnvironment(tokens[1], tokens.size() > 2 ? atof(tokens[2].c_str()) : 1.f);
+                cout << " " << endl;
             }
         }
     }
+    buildLightBVH(geoms, triangles, materials, lights, lightNodes);
 }
 
 glm::vec3 triangleTangent(const Triangle& tri)
@@ -46,12 +53,209 @@ glm::vec3 triangleTangent(const Triangle& tri)
     return glm::normalize(t);
 }
 
+namespace {
+
+// A mesh BVH is rebuilt once refitting has raised its SAH cost by this factor
+// over the cost right after its last build.
+const float maxRefitCostRatio = 1.5f;
+
+// Triangle list of a glTF mesh, to become triangles [first, first + count)
+// of its geom. Missing attributes have empty views.
+struct GLTFPrimitive
+{
+    int mesh;
+    size_t first;
+    size_t count;
+    bool indexed;
+    AccessorView indices;
+    AccessorView positions;
+    AccessorView normals;
+    AccessorView uvs;
+    AccessorView tangents;
+};
+
+AccessorView attributeView(const GLTFFile& file, const tinygltf::Primitive& prim, const char* name, size_t numVertices)
+{
+    auto it = prim.attributes.find(name);
+    AccessorView view = file.accessor(it == prim.attributes.end() ? -1 : it->second);
+    return view.count >= numVertices ? view : AccessorView();
+}
+
+// Triangle i of a primitive, with its world space box added to bounds.
+Triangle assembleTriangle(const GLTFPrimitive& prim, size_t i, const glm::mat4& transform, AABB& bounds)
+{
+    Triangle tri;
+    for (int j = 0; j < 3; ++j)
+    {
+        size_t idx = prim.indexed ? prim.indices.index(i * 3 + j) : i * 3 + j;
+        idx = idx < prim.positions.count ? idx : 0;
+        tri.pos[j] = glm::vec3(prim.positions.element(idx));
+        if (prim.normals.count)
+        {
+            tri.normal[j] = glm::vec3(prim.normals.element(idx));
+        }
+        if (prim.uvs.count)
+        {
+            tri.uv[j] = glm::vec2(prim.uvs.element(idx));
+        }
+        if (prim.tangents.count)
+        {
+            tri.tangent[j] = prim.tangents.element(idx);
+        }
+        glm::vec3 worldPos(transform * glm::vec4(tri.pos[j], 1.f));
+        bounds.bound[0] = glm::min(bounds.bound[0], worldPos);
+        bounds.bound[1] = glm::max(bounds.bound[1], worldPos);
+    }
+    if (!prim.normals.count)
+    {
+        glm::vec3 normal = glm::normalize(glm::cross(tri.pos[1] - tri.pos[0], tri.pos[2] - tri.pos[0]));
+        for (int i = 0; i < 3; ++i)
+        {
+            tri.normal[i] = normal;
+        }
+    }
+    if (prim.uvs.count && !prim.tangents.count)
+    {
+        glm::vec3 dpos1 = tri.pos[1] - tri.pos[0];
+        glm::vec3 dpos2 = tri.pos[2] - tri.pos[0];
+        glm::vec2 duv1 = tri.uv[1] - tri.uv[0];
+        glm::vec2 duv2 = tri.uv[2] - tri.uv[0];
+        glm::vec3 t = (duv2.y * dpos1 - duv1.y * dpos2) / (duv2.y * duv1.x - duv1.y * duv2.x);
+        t = glm::normalize(t);
+        for (int i = 0; i < 3; ++i)
+        {
+            tri.tangent[i] = glm::vec4(t, 1);
+        }
+    }
+    return tri;
+}
+
+// Node hierarchy and translation/rotation/scale channels of a glTF model.
+// triangleMeshes is the glTF mesh each loaded triangle came from.
+MeshAnimation loadAnimation(const GLTFFile& file, const vector<int>& triangleMeshes)
+{
+    const tinygltf::Model& model = file.model;
+    MeshAnimation anim;
+    const int numNodes = model.nodes.size();
+    anim.parents.assign(numNodes, -1);
+    anim.restNodes.resize(numNodes);
+    vector<int> meshNodes(model.meshes.size(), -1);
+    for (int n = 0; n < numNodes; ++n)
+    {
+        const tinygltf::Node& node = model.nodes[n];
+        for (int child : node.children)
+        {
+            anim.parents[child] = n;
+        }
+        if (node.mesh >= 0 && meshNodes[node.mesh] < 0)
+        {
+            meshNodes[node.mesh] = n;
+        }
+
+        NodeTransform& rest = anim.restNodes[n];
+        if (node.matrix.size() == 16)
+        {
+            rest.hasMatrix = true;
+            for (int i = 0; i < 16; ++i)
+            {
+                rest.matrix[i / 4][i % 4] = (float)node.matrix[i];
+            }
+        }
+        if (node.translation.size() == 3)
+        {
+            rest.translation = glm::vec3(node.translation[0], node.translation[1], node.translation[2]);
+        }
+        if (node.rotation.size() == 4)
+        {
+            rest.rotation = glm::quat((float)node.rotation[3], (float)node.rotation[0], (float)node.rotation[1], (float)node.rotation[2]);
+        }
+        if (node.scale.size() == 3)
+        {
+            rest.scale = glm::vec3(node.scale[0], node.scale[1], node.scale[2]);
+        }
+    }
+    // no channels yet, so this is the rest pose
+    anim.restWorld = anim.worldMatrices(0.f);
+
+    for (const tinygltf::Animation& animation : model.animations)
+    {
+        for (const tinygltf::AnimationChannel& channel : animation.channels)
+        {
+            NodeChannel c;
+            c.node = channel.target_node;
+            if (channel.target_path == "translation")
+            {
+                c.path = NodeChannel::TRANSLATION;
+            }
+            else if (channel.target_path == "rotation")
+            {
+                c.path = NodeChannel::ROTATION;
+            }
+            else if (channel.target_path == "scale")
+            {
+                c.path = NodeChannel::SCALE;
+            }
+            else
+            {
+                cout << "Skipping " << channel.target_path << " animation channel, morph targets aren't loaded" << endl;
+                continue;
+            }
+
+            const tinygltf::AnimationSampler& sampler = animation.samplers[channel.sampler];
+            if (c.node < 0)
+            {
+                continue;
+            }
+            const AccessorView times = file.accessor(sampler.input);
+            const AccessorView values = file.accessor(sampler.output);
+            c.step = sampler.interpolation == "STEP";
+            const bool cubic = sampler.interpolation == "CUBICSPLINE";
+            const size_t numKeys = std::min(times.count, cubic ? values.count / 3 : values.count);
+            for (size_t k = 0; k < numKeys; ++k)
+            {
+                // cubic spline keys are in-tangent, value, out-tangent; quantized
+                // rotations come back normalized
+                c.times.push_back(times.component(k, 0));
+                c.values.push_back(values.element(cubic ? 3 * k + 1 : k));
+            }
+            if (!c.times.empty())
+            {
+                anim.channels.push_back(c);
+            }
+        }
+    }
+
+    anim.triangleNodes.resize(triangleMeshes.size());
+    for (size_t i = 0; i < triangleMeshes.size(); ++i)
+    {
+        anim.triangleNodes[i] = meshNodes[triangleMeshes[i]];
+    }
+    return anim;
+}
+
+// World space box of a mesh geom's triangles.
+AABB meshBounds(const Geom& geom, const vector<Triangle>& triangles)
+{
+    AABB aabb;
+    for (int i = geom.triBeginIdx; i < geom.triEndIdx; ++i)
+    {
+        for (int j = 0; j < 3; ++j)
+        {
+            glm::vec3 worldPos(geom.transform * glm::vec4(triangles[i].pos[j], 1.f));
+            aabb.bound[0] = glm::min(aabb.bound[0], worldPos);
+            aabb.bound[1] = glm::max(aabb.bound[1], worldPos);
+        }
+    }
+    return aabb;
+}
+
+}
+
 int Scene::loadGLTF(string filename, Geom& geom)
 {
-    tinygltf::Model model;
-    tinygltf::TinyGLTF loader;
+    GLTFFile file;
     string err, warn;
-    bool ret = loader.LoadASCIIFromFile(&model, &err, &warn, filename);
+    bool ret = file.load(filename, err, warn);
     if (!warn.empty())
     {
         cout << "Warning: " << warn << endl;
@@ -65,110 +269,75 @@ int Scene::loadGLTF(string filename, Geom& geom)
         cout << "Failed to parse glTF" << endl;
         return -1;
     }
+    const tinygltf::Model& model = file.model;
 
-    geom.triBeginIdx = triangles.size();
-    for (auto& mesh : model.meshes)
+    // the index counts give the triangle count, so the arrays are sized once
+    // and filled in place
+    vector<GLTFPrimitive> primitives;
+    size_t numTriangles = 0;
+    for (size_t m = 0; m < model.meshes.size(); ++m)
     {
-        for (auto& prim : mesh.primitives)
-        {   
-            const tinygltf::Accessor* accessor;
-            const tinygltf::BufferView* bufferView;
-            const tinygltf::Buffer* buffer;
-            int offset;
-            const unsigned short* indices = nullptr;
-            const float* positions = nullptr;
-            const float* normals = nullptr;
-            const float* uvs = nullptr;
-            const float* tangents = nullptr;
-
-            accessor = &model.accessors[prim.indices];
-            bufferView = &model.bufferViews[accessor->bufferView];
-            buffer = &model.buffers[bufferView->buffer];
-            offset = bufferView->byteOffset + accessor->byteOffset;
-            indices = reinterpret_cast<const unsigned short*>(&buffer->data[offset]);
-
-            accessor = &model.accessors[prim.attributes["POSITION"]];
-            bufferView = &model.bufferViews[accessor->bufferView];
-            buffer = &model.buffers[bufferView->buffer];
-            offset = bufferView->byteOffset + accessor->byteOffset;
-            positions = reinterpret_cast<const float*>(&buffer->data[offset]);
-
-            if (prim.attributes.find("NORMAL") != prim.attributes.end())
+        for (const tinygltf::Primitive& prim : model.meshes[m].primitives)
+        {
+            if (prim.mode != TINYGLTF_MODE_TRIANGLES)
             {
-                accessor = &model.accessors[prim.attributes["NORMAL"]];
-                bufferView = &model.bufferViews[accessor->bufferView];
-                buffer = &model.buffers[bufferView->buffer];
-                offset = bufferView->byteOffset + accessor->byteOffset;
-                normals = reinterpret_cast<const float*>(&buffer->data[offset]);
+                cout << "Skipping primitive that isn't a triangle list" << endl;
+                continue;
             }
-
-            if (prim.attributes.find("TEXCOORD_0") != prim.attributes.end())
+            GLTFPrimitive p;
+            p.mesh = m;
+            p.positions = attributeView(file, prim, "POSITION", 1);
+            p.indexed = prim.indices >= 0;
+            p.indices = file.accessor(prim.indices);
+            if (p.positions.count == 0 || (p.indexed && !p.indices.data))
             {
-                accessor = &model.accessors[prim.attributes["TEXCOORD_0"]];
-                bufferView = &model.bufferViews[accessor->bufferView];
-                buffer = &model.buffers[bufferView->buffer];
-                offset = bufferView->byteOffset + accessor->byteOffset;
-                uvs = reinterpret_cast<const float*>(&buffer->data[offset]);
-            }
-
-            if (prim.attributes.find("TANGENT") != prim.attributes.end())
-            {
-                accessor = &model.accessors[prim.attributes["TANGENT"]];
-                bufferView = &model.bufferViews[accessor->bufferView];
-                buffer = &model.buffers[bufferView->buffer];
-                offset = bufferView->byteOffset + accessor->byteOffset;
-                tangents = reinterpret_cast<const float*>(&buffer->data[offset]);
+                cout << "Skipping primitive with unreadable positions or indices" << endl;
+                continue;
             }
+            p.normals = attributeView(file, prim, "NORMAL", p.positions.count);
+            p.uvs = attributeView(file, prim, "TEXCOORD_0", p.positions.count);
+            p.tangents = attributeView(file, prim, "TANGENT", p.positions.count);
+            p.first = numTriangles;
+            p.count = (p.indexed ? p.indices.count : p.positions.count) / 3;
+            numTriangles += p.count;
+            primitives.push_back(p);
+        }
+    }
 
-            for (size_t i = 0; i < model.accessors[prim.indices].count; i += 3)
+    geom.triBeginIdx = triangles.size();
+    triangles.resize(geom.triBeginIdx + numTriangles);
+    vector<int> triangleMeshes(numTriangles);
+    const size_t tileSize = StreamCompaction::Parallel::tileSize;
+    for (const GLTFPrimitive& p : primitives)
+    {
+        Triangle* out = &triangles[geom.triBeginIdx + p.first];
+        vector<AABB> tileBounds((p.count + tileSize - 1) / tileSize);
+        StreamCompaction::Parallel::parallelFor(tileBounds.size(), [&](int t) {
+            for (size_t i = t * tileSize; i < std::min(p.count, (t + 1) * tileSize); ++i)
             {
-                Triangle tri;
-                for (int j = 0; j < 3; ++j)
-                {
-                    int idx = indices[i + j];
-                    tri.pos[j] = glm::vec3(positions[idx * 3], positions[idx * 3 + 1], positions[idx * 3 + 2]);
-                    if (normals)
-                    {
-                        tri.normal[j] = glm::vec3(normals[idx * 3], normals[idx * 3 + 1], normals[idx * 3 + 2]);
-                    }
-                    if (uvs)
-                    {
-                        tri.uv[j] = glm::vec2(uvs[idx * 2], uvs[idx * 2 + 1]);
-                    }
-                    if (tangents)
-                    {
-                        tri.tangent[j] = glm::vec4(tangents[idx * 4], tangents[idx * 4 + 1], tangents[idx * 4 + 2], tangents[idx * 4 + 3]);
-                    }
-                    glm::vec3 worldPos(geom.transform * glm::vec4(tri.pos[j], 1.f));
-                    geom.aabb.bound[0] = glm::min(geom.aabb.bound[0], worldPos);
-                    geom.aabb.bound[1] = glm::max(geom.aabb.bound[1], worldPos);
-                }
-                if (!normals)
-                {
-                    glm::vec3 normal = glm::normalize(glm::cross(tri.pos[1] - tri.pos[0], tri.pos[2] - tri.pos[0]));
-                    for (int i = 0; i < 3; ++i)
-                    {
-                        tri.normal[i] = normal;
-                    }
-                }
-                if (uvs && !tangents)
-                {
-                    glm::vec3 dpos1 = tri.pos[1] - tri.pos[0];
-                    glm::vec3 dpos2 = tri.pos[2] - tri.pos[0];
-                    glm::vec2 duv1 = tri.uv[1] - tri.uv[0];
-                    glm::vec2 duv2 = tri.uv[2] - tri.uv[0];
-                    glm::vec3 t = (duv2.y * dpos1 - duv1.y * dpos2) / (duv2.y * duv1.x - duv1.y * duv2.x);
-                    t = glm::normalize(t);
-                    for (int i = 0; i < 3; ++i)
-                    {
-                        tri.tangent[i] = glm::vec4(t, 1);
-                    }
-                }
-                triangles.push_back(tri);
+                out[i] = assembleTriangle(p, i, geom.transform, tileBounds[t]);
             }
+        });
+        for (const AABB& bounds : tileBounds)
+        {
+            geom.aabb.bound[0] = glm::min(geom.aabb.bound[0], bounds.bound[0]);
+            geom.aabb.bound[1] = glm::max(geom.aabb.bound[1], bounds.bound[1]);
         }
+        std::fill(triangleMeshes.begin() + p.first, triangleMeshes.begin() + p.first + p.count, p.mesh);
     }
     geom.triEndIdx = triangles.size();
+
+    if (!model.animations.empty())
+    {
+        MeshAnimation anim = loadAnimation(file, triangleMeshes);
+        if (!anim.channels.empty())
+        {
+            anim.geom = geoms.size();
+            anim.restTriangles.assign(triangles.begin() + geom.triBeginIdx, triangles.end());
+            meshAnimations.push_back(anim);
+            cout << "Loaded " << anim.channels.size() << " animation channels" << endl;
+        }
+    }
     return 1;
 }
 
@@ -215,14 +384,19 @@ int Scene::loadGeom(string objectid) {
             cout << "Connecting Geom " << objectid << " to Material " << newGeom.materialid << "..." << endl;
         }
 
-        //load transformations
+        //load transformations, and keyframes from FRAME lines on
         glm::vec3 translation, rotation, scale;
+        map<int, TransformKeyframe> keyframes;
+        int keyframe = 0;
         utilityCore::safeGetline(fp_in, line);
         while (!line.empty() && fp_in.good()) {
             vector<string> tokens = utilityCore::tokenizeString(line);
 
             //load tranformations
-            if (strcmp(tokens[0].c_str(), "TRANS") == 0) {
+            if (strcmp(tokens[0].c_str(), "FRAME") == 0) {
+                keyframes[keyframe] = { keyframe, translation, rotation, scale };
+                keyframe = atoi(tokens[1].c_str());
+            } else if (strcmp(tokens[0].c_str(), "TRANS") == 0) {
                 translation = glm::vec3(atof(tokens[1].c_str()), atof(tokens[2].c_str()), atof(tokens[3].c_str()));
             } else if (strcmp(tokens[0].c_str(), "ROTAT") == 0) {
                 rotation = glm::vec3(atof(tokens[1].c_str()), atof(tokens[2].c_str()), atof(tokens[3].c_str()));
@@ -233,12 +407,29 @@ int Scene::loadGeom(string objectid) {
             utilityCore::safeGetline(fp_in, line);
         }
         newGeom.transform = utilityCore::buildTransformationMatrix(translation, rotation, scale);
+        if (!keyframes.empty()) {
+            keyframes[keyframe] = { keyframe, translation, rotation, scale };
+            GeomAnimation animation;
+            animation.geom = id;
+            for (auto& key : keyframes) {
+                animation.keyframes.push_back(key.second);
+            }
+            newGeom.transform = animation.transformAt(0);
+            geomAnimations.push_back(animation);
+            cout << "Loaded " << animation.keyframes.size() << " keyframes" << endl;
+        }
         newGeom.inverseTransform = glm::inverse(newGeom.transform);
         newGeom.invTranspose = glm::inverseTranspose(newGeom.transform);
 
-        if (newGeom.type == MESH)
+        if (newGeom.type == MESH && loadGLTF(gltf_file, newGeom) > 0 && newGeom.triEndIdx > newGeom.triBeginIdx)
         {
-            loadGLTF(gltf_file, newGeom);
+            vector<int> order;
+            newGeom.bvhRootIdx = buildWideBVH(triangles, newGeom.triBeginIdx, newGeom.triEndIdx, bvhNodes, &order);
+            if (!meshAnimations.empty() && meshAnimations.back().geom == id)
+            {
+                meshAnimations.back().reorder(order);
+                meshAnimations.back().builtCost = refitWideBVH(triangles, bvhNodes, newGeom.bvhRootIdx);
+            }
         }
 
         geoms.push_back(newGeom);
@@ -246,6 +437,117 @@ int Scene::loadGeom(string objectid) {
     }
 }
 
+void Scene::rebuildBVH(Geom& geom)
+{
+    // the mesh's nodes are contiguous from its root up to the next mesh's root
+    const int nodeBegin = geom.bvhRootIdx;
+    int nodeEnd = bvhNodes.size();
+    for (const Geom& other : geoms)
+    {
+        if (other.bvhRootIdx > nodeBegin)
+        {
+            nodeEnd = min(nodeEnd, other.bvhRootIdx);
+        }
+    }
+
+    vector<WideBVHNode> rebuilt;
+    vector<int> order;
+    buildWideBVH(triangles, geom.triBeginIdx, geom.triEndIdx, rebuilt, &order);
+    for (WideBVHNode& node : rebuilt)
+    {
+        for (int c = 0; c < node.childCount; ++c)
+        {
+            node.child[c] += node.triCount[c] == 0 ? nodeBegin : 0;
+        }
+    }
+
+    // move the nodes of the meshes after this one
+    const int shift = (int)rebuilt.size() - (nodeEnd - nodeBegin);
+    for (size_t n = nodeEnd; n < bvhNodes.size(); ++n)
+    {
+        for (int c = 0; c < bvhNodes[n].childCount; ++c)
+        {
+            bvhNodes[n].child[c] += bvhNodes[n].triCount[c] == 0 ? shift : 0;
+        }
+    }
+    for (Geom& other : geoms)
+    {
+        if (other.bvhRootIdx >= nodeEnd)
+        {
+            other.bvhRootIdx += shift;
+        }
+    }
+    bvhNodes.erase(bvhNodes.begin() + nodeBegin, bvhNodes.begin() + nodeEnd);
+    bvhNodes.insert(bvhNodes.begin() + nodeBegin, rebuilt.begin(), rebuilt.end());
+
+    for (MeshAnimation& anim : meshAnimations)
+    {
+        if (&geoms[anim.geom] == &geom)
+        {
+            anim.reorder(order);
+            anim.builtCost = refitWideBVH(triangles, bvhNodes, geom.bvhRootIdx);
+        }
+    }
+}
+
+bool Scene::setFrame(int frame)
+{
+    for (const GeomAnimation& anim : geomAnimations)
+    {
+        Geom& geom = geoms[anim.geom];
+        geom.transform = anim.transformAt(frame);
+        geom.inverseTransform = glm::inverse(geom.transform);
+        geom.invTranspose = glm::inverseTranspose(geom.transform);
+        if (geom.type == MESH)
+        {
+            geom.aabb = meshBounds(geom, triangles);
+        }
+    }
+
+    const float time = frame / state.fps;
+    for (MeshAnimation& anim : meshAnimations)
+    {
+        Geom& geom = geoms[anim.geom];
+        anim.pose(time, triangles, geom.triBeginIdx);
+        float cost = refitWideBVH(triangles, bvhNodes, geom.bvhRootIdx);
+        if (cost > maxRefitCostRatio * anim.builtCost)
+        {
+            cout << "Frame " << frame << ": refitted BVH cost " << cost << " is over " << maxRefitCostRatio
+                 << "x the built cost " << anim.builtCost << ", rebuilding" << endl;
+            rebuildBVH(geom);
+        }
+        geom.aabb = meshBounds(geom, triangles);
+    }
+    if (!geomAnimations.empty() || !meshAnimations.empty())
+    {
+        buildLightBVH(geoms, triangles, materials, lights, lightNodes);
+    }
+    return !meshAnimations.empty();
+}
+
+int Scene::loadEnvironment(string filename, float scale)
+{
+    cout << "Loading Environment " << filename << "..." << endl;
+    int width, height, channels;
+    float* pixels = stbi_loadf(filename.c_str(), &width, &height, &channels, 3);
+    if (!pixels)
+    {
+        cout << "Image loading failed" << endl;
+        return -1;
+    }
+
+    envResolution = glm::ivec2(width, height);
+    envRadiance.resize(width * height);
+    for (int i = 0; i < width * height; ++i)
+    {
+        envRadiance[i] = scale * glm::vec3(pixels[i * 3], pixels[i * 3 + 1], pixels[i * 3 + 2]);
+    }
+    stbi_image_free(pixels);
+
+    envAlias = buildEnvironmentAliasTable(envRadiance, width, height);
+    return 1;
+}
+
 int Scene::loadCamera() {
     cout << "Loading Camera ..." << endl;
     RenderState &state = this->state;
@@ -305,6 +607,26 @@ int Scene::loadCamera() {
         {
             camera.aperture = atof(tokens[1].c_str());
         }
+        else if (strcmp(tokens[0].c_str(), "TIME_BUDGET") == 0)
+        {
+            state.timeBudget = atof(tokens[1].c_str());
+        }
+        else if (strcmp(tokens[0].c_str(), "MIN_SPS") == 0)
+        {
+            state.minSamplesPerSecond = atof(tokens[1].c_str());
+        }
+        else if (strcmp(tokens[0].c_str(), "TARGET_ERROR") == 0)
+        {
+            state.targetError = atof(tokens[1].c_str());
+        }
+        else if (strcmp(tokens[0].c_str(), "FRAMES") == 0)
+        {
+            state.frames = max(1, atoi(tokens[1].c_str()));
+        }
+        else if (strcmp(tokens[0].c_str(), "FPS") == 0)
+        {
+            state.fps = atof(tokens[1].c_str());
+        }
 
         utilityCore::safeGetline(fp_in, line);
     }
@@ -395,14 +717,14 @@ int Scene::loadMaterial(string materialid) {
                 texInfo->offset = texData.size();
                 texInfo->width = width;
                 texInfo->height = height;
+                texData.resize(texInfo->offset + width * height);
+                glm::vec3* texels = &texData[texInfo->offset];
                 for (int i = 0; i < width * height; ++i)
                 {
-                    glm::vec3 col;
                     for (int j = 0; j < 3; ++j)
                     {
-                        col[j] = (float) pixels[i * 3 + j] / 255.f;
+                        texels[i][j] = (float) pixels[i * 3 + j] / 255.f;
                     }
-                    texData.push_back(col);
                 }
 
                 stbi_image_free(pixels);
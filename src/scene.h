@@ -7,6 +7,10 @@
 #include "glm/glm.hpp"
 #include "utilities.h"
 #include "sceneStructs.h"
+#include "bvh.h"
+#include "animation.h"
+#include "environment.h"
+#include "lightbvh.h"
 
 using namespace std;
 
@@ -17,13 +21,39 @@ private:
     int loadGeom(string objectid);
     int loadGLTF(string filename, Geom& geomTemplate);
     int loadCamera();
+    int loadEnvironment(string filename, float scale);
+    void rebuildBVH(Geom& geom);
 public:
     Scene(string filename);
     ~Scene();
 
     vector<Geom> geoms;
     vector<Triangle> triangles;
+    vector<WideBVHNode> bvhNodes;
     vector<Material> materials;
     vector<glm::vec3> texData;
     RenderState state;
+
+    // Equirectangular environment of the ENVMAP line, if any, and the alias
+    // table importance sampling it.
+    glm::ivec2 envResolution = glm::ivec2(0);
+    vector<glm::vec3> envRadiance;
+    vector<AliasEntry> envAlias;
+
+    // Emissive primitives and triangles, and the BVH light sampling walks.
+    vector<Light> lights;
+    vector<LightBVHNode> lightNodes;
+
+    vector<GeomAnimation> geomAnimations;
+    vector<MeshAnimation> meshAnimations;
+
+    /**
+     * Poses all animated objects at `frame`: keyframed objects get new
+     * transforms, glTF-animated meshes are deformed and their BVHs refitted,
+     * or rebuilt once refitting has degraded them too much. The light BVH is
+     * rebuilt if anything moved.
+     *
+     * @return  Whether triangles or BVH nodes changed.
+     */
+    bool setFrame(int frame);
 };
@@ -13,6 +13,18 @@ enum GeomType {
     MESH
 };
 
+// Renderer features a scene can use. The kernels are instantiated for the
+// features of the loaded scene, so code for unused features is compiled out.
+enum SceneFeature {
+    FEATURE_MESH        = 1 << 0,
+    FEATURE_BUMP        = 1 << 1,
+    FEATURE_TEXTURE     = 1 << 2,
+    FEATURE_REFLECTIVE  = 1 << 3,
+    FEATURE_REFRACTIVE  = 1 << 4,
+    FEATURE_DOF         = 1 << 5,
+    FEATURE_ALL         = (1 << 6) - 1
+};
+
 struct Ray {
     glm::vec3 origin;
     glm::vec3 direction;
@@ -26,9 +38,35 @@ struct Triangle
     glm::vec4 tangent[3];
 };
 
+// COMPRESSED_ATTRIBUTES: the kernels read triangles as PackedTriangle, with
+// quantized normals, tangents and UVs; the host keeps them as Triangle.
+#define COMPRESSED_ATTRIBUTES 1
+
+/**
+ * Triangle as uploaded with COMPRESSED_ATTRIBUTES: 76 bytes instead of 144.
+ * Positions stay at full precision. Normals are octahedral in 2x16 bits,
+ * tangents in 16 + 15 bits plus their handedness in the top bit, and UVs are
+ * 16-bit fractions of uvExtent. See packedtriangle.h.
+ */
+struct PackedTriangle
+{
+    glm::vec3 pos[3];
+    unsigned int normal[3];
+    unsigned int tangent[3];
+    unsigned short uv[3][2];
+    float uvExtent;
+};
+
+// Triangles as the kernels see them.
+#if COMPRESSED_ATTRIBUTES
+typedef PackedTriangle DeviceTriangle;
+#else
+typedef Triangle DeviceTriangle;
+#endif
+
 struct AABB 
 {
-    glm::vec3 bound[2] = { glm::vec3(FLT_MAX), glm::vec3(FLT_MIN) };
+    glm::vec3 bound[2] = { glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX) };
 };
 
 struct Geom 
@@ -41,6 +79,9 @@ struct Geom
 
     int triBeginIdx;
     int triEndIdx;
+    int bvhRootIdx = -1;
+    // index of the geom's light, or of its first triangle's, if it's emissive
+    int lightBeginIdx = -1;
     AABB aabb;
 };
 
@@ -65,6 +106,18 @@ struct Material {
     TexInfo bump;
 };
 
+// Kinds of BSDF a material can have, in scatterRay's order of precedence.
+// Shading queues are indexed by these; a new BSDF needs an entry here, a case
+// in bsdfType and a scatterBSDF specialization.
+enum BSDFType {
+    BSDF_EMISSIVE,
+    BSDF_REFRACTIVE,
+    BSDF_REFLECTIVE,
+    BSDF_DIFFUSE,
+    BSDF_DIFFUSE_TEXTURED,
+    NUM_BSDF_TYPES
+};
+
 struct Camera {
     glm::ivec2 resolution;
     glm::vec3 position;
@@ -81,21 +134,48 @@ struct Camera {
 struct RenderState {
     Camera camera;
     unsigned int iterations;
+    // Optional stopping criteria besides the iteration count; 0 disables them.
+    float timeBudget = 0.f;             // seconds of rendering
+    float minSamplesPerSecond = 0.f;    // iterations per second
+    float targetError = 0.f;            // estimated relative RMS error
     int traceDepth;
+    // Frame sequence of an animated scene, rendered one after the other.
+    int frames = 1;
+    float fps = 24.f;
     std::vector<glm::vec3> image;
     std::string imageName;
 };
 
+// Where a path stands relative to the caustic photon map, which is gathered
+// at the path's first diffuse vertex. Light reached from that vertex through
+// specular bounces only is already in the photons.
+enum CausticState {
+    CAUSTIC_BEFORE_GATHER,
+    CAUSTIC_GATHERED,
+    CAUSTIC_SPECULAR_CHAIN,
+    CAUSTIC_PAST
+};
+
 struct PathSegment {
     Ray ray;
     glm::vec3 color;
     int pixelIndex;
     int remainingBounces;
+    // solid angle density the ray's direction was sampled with; 0 for camera
+    // rays and specular bounces, which light sampling can't produce
+    float bsdfPdf;
+    int causticState;
+    int guideRecord;    // newest path guiding record of the path, -1 if none
+    int cacheRecord;    // newest radiance cache record of the path, -1 if none
+    // footprint of the camera ray at the first hit and how far the bounces
+    // since have spread it, as square roots of areas
+    float cameraSpread;
+    float spread;
 };
 
 struct pathRemains
 {
-    __device__ bool operator()(const PathSegment& pathSeg)
+    __host__ __device__ bool operator()(const PathSegment& pathSeg) const
     {
         return pathSeg.remainingBounces > 0;
     }
@@ -110,6 +190,7 @@ struct ShadeableIntersection
   glm::vec3 surfaceNormal;
   int materialId;
   glm::vec2 uv;
+  int lightIdx;     // light hit, -1 if the surface doesn't emit
 
   __host__ __device__ bool operator<(const ShadeableIntersection& other) const
   {
@@ -0,0 +1,117 @@
+#include <algorithm>
+#include <cstring>
+#include <cuda_runtime.h>
+
+#include "scenearena.h"
+#include "packedtriangle.h"
+#include "../stream_compaction/parallel.h"
+
+namespace {
+
+size_t alignSection(size_t bytes)
+{
+    return (bytes + sceneArenaAlignment - 1) / sceneArenaAlignment * sceneArenaAlignment;
+}
+
+template <typename T>
+void releaseArray(std::vector<T>& v)
+{
+    // clear() keeps the capacity
+    std::vector<T>().swap(v);
+}
+
+template <typename T>
+void stageArray(const std::vector<T>& src, SceneArena& arena, SceneSection s)
+{
+    if (!src.empty())
+    {
+        std::memcpy(arena.staging + arena.offset[s], src.data(), arena.bytes[s]);
+    }
+}
+
+}
+
+void stageScene(const Scene& scene, SceneArena& arena)
+{
+    const size_t sizes[NUM_SCENE_SECTIONS] = {
+        scene.geoms.size() * sizeof(Geom),
+        scene.triangles.size() * sizeof(DeviceTriangle),
+        scene.bvhNodes.size() * sizeof(WideBVHNode),
+        scene.materials.size() * sizeof(Material),
+        scene.texData.size() * sizeof(glm::vec3),
+        scene.envRadiance.size() * sizeof(glm::vec3),
+        scene.envAlias.size() * sizeof(AliasEntry),
+        scene.lights.size() * sizeof(Light),
+        scene.lightNodes.size() * sizeof(LightBVHNode),
+    };
+    arena.totalBytes = 0;
+    for (int s = 0; s < NUM_SCENE_SECTIONS; ++s)
+    {
+        arena.offset[s] = arena.totalBytes;
+        arena.bytes[s] = sizes[s];
+        arena.totalBytes = alignSection(arena.totalBytes + sizes[s]);
+    }
+
+    // pinned memory is copied from directly rather than through a driver
+    // buffer; without a device there's nothing to pin it for
+    const size_t allocBytes = std::max(arena.totalBytes, sceneArenaAlignment);
+    arena.pinned = cudaMallocHost(&arena.staging, allocBytes) == cudaSuccess;
+    if (!arena.pinned)
+    {
+        cudaGetLastError();
+        arena.staging = new char[allocBytes];
+    }
+
+    stageArray(scene.geoms, arena, SECTION_GEOMS);
+    stageTriangles(scene.triangles, arena);
+    stageArray(scene.bvhNodes, arena, SECTION_BVH_NODES);
+    stageArray(scene.materials, arena, SECTION_MATERIALS);
+    stageArray(scene.texData, arena, SECTION_TEXTURES);
+    stageArray(scene.envRadiance, arena, SECTION_ENV_RADIANCE);
+    stageArray(scene.envAlias, arena, SECTION_ENV_ALIAS);
+    stageArray(scene.lights, arena, SECTION_LIGHTS);
+    stageArray(scene.lightNodes, arena, SECTION_LIGHT_NODES);
+}
+
+void stageTriangles(const std::vector<Triangle>& triangles, SceneArena& arena)
+{
+#if COMPRESSED_ATTRIBUTES
+    PackedTriangle* packed = arena.section<PackedTriangle>(arena.staging, SECTION_TRIANGLES);
+    const int n = triangles.size();
+    const int tileSize = StreamCompaction::Parallel::tileSize;
+    StreamCompaction::Parallel::parallelFor((n + tileSize - 1) / tileSize, [&](int t) {
+        for (int i = t * tileSize; i < std::min(n, (t + 1) * tileSize); ++i)
+        {
+            packed[i] = packTriangle(triangles[i]);
+        }
+    });
+#else
+    stageArray(triangles, arena, SECTION_TRIANGLES);
+#endif
+}
+
+void freeSceneStaging(SceneArena& arena)
+{
+    if (arena.pinned)
+    {
+        cudaFreeHost(arena.staging);
+    }
+    else
+    {
+        delete[] arena.staging;
+    }
+    arena.staging = nullptr;
+    arena.pinned = false;
+}
+
+void releaseStagedArrays(Scene& scene)
+{
+    releaseArray(scene.texData);
+    releaseArray(scene.envRadiance);
+    releaseArray(scene.envAlias);
+    if (scene.geomAnimations.empty() && scene.meshAnimations.empty())
+    {
+        releaseArray(scene.triangles);
+        releaseArray(scene.bvhNodes);
+    }
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+#include "scene.h"
+
+/**
+ * Sections of the scene arena, the one device allocation that holds the
+ * scene data the kernels read.
+ */
+enum SceneSection
+{
+    SECTION_GEOMS,
+    SECTION_TRIANGLES,
+    SECTION_BVH_NODES,
+    SECTION_MATERIALS,
+    SECTION_TEXTURES,
+    SECTION_ENV_RADIANCE,
+    SECTION_ENV_ALIAS,
+    SECTION_LIGHTS,
+    SECTION_LIGHT_NODES,
+    NUM_SCENE_SECTIONS
+};
+
+// Sections start at multiples of this many bytes.
+const size_t sceneArenaAlignment = 256;
+
+/**
+ * Offset table of the scene arena, and the host buffer it's staged in,
+ * pinned if a CUDA device is there to pin it for. Triangles are staged as
+ * DeviceTriangles.
+ */
+struct SceneArena
+{
+    size_t offset[NUM_SCENE_SECTIONS] = {};
+    size_t bytes[NUM_SCENE_SECTIONS] = {};
+    size_t totalBytes = 0;
+    char* staging = nullptr;
+    bool pinned = false;
+
+    /**
+     * Section s of a buffer laid out like the arena, or null if it's empty.
+     */
+    template <typename T>
+    T* section(char* base, SceneSection s) const
+    {
+        return bytes[s] > 0 ? reinterpret_cast<T*>(base + offset[s]) : nullptr;
+    }
+};
+
+/**
+ * Lays out the scene's device data in arena and allocates its staging buffer,
+ * then fills each section in place: the arrays are copied and the triangles
+ * packed on the StreamCompaction::Parallel threads.
+ */
+void stageScene(const Scene& scene, SceneArena& arena);
+
+/**
+ * Packs triangles into the arena's staging buffer.
+ */
+void stageTriangles(const std::vector<Triangle>& triangles, SceneArena& arena);
+
+void freeSceneStaging(SceneArena& arena);
+
+/**
+ * Frees the host copies of the arrays only the device reads once they're
+ * staged: textures and the environment map, and the triangles and BVH nodes
+ * unless animations repose or move the meshes. Host ray queries need the
+ * latter, so they can't run on the scene afterwards.
+ */
+void releaseStagedArrays(Scene& scene);
@@ -14,8 +14,6 @@ namespace StreamCompaction {
             return timer;
         }
 
-#if USING_SHARED_MEMORY
-
         const int blockSize_sharedMemory = 128;
 
         const int logNumBanks = 5;
@@ -98,6 +96,8 @@ namespace StreamCompaction {
             dev_data[threadIdx.x + blockDim.x] += blockSum;
         }
 
+#if USING_SHARED_MEMORY
+
         void scanHelper(int size, int *dev_data) {
 
             if (size > 2 * blockSize_sharedMemory) {
@@ -159,6 +159,43 @@ namespace StreamCompaction {
 
 #endif
 
+        // Scan levels of scanDevice are padded to whole blocks of this many elements.
+        const int scanTileSize = 2 * blockSize_sharedMemory;
+
+        inline int roundUpToTile(int n) {
+            return (n + scanTileSize - 1) / scanTileSize * scanTileSize;
+        }
+
+        int scanDeviceSize(int n) {
+            // at least one padding element, which ends up holding the total
+            return roundUpToTile(n + 1);
+        }
+
+        int scanDeviceBlockSumsSize(int n) {
+            int total = 0;
+            for (int size = scanDeviceSize(n); size > scanTileSize; ) {
+                size = scanDeviceSize(size / scanTileSize);
+                total += size;
+            }
+            return total;
+        }
+
+        void scanDevice(int n, int *dev_data, int *dev_blockSums) {
+            int size = scanDeviceSize(n);
+            cudaMemsetAsync(dev_data + n, 0, (size - n) * sizeof(int));
+            if (size == scanTileSize) {
+                kernScanPerBlock<<<1, blockSize_sharedMemory>>>(size, dev_data, nullptr);
+                return;
+            }
+
+            // the block sums are scanned like any other level, with the next
+            // level's scratch right after them
+            int blocks = size / scanTileSize;
+            kernScanPerBlock<<<blocks, blockSize_sharedMemory>>>(size, dev_data, dev_blockSums);
+            scanDevice(blocks, dev_blockSums, dev_blockSums + scanDeviceSize(blocks));
+            kernAddPerBlock<<<blocks, blockSize_sharedMemory>>>(dev_data, dev_blockSums);
+        }
+
         /**
          * Performs prefix-sum (aka scan) on idata, storing the result into odata.
          */
@@ -11,5 +11,25 @@ namespace StreamCompaction {
         int compact(int n, int *odata, const int *idata);
 
         void radixSort(int n, int *odata, const int *idata);
+
+        /**
+         * Number of ints the dev_data array of scanDevice must hold for n
+         * elements; at least n + 1.
+         */
+        int scanDeviceSize(int n);
+
+        /**
+         * Number of ints the dev_blockSums array of scanDevice must hold for
+         * n elements.
+         */
+        int scanDeviceBlockSumsSize(int n);
+
+        /**
+         * Exclusive scan of dev_data[0, n) in place, without allocating.
+         * Afterwards dev_data[n] holds the sum of all n elements. The rest of
+         * dev_data and dev_blockSums are scratch, sized by scanDeviceSize and
+         * scanDeviceBlockSumsSize for the largest n that will be scanned.
+         */
+        void scanDevice(int n, int *dev_data, int *dev_blockSums);
     }
 }
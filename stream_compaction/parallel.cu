@@ -0,0 +1,126 @@
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "parallel.h"
+
+namespace StreamCompaction {
+    namespace Parallel {
+        using StreamCompaction::Common::PerformanceTimer;
+        PerformanceTimer& timer()
+        {
+            static PerformanceTimer timer;
+            return timer;
+        }
+
+        namespace {
+            /**
+             * Worker threads that sleep until parallelFor hands them a batch
+             * of tasks. Tasks are claimed one at a time from a shared counter.
+             */
+            class ThreadPool {
+            public:
+                ThreadPool() {
+                    int numWorkers = std::max(1u, std::thread::hardware_concurrency()) - 1;
+                    for (int i = 0; i < numWorkers; ++i) {
+                        workers.emplace_back([this] { workerLoop(); });
+                    }
+                }
+
+                ~ThreadPool() {
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        stop = true;
+                    }
+                    wake.notify_all();
+                    for (std::thread &worker : workers) {
+                        worker.join();
+                    }
+                }
+
+                int size() const {
+                    return (int)workers.size() + 1;
+                }
+
+                void run(int n, const std::function<void(int)> &fn) {
+                    // one run at a time, in case several host threads use the pool
+                    std::lock_guard<std::mutex> runLock(runMutex);
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        task = &fn;
+                        numTasks = n;
+                        nextTask = 0;
+                        pending = (int)workers.size();
+                        ++generation;
+                    }
+                    wake.notify_all();
+                    runTasks();
+
+                    std::unique_lock<std::mutex> lock(mutex);
+                    done.wait(lock, [this] { return pending == 0; });
+                    task = nullptr;
+                }
+
+            private:
+                void runTasks() {
+                    int i;
+                    while ((i = nextTask++) < numTasks) {
+                        (*task)(i);
+                    }
+                }
+
+                void workerLoop() {
+                    unsigned int seen = 0;
+                    while (true) {
+                        {
+                            std::unique_lock<std::mutex> lock(mutex);
+                            wake.wait(lock, [&] { return stop || generation != seen; });
+                            if (stop) {
+                                return;
+                            }
+                            seen = generation;
+                        }
+                        runTasks();
+                        {
+                            std::lock_guard<std::mutex> lock(mutex);
+                            if (--pending == 0) {
+                                done.notify_one();
+                            }
+                        }
+                    }
+                }
+
+                std::vector<std::thread> workers;
+                std::mutex runMutex;
+                std::mutex mutex;
+                std::condition_variable wake;
+                std::condition_variable done;
+                const std::function<void(int)> *task = nullptr;
+                int numTasks = 0;
+                std::atomic<int> nextTask{0};
+                int pending = 0;
+                unsigned int generation = 0;
+                bool stop = false;
+            };
+
+            ThreadPool& pool() {
+                static ThreadPool pool;
+                return pool;
+            }
+        }
+
+        int numThreads() {
+            return pool().size();
+        }
+
+        void parallelFor(int numTasks, const std::function<void(int)> &task) {
+            if (numTasks <= 1 || pool().size() == 1) {
+                for (int i = 0; i < numTasks; ++i) {
+                    task(i);
+                }
+                return;
+            }
+            pool().run(numTasks, task);
+        }
+    }
+}
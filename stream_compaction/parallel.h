@@ -0,0 +1,251 @@
+#pragma once
+
+#include "common.h"
+
+#include <functional>
+#include <vector>
+
+namespace StreamCompaction {
+    namespace Parallel {
+        StreamCompaction::Common::PerformanceTimer& timer();
+
+        /**
+         * Number of threads parallelFor runs tasks on, including the caller.
+         */
+        int numThreads();
+
+        /**
+         * Runs task(0) ... task(numTasks - 1) on a persistent pool of worker
+         * threads and the calling thread, and returns once all are done.
+         * Tasks must not call parallelFor themselves.
+         */
+        void parallelFor(int numTasks, const std::function<void(int)>& task);
+
+        // Inputs smaller than this are processed on the calling thread.
+        const int serialThreshold = 1 << 15;
+        // Elements per task in the blocked passes: small enough that a tile
+        // is still in cache when it's read a second time.
+        const int tileSize = 1 << 14;
+
+        namespace detail {
+            /**
+             * Two passes over [0, n) in tiles of tileSize, one superblock of
+             * numThreads() tiles at a time so tiles stay in cache between the
+             * passes: count(begin, end) returns a tile's total, then
+             * write(begin, end, offset) gets the op-sum of all earlier tiles'
+             * totals and returns it with the tile's own total added. Small
+             * inputs skip the first pass. Returns the grand total.
+             */
+            template <typename T, typename Op, typename Count, typename Write>
+            T blockedTwoPass(int n, T identity, const Op &op, const Count &count, const Write &write) {
+                if (n < serialThreshold || numThreads() == 1) {
+                    return write(0, n, identity);
+                }
+
+                const int tilesPerBlock = numThreads();
+                std::vector<T> tileTotals(tilesPerBlock);
+                T carry = identity;
+                for (int blockBegin = 0; blockBegin < n; blockBegin += tilesPerBlock * tileSize) {
+                    int numTiles = std::min(tilesPerBlock, (n - blockBegin + tileSize - 1) / tileSize);
+                    parallelFor(numTiles, [&](int t) {
+                        int begin = blockBegin + t * tileSize;
+                        tileTotals[t] = count(begin, std::min(begin + tileSize, n));
+                    });
+                    for (int t = 0; t < numTiles; ++t) {
+                        T total = tileTotals[t];
+                        tileTotals[t] = carry;
+                        carry = op(carry, total);
+                    }
+                    parallelFor(numTiles, [&](int t) {
+                        int begin = blockBegin + t * tileSize;
+                        write(begin, std::min(begin + tileSize, n), tileTotals[t]);
+                    });
+                }
+                return carry;
+            }
+
+            template <typename T>
+            void parallelCopy(int n, T *odata, const T *idata) {
+                if (n < serialThreshold) {
+                    std::copy(idata, idata + n, odata);
+                    return;
+                }
+                int numTasks = (n + tileSize - 1) / tileSize;
+                parallelFor(numTasks, [&](int t) {
+                    int begin = t * tileSize;
+                    int end = std::min(begin + tileSize, n);
+                    std::copy(idata + begin, idata + end, odata + begin);
+                });
+            }
+
+            template <typename T, typename Pred>
+            int compact(int n, T *odata, const T *idata, const Pred &pred) {
+                return blockedTwoPass<int>(n, 0, std::plus<int>(),
+                    [&](int begin, int end) {
+                        int count = 0;
+                        for (int i = begin; i < end; ++i) {
+                            count += pred(idata[i]) ? 1 : 0;
+                        }
+                        return count;
+                    },
+                    [&](int begin, int end, int offset) {
+                        for (int i = begin; i < end; ++i) {
+                            if (pred(idata[i])) {
+                                odata[offset++] = idata[i];
+                            }
+                        }
+                        return offset;
+                    });
+            }
+        }
+
+        /**
+         * Exclusive scan of idata with the associative operator op. odata may
+         * alias idata.
+         */
+        template <typename T, typename Op = std::plus<T>>
+        void scan(int n, T *odata, const T *idata, T identity = T(), const Op &op = Op()) {
+            timer().startCpuTimer();
+            detail::blockedTwoPass<T>(n, identity, op,
+                [&](int begin, int end) {
+                    T sum = identity;
+                    for (int i = begin; i < end; ++i) {
+                        sum = op(sum, idata[i]);
+                    }
+                    return sum;
+                },
+                [&](int begin, int end, T sum) {
+                    for (int i = begin; i < end; ++i) {
+                        T value = idata[i];
+                        odata[i] = sum;
+                        sum = op(sum, value);
+                    }
+                    return sum;
+                });
+            timer().endCpuTimer();
+        }
+
+        /**
+         * Stable stream compaction: copies the elements x of idata for which
+         * pred(x) holds to the front of odata, in order. odata must not alias
+         * idata.
+         *
+         * @returns the number of elements remaining after compaction.
+         */
+        template <typename T, typename Pred>
+        int compact(int n, T *odata, const T *idata, const Pred &pred) {
+            timer().startCpuTimer();
+            int count = detail::compact(n, odata, idata, pred);
+            timer().endCpuTimer();
+            return count;
+        }
+
+        /**
+         * Stable partition of data in place: elements for which pred holds
+         * come first. scratch must hold n elements. Usable on PathSegment
+         * arrays with pathRemains.
+         *
+         * @returns the number of elements for which pred holds.
+         */
+        template <typename T, typename Pred>
+        int partition(int n, T *data, T *scratch, const Pred &pred) {
+            timer().startCpuTimer();
+            int numTasks = std::max(1, std::min(numThreads(), n / serialThreshold));
+            int chunk = (n + numTasks - 1) / numTasks;
+
+            // falses can only be placed once the total number of trues is known,
+            // so count over the whole array first
+            std::vector<int> trueOffsets(numTasks + 1, 0);
+            auto countTask = [&](int t) {
+                int count = 0;
+                for (int i = t * chunk; i < std::min((t + 1) * chunk, n); ++i) {
+                    count += pred(data[i]) ? 1 : 0;
+                }
+                trueOffsets[t + 1] = count;
+            };
+            parallelFor(numTasks, countTask);
+            for (int t = 0; t < numTasks; ++t) {
+                trueOffsets[t + 1] += trueOffsets[t];
+            }
+            const int numTrue = trueOffsets[numTasks];
+
+            auto scatterTask = [&](int t) {
+                int begin = t * chunk;
+                int trueOut = trueOffsets[t];
+                int falseOut = numTrue + begin - trueOffsets[t];
+                for (int i = begin; i < std::min(begin + chunk, n); ++i) {
+                    if (pred(data[i])) {
+                        scratch[trueOut++] = data[i];
+                    } else {
+                        scratch[falseOut++] = data[i];
+                    }
+                }
+            };
+            parallelFor(numTasks, scatterTask);
+            detail::parallelCopy(n, data, scratch);
+            timer().endCpuTimer();
+            return numTrue;
+        }
+
+        /**
+         * Stable LSD radix sort of data by the unsigned key key(x), 8 bits per
+         * pass, using the lowest numBits bits of the key; higher bits are
+         * ignored. Passes in which all keys share a digit are skipped.
+         * scratch must hold n elements.
+         */
+        template <typename T, typename KeyFn>
+        void radixSort(int n, T *data, T *scratch, const KeyFn &key, int numBits = 32) {
+            timer().startCpuTimer();
+            const int radixBits = 8;
+            const int radix = 1 << radixBits;
+            int numTasks = std::max(1, std::min(numThreads(), n / serialThreshold));
+            int chunk = (n + numTasks - 1) / numTasks;
+            std::vector<int> histograms(numTasks * radix);
+
+            T *src = data;
+            T *dst = scratch;
+            for (int shift = 0; shift < numBits; shift += radixBits) {
+                // the last digit may be narrower than radixBits
+                const int digitMask = (1 << std::min(radixBits, numBits - shift)) - 1;
+                std::fill(histograms.begin(), histograms.end(), 0);
+                auto histogramTask = [&](int t) {
+                    int *histogram = &histograms[t * radix];
+                    for (int i = t * chunk; i < std::min((t + 1) * chunk, n); ++i) {
+                        histogram[(key(src[i]) >> shift) & digitMask]++;
+                    }
+                };
+                parallelFor(numTasks, histogramTask);
+
+                // offsets are digit-major, task-minor, which keeps the sort stable
+                int offset = 0;
+                bool singleDigit = false;
+                for (int d = 0; d < radix; ++d) {
+                    int digitBegin = offset;
+                    for (int t = 0; t < numTasks; ++t) {
+                        int count = histograms[t * radix + d];
+                        histograms[t * radix + d] = offset;
+                        offset += count;
+                    }
+                    singleDigit |= offset - digitBegin == n;
+                }
+                if (singleDigit) {
+                    continue;
+                }
+
+                auto scatterTask = [&](int t) {
+                    int *offsets = &histograms[t * radix];
+                    for (int i = t * chunk; i < std::min((t + 1) * chunk, n); ++i) {
+                        dst[offsets[(key(src[i]) >> shift) & digitMask]++] = src[i];
+                    }
+                };
+                parallelFor(numTasks, scatterTask);
+                std::swap(src, dst);
+            }
+
+            if (src != data) {
+                detail::parallelCopy(n, data, src);
+            }
+            timer().endCpuTimer();
+        }
+    }
+}
@@ -0,0 +1,31 @@
+#include <cuda.h>
+#include <cuda_runtime.h>
+#include "primitives.h"
+
+namespace StreamCompaction {
+    namespace Primitives {
+        Workspace createWorkspace(int capacity, bool onDevice) {
+            Workspace workspace;
+            workspace.capacity = capacity;
+            workspace.onDevice = onDevice;
+            if (onDevice) {
+                cudaMalloc((void**) &workspace.dev_indices, Efficient::scanDeviceSize(capacity) * sizeof(int));
+                cudaMalloc((void**) &workspace.dev_blockSums,
+                           std::max(1, Efficient::scanDeviceBlockSumsSize(capacity)) * sizeof(int));
+                cudaMallocHost((void**) &workspace.hst_count, sizeof(int));
+                cudaEventCreateWithFlags(&workspace.countReady, cudaEventDisableTiming);
+            }
+            return workspace;
+        }
+
+        void freeWorkspace(Workspace &workspace) {
+            cudaFree(workspace.dev_indices);
+            cudaFree(workspace.dev_blockSums);
+            cudaFreeHost(workspace.hst_count);
+            if (workspace.countReady) {
+                cudaEventDestroy(workspace.countReady);
+            }
+            workspace = Workspace();
+        }
+    }
+}
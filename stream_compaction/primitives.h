@@ -0,0 +1,205 @@
+#pragma once
+
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "efficient.h"
+#include "parallel.h"
+
+/**
+ * Templated compaction, partition and sort-by-key built on the shared-memory
+ * scan in efficient.cu. All scratch comes from a Workspace allocated once up
+ * front, so calls in a render loop don't allocate device memory. Only include
+ * this header from .cu files.
+ */
+namespace StreamCompaction {
+    namespace Primitives {
+        /**
+         * Scratch for up to capacity elements. A host workspace owns no device
+         * memory; the primitives then take host pointers and run the
+         * multithreaded fallbacks from parallel.h.
+         */
+        struct Workspace {
+            int capacity = 0;
+            bool onDevice = false;
+            // scanDeviceSize(capacity) ints
+            int *dev_indices = nullptr;
+            // scanDeviceBlockSumsSize(capacity) ints
+            int *dev_blockSums = nullptr;
+            // pinned; the count compact and partition read back
+            int *hst_count = nullptr;
+            cudaEvent_t countReady = nullptr;
+        };
+
+        Workspace createWorkspace(int capacity, bool onDevice = true);
+        void freeWorkspace(Workspace &workspace);
+
+        namespace detail {
+            const int blockSize = 128;
+
+            inline dim3 numBlocks(int n) {
+                return dim3((n + blockSize - 1) / blockSize);
+            }
+
+            template <typename T, typename Pred>
+            __global__ void kernMapToBoolean(int n, int *bools, const T *idata, Pred pred) {
+                int index = threadIdx.x + blockIdx.x * blockDim.x;
+                if (index < n) {
+                    bools[index] = pred(idata[index]) ? 1 : 0;
+                }
+            }
+
+            template <typename K>
+            __global__ void kernKeyBitIsZero(int n, int *bools, const K *keys, int bit) {
+                int index = threadIdx.x + blockIdx.x * blockDim.x;
+                if (index < n) {
+                    bools[index] = (keys[index] >> bit) & 1 ? 0 : 1;
+                }
+            }
+
+            // indices is the exclusive scan of the flags with the total at
+            // indices[n], so a flag is set iff indices[i + 1] != indices[i].
+            template <typename T>
+            __global__ void kernScatter(int n, T *odata, const T *idata, const int *indices) {
+                int index = threadIdx.x + blockIdx.x * blockDim.x;
+                if (index < n && indices[index + 1] != indices[index]) {
+                    odata[indices[index]] = idata[index];
+                }
+            }
+
+            __device__ inline int partitionIndex(int n, const int *indices, int index) {
+                int numTrue = indices[n];
+                return indices[index + 1] != indices[index] ? indices[index] : numTrue + index - indices[index];
+            }
+
+            template <typename T>
+            __global__ void kernPartition(int n, T *odata, const T *idata, const int *indices) {
+                int index = threadIdx.x + blockIdx.x * blockDim.x;
+                if (index < n) {
+                    odata[partitionIndex(n, indices, index)] = idata[index];
+                }
+            }
+
+            template <typename K, typename V>
+            __global__ void kernPartitionByKey(int n, K *okeys, V *ovalues, const K *ikeys, const V *ivalues,
+                                               const int *indices) {
+                int index = threadIdx.x + blockIdx.x * blockDim.x;
+                if (index < n) {
+                    int dst = partitionIndex(n, indices, index);
+                    okeys[dst] = ikeys[index];
+                    ovalues[dst] = ivalues[index];
+                }
+            }
+
+            // Queues the copy of the scan total to pinned memory. scanTotal
+            // then waits for that copy alone, not for work queued after it.
+            inline void readScanTotal(int n, const Workspace &workspace) {
+                cudaMemcpyAsync(workspace.hst_count, workspace.dev_indices + n, sizeof(int), cudaMemcpyDeviceToHost);
+                cudaEventRecord(workspace.countReady);
+            }
+
+            inline int scanTotal(const Workspace &workspace) {
+                cudaEventSynchronize(workspace.countReady);
+                return *workspace.hst_count;
+            }
+
+            struct PairKey {
+                template <typename P>
+                unsigned int operator()(const P &p) const {
+                    return (unsigned int)p.first;
+                }
+            };
+        }
+
+        /**
+         * Stable stream compaction: copies the elements x of idata for which
+         * pred(x) holds to the front of odata, in order. pred must be callable
+         * on the device. odata must not alias idata.
+         *
+         * @returns the number of elements remaining after compaction.
+         */
+        template <typename T, typename Pred>
+        int compact(int n, T *odata, const T *idata, const Pred &pred, const Workspace &workspace) {
+            if (!workspace.onDevice) {
+                return Parallel::compact(n, odata, idata, pred);
+            }
+            if (n <= 0) {
+                return 0;
+            }
+            detail::kernMapToBoolean<<<detail::numBlocks(n), detail::blockSize>>>(n, workspace.dev_indices, idata, pred);
+            Efficient::scanDevice(n, workspace.dev_indices, workspace.dev_blockSums);
+            detail::readScanTotal(n, workspace);
+            detail::kernScatter<<<detail::numBlocks(n), detail::blockSize>>>(n, odata, idata, workspace.dev_indices);
+            return detail::scanTotal(workspace);
+        }
+
+        /**
+         * Stable partition of data in place: elements for which pred holds
+         * come first. Works like thrust::partition on PathSegment arrays with
+         * pathRemains, but also keeps the order. scratch must hold n elements.
+         * The host only waits for the count, not for the partition itself.
+         *
+         * @returns the number of elements for which pred holds.
+         */
+        template <typename T, typename Pred>
+        int partition(int n, T *data, T *scratch, const Pred &pred, const Workspace &workspace) {
+            if (!workspace.onDevice) {
+                return Parallel::partition(n, data, scratch, pred);
+            }
+            if (n <= 0) {
+                return 0;
+            }
+            detail::kernMapToBoolean<<<detail::numBlocks(n), detail::blockSize>>>(n, workspace.dev_indices, data, pred);
+            Efficient::scanDevice(n, workspace.dev_indices, workspace.dev_blockSums);
+            detail::readScanTotal(n, workspace);
+            detail::kernPartition<<<detail::numBlocks(n), detail::blockSize>>>(n, scratch, data, workspace.dev_indices);
+            cudaMemcpyAsync(data, scratch, n * sizeof(T), cudaMemcpyDeviceToDevice);
+            return detail::scanTotal(workspace);
+        }
+
+        /**
+         * Stable LSD radix sort of keys and values by the lowest numBits bits
+         * of the integral keys, one bit per pass. Small key ranges (material
+         * ids) only pay for the bits they use. keysScratch and valuesScratch
+         * must hold n elements. Nothing is read back to the host, so the sort
+         * doesn't synchronize.
+         */
+        template <typename K, typename V>
+        void sortByKey(int n, K *keys, V *values, K *keysScratch, V *valuesScratch, int numBits,
+                       const Workspace &workspace) {
+            if (!workspace.onDevice) {
+                // the host sort moves whole elements, so pair the keys up
+                std::vector<std::pair<K, V>> pairs(n);
+                std::vector<std::pair<K, V>> pairsScratch(n);
+                for (int i = 0; i < n; ++i) {
+                    pairs[i] = std::make_pair(keys[i], values[i]);
+                }
+                Parallel::radixSort(n, pairs.data(), pairsScratch.data(), detail::PairKey(), numBits);
+                for (int i = 0; i < n; ++i) {
+                    keys[i] = pairs[i].first;
+                    values[i] = pairs[i].second;
+                }
+                return;
+            }
+            if (n <= 1) {
+                return;
+            }
+
+            K *srcKeys = keys, *dstKeys = keysScratch;
+            V *srcValues = values, *dstValues = valuesScratch;
+            for (int bit = 0; bit < numBits; ++bit) {
+                detail::kernKeyBitIsZero<<<detail::numBlocks(n), detail::blockSize>>>(n, workspace.dev_indices, srcKeys, bit);
+                Efficient::scanDevice(n, workspace.dev_indices, workspace.dev_blockSums);
+                detail::kernPartitionByKey<<<detail::numBlocks(n), detail::blockSize>>>
+                    (n, dstKeys, dstValues, srcKeys, srcValues, workspace.dev_indices);
+                std::swap(srcKeys, dstKeys);
+                std::swap(srcValues, dstValues);
+            }
+            if (srcKeys != keys) {
+                cudaMemcpyAsync(keys, srcKeys, n * sizeof(K), cudaMemcpyDeviceToDevice);
+                cudaMemcpyAsync(values, srcValues, n * sizeof(V), cudaMemcpyDeviceToDevice);
+            }
+        }
+    }
+}